@@ -175,8 +175,8 @@ ST_DATA const int reg_classes[NB_REGS] = {
 ST_DATA CType float_type, double_type, func_float_type, func_double_type;
 #endif
 
-static int func_sub_sp_offset, last_itod_magic;
-static int leaffunc;
+static ST_TLS int func_sub_sp_offset, last_itod_magic;
+static ST_TLS int leaffunc;
 
 static int two2mask(int a,int b) {
   return (reg_classes[a]|reg_classes[b])&~(RC_INT|RC_FLOAT);
@@ -0,0 +1,144 @@
+/// @file bench.cc
+/// Measure the throughput and latency of the tinycc demo with the Linux
+/// stand-in for Pepper.  Each request runs a small program which reads a
+/// number from its stdin and prints it back, so that a response can be
+/// matched with its request and checked.
+///
+/// Usage: bench [-n requests] [-c concurrency] [-j workers] [-w work]
+///              [-k cache entries]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/var.h"
+#include "nacl-mounts/base/MainThreadRunner.h"
+
+using namespace std;
+
+static const char kProgram[] =
+    "#include <stdio.h>\n"
+    "int main() {\n"
+    "    int id, i, s = 0;\n"
+    "    scanf(\"%%d\", &id);\n"
+    "    for (i = 0; i < %d; i++)\n"
+    "        s += i %% 7;\n"
+    "    printf(\"%%d %%d\\n\", id, s);\n"
+    "    return 0;\n"
+    "}\n";
+
+static string status;
+static vector<double> sent_at;
+static vector<double> latencies;
+static int num_received;
+static int num_bad;
+static int expected_sum;
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void HandleMessage(const pp::Var& message) {
+  const string& msg = message.AsString();
+  if (msg.compare(0, 7, "status:") == 0) {
+    status = msg.substr(7);
+    return;
+  }
+  num_received++;
+  int id, sum;
+  const char* p = strstr(msg.c_str(), "=== STDOUT ===\n");
+  if (!p || sscanf(p + 15, "%d %d", &id, &sum) != 2 ||
+      id < 0 || id >= (int)sent_at.size() || sum != expected_sum) {
+    if (num_bad++ < 3)
+      fprintf(stderr, "unexpected response:\n%s\n", msg.c_str());
+    return;
+  }
+  latencies.push_back(Now() - sent_at[id]);
+}
+
+static string Arg(const string& s) {
+  char buf[32];
+  sprintf(buf, "%d ", (int)s.size());
+  return buf + s;
+}
+
+int main(int argc, char* argv[]) {
+  int num_requests = 200;
+  int concurrency = 8;
+  const char* workers = "4";
+  int work = 100000;
+  const char* cache = "64";
+  int c;
+  while ((c = getopt(argc, argv, "n:c:j:w:k:")) != -1) {
+    switch (c) {
+    case 'n': num_requests = atoi(optarg); break;
+    case 'c': concurrency = atoi(optarg); break;
+    case 'j': workers = optarg; break;
+    case 'w': work = atoi(optarg); break;
+    case 'k': cache = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-n requests] [-c concurrency] "
+              "[-j workers] [-w work] [-k cache entries]\n", argv[0]);
+      return 1;
+    }
+  }
+  for (int i = 0; i < work; i++)
+    expected_sum += i % 7;
+  char code[1024];
+  snprintf(code, sizeof(code), kProgram, work);
+
+  pp::Instance::SetMessageHandler(&HandleMessage);
+  pp::Module* module = pp::CreateModule();
+  pp::Instance* instance = module->CreateInstance(1);
+  const char* argn[] = { "workers", "cache" };
+  const char* argval[] = { workers, cache };
+  instance->Init(2, argn, argval);
+  while (status.compare(0, 5, "READY") != 0) {
+    MainThreadRunner::RunPendingJobs(true);
+    if (status.find("FAILED") != string::npos) {
+      fprintf(stderr, "%s\n", status.c_str());
+      return 1;
+    }
+  }
+
+  double start = Now();
+  while (num_received < num_requests) {
+    while ((int)sent_at.size() < num_requests &&
+           (int)sent_at.size() - num_received < concurrency) {
+      char id[16];
+      sprintf(id, "%d", (int)sent_at.size());
+      sent_at.push_back(Now());
+      instance->HandleMessage(pp::Var("run:" + Arg(code) + Arg(id)));
+    }
+    MainThreadRunner::RunPendingJobs(true);
+  }
+  double elapsed = Now() - start;
+  delete instance;
+
+  sort(latencies.begin(), latencies.end());
+  double total = 0;
+  for (size_t i = 0; i < latencies.size(); i++)
+    total += latencies[i];
+  printf("workers %s, cache %s, concurrency %d: %d requests in %.3fs "
+         "(%.1f/s)\n", workers, cache, concurrency, num_requests, elapsed,
+         num_requests / elapsed);
+  if (!latencies.empty()) {
+    size_t n = latencies.size();
+    printf("latency ms: mean %.2f, p50 %.2f, p90 %.2f, max %.2f\n",
+           total / n * 1e3, latencies[n / 2] * 1e3,
+           latencies[n * 9 / 10] * 1e3, latencies[n - 1] * 1e3);
+  }
+  if (num_bad)
+    printf("%d bad responses\n", num_bad);
+  return num_bad != 0;
+}
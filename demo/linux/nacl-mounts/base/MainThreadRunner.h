@@ -0,0 +1,48 @@
+// Linux stand-in for the MainThreadRunner of nacl-mounts.  RunJob() queues
+// a job for the main thread and waits for its completion;
+// MainThreadRunner::RunPendingJobs() is the main thread's side of it.
+#ifndef TINYCC_LINUX_NACL_MOUNTS_BASE_MAINTHREADRUNNER_H_
+#define TINYCC_LINUX_NACL_MOUNTS_BASE_MAINTHREADRUNNER_H_
+
+#include <pthread.h>
+
+#include "ppapi/cpp/instance.h"
+
+class MainThreadJob;
+
+class MainThreadRunner {
+ public:
+  struct JobEntry {
+    MainThreadJob* job;
+    pp::Instance* instance;
+    bool done;
+    int32_t result;
+    JobEntry* next;
+  };
+
+  explicit MainThreadRunner(pp::Instance* instance) : instance_(instance) {}
+
+  /// Run @a job on the main thread and return its result.  The job is
+  /// deleted once it has completed.
+  int32_t RunJob(MainThreadJob* job);
+
+  static pp::Instance* ExtractPepperInstance(JobEntry* entry) {
+    return entry->instance;
+  }
+  static void ResultCompletion(JobEntry* entry, int32_t result);
+
+  /// Run the jobs queued for the main thread, waiting for one if
+  /// @a wait is set.  Returns the number of jobs run.
+  static int RunPendingJobs(bool wait);
+
+ private:
+  pp::Instance* instance_;
+};
+
+class MainThreadJob {
+ public:
+  virtual ~MainThreadJob() {}
+  virtual void Run(MainThreadRunner::JobEntry* entry) = 0;
+};
+
+#endif  // TINYCC_LINUX_NACL_MOUNTS_BASE_MAINTHREADRUNNER_H_
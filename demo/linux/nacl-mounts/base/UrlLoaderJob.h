@@ -0,0 +1,23 @@
+// Linux stand-in for the UrlLoaderJob of nacl-mounts: the URL is read as a
+// local file, and a missing file gives no data.
+#ifndef TINYCC_LINUX_NACL_MOUNTS_BASE_URLLOADERJOB_H_
+#define TINYCC_LINUX_NACL_MOUNTS_BASE_URLLOADERJOB_H_
+
+#include <string>
+#include <vector>
+
+#include "nacl-mounts/base/MainThreadRunner.h"
+
+class UrlLoaderJob : public MainThreadJob {
+ public:
+  UrlLoaderJob() : dst_(NULL) {}
+  void set_url(const std::string& url) { url_ = url; }
+  void set_dst(std::vector<char>* dst) { dst_ = dst; }
+  virtual void Run(MainThreadRunner::JobEntry* entry);
+
+ private:
+  std::string url_;
+  std::vector<char>* dst_;
+};
+
+#endif  // TINYCC_LINUX_NACL_MOUNTS_BASE_URLLOADERJOB_H_
@@ -0,0 +1,9 @@
+// Linux stand-in for the MemMount of nacl-mounts: the host file system is
+// used directly.
+#ifndef TINYCC_LINUX_NACL_MOUNTS_MEMORY_MEMMOUNT_H_
+#define TINYCC_LINUX_NACL_MOUNTS_MEMORY_MEMMOUNT_H_
+
+class MemMount {
+};
+
+#endif  // TINYCC_LINUX_NACL_MOUNTS_MEMORY_MEMMOUNT_H_
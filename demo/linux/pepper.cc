@@ -0,0 +1,111 @@
+/// @file pepper.cc
+/// A native Linux stand-in for the parts of Pepper and nacl-mounts used by
+/// tinycc.cc, so that the demo can be run and benchmarked without a browser.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "ppapi/cpp/instance.h"
+#include "nacl-mounts/base/MainThreadRunner.h"
+#include "nacl-mounts/base/UrlLoaderJob.h"
+
+static pp::Instance::MessageHandler message_handler;
+
+// The jobs queued for the main thread, guarded by jobs_lock.
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static MainThreadRunner::JobEntry* jobs_head;
+static MainThreadRunner::JobEntry* jobs_tail;
+
+namespace pp {
+
+void Instance::PostMessage(const Var& message) {
+  if (message_handler)
+    message_handler(message);
+}
+
+void Instance::SetMessageHandler(MessageHandler handler) {
+  message_handler = handler;
+}
+
+}  // namespace pp
+
+int32_t MainThreadRunner::RunJob(MainThreadJob* job) {
+  JobEntry entry;
+  entry.job = job;
+  entry.instance = instance_;
+  entry.done = false;
+  entry.result = 0;
+  entry.next = NULL;
+
+  pthread_mutex_lock(&jobs_lock);
+  if (jobs_tail)
+    jobs_tail->next = &entry;
+  else
+    jobs_head = &entry;
+  jobs_tail = &entry;
+  pthread_cond_broadcast(&jobs_cond);
+  while (!entry.done)
+    pthread_cond_wait(&jobs_cond, &jobs_lock);
+  pthread_mutex_unlock(&jobs_lock);
+
+  delete job;
+  return entry.result;
+}
+
+void MainThreadRunner::ResultCompletion(JobEntry* entry, int32_t result) {
+  pthread_mutex_lock(&jobs_lock);
+  entry->result = result;
+  entry->done = true;
+  pthread_cond_broadcast(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+int MainThreadRunner::RunPendingJobs(bool wait) {
+  pthread_mutex_lock(&jobs_lock);
+  while (wait && !jobs_head)
+    pthread_cond_wait(&jobs_cond, &jobs_lock);
+  JobEntry* entry = jobs_head;
+  jobs_head = jobs_tail = NULL;
+  pthread_mutex_unlock(&jobs_lock);
+
+  int n = 0;
+  while (entry) {
+    // The entry belongs to the waiting thread once the job completes.
+    JobEntry* next = entry->next;
+    entry->job->Run(entry);
+    entry = next;
+    n++;
+  }
+  return n;
+}
+
+void UrlLoaderJob::Run(MainThreadRunner::JobEntry* entry) {
+  dst_->clear();
+  FILE* fp = fopen(url_.c_str(), "rb");
+  if (fp) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      dst_->insert(dst_->end(), buf, buf + n);
+    fclose(fp);
+  }
+  MainThreadRunner::ResultCompletion(entry, fp ? 0 : -1);
+}
+
+/// Extract the tar file @a path into the current directory.  Without a
+/// data.tar the archive is empty, and tcc uses the headers of the host.
+extern "C" int simple_tar_extract(const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return -1;
+  if (st.st_size == 0)
+    return 0;
+  std::string cmd = std::string("tar xf '") + path + "'";
+  return system(cmd.c_str()) == 0 ? 0 : -1;
+}
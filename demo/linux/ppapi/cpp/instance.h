@@ -0,0 +1,38 @@
+// Linux stand-in for the Pepper pp::Instance.  Messages posted by the
+// instance are handed to the function set with SetMessageHandler(), on the
+// thread which posts them (the main thread, as with Pepper).
+#ifndef TINYCC_LINUX_PPAPI_CPP_INSTANCE_H_
+#define TINYCC_LINUX_PPAPI_CPP_INSTANCE_H_
+
+#include <stdint.h>
+
+#include "ppapi/cpp/var.h"
+
+typedef int PP_Instance;
+
+namespace pp {
+
+class Instance {
+ public:
+  explicit Instance(PP_Instance instance) : pp_instance_(instance) {}
+  virtual ~Instance() {}
+
+  virtual bool Init(uint32_t argc, const char* argn[], const char* argv[]) {
+    return true;
+  }
+  virtual void HandleMessage(const Var& message) {}
+
+  void PostMessage(const Var& message);
+
+  PP_Instance pp_instance() const { return pp_instance_; }
+
+  typedef void (*MessageHandler)(const Var& message);
+  static void SetMessageHandler(MessageHandler handler);
+
+ private:
+  PP_Instance pp_instance_;
+};
+
+}  // namespace pp
+
+#endif  // TINYCC_LINUX_PPAPI_CPP_INSTANCE_H_
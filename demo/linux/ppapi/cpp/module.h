@@ -0,0 +1,21 @@
+// Linux stand-in for the Pepper pp::Module.
+#ifndef TINYCC_LINUX_PPAPI_CPP_MODULE_H_
+#define TINYCC_LINUX_PPAPI_CPP_MODULE_H_
+
+#include "ppapi/cpp/instance.h"
+
+namespace pp {
+
+class Module {
+ public:
+  Module() {}
+  virtual ~Module() {}
+  virtual Instance* CreateInstance(PP_Instance instance) = 0;
+};
+
+/// Implemented by the module, as with Pepper.
+Module* CreateModule();
+
+}  // namespace pp
+
+#endif  // TINYCC_LINUX_PPAPI_CPP_MODULE_H_
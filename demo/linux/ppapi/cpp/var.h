@@ -0,0 +1,28 @@
+// Linux stand-in for the Pepper pp::Var: only strings are supported.
+#ifndef TINYCC_LINUX_PPAPI_CPP_VAR_H_
+#define TINYCC_LINUX_PPAPI_CPP_VAR_H_
+
+#include <string>
+
+namespace pp {
+
+class Var {
+ public:
+  Var() : is_string_(false) {}
+  Var(const char* s) : is_string_(true), s_(s) {}
+  Var(const std::string& s) : is_string_(true), s_(s) {}
+
+  bool is_string() const { return is_string_; }
+  std::string AsString() const { return s_; }
+  std::string DebugString() const {
+    return is_string_ ? s_ : std::string("undefined");
+  }
+
+ private:
+  bool is_string_;
+  std::string s_;
+};
+
+}  // namespace pp
+
+#endif  // TINYCC_LINUX_PPAPI_CPP_VAR_H_
@@ -19,12 +19,27 @@
 /// to be handled.  This has implications in your program design, particularly
 /// when mutating property values that are exposed to both the browser and the
 /// NaCl module.
-
+///
+/// Compiling and running a program can take a while, so HandleMessage() only
+/// queues the request.  A pool of worker threads takes requests from the
+/// queue, compiles them with their own TCCState and posts the result back
+/// through the MainThreadRunner.  Results are posted in the order the
+/// requests complete.
+
+#include <assert.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <vector>
@@ -41,11 +56,134 @@
 
 using namespace std;
 
+/// The directory under which the data is extracted and the per-request
+/// files are written.  The Linux stand-in (see linux/) points it to a
+/// scratch directory.
+#ifndef TINYCC_ROOT
+#define TINYCC_ROOT ""
+#endif
+
+/// The number of worker threads, unless the <embed> tag has a "workers"
+/// attribute.
+static const int kDefaultWorkers = 4;
+
+/// The number of compiled programs kept by libtcc, unless the <embed> tag
+/// has a "cache" attribute (0 turns the cache off).
+static const int kDefaultCacheEntries = 64;
+
 extern "C" int mount(const char *type, const char *dir, int flags, void *data);
 extern "C" int umount(const char *path);
 extern "C" int simple_tar_extract(const char *path);
 
 static void* InitFileSystemThread(void* data);
+static void* WorkerThread(void* data);
+
+/// The standard streams of a program run by tcc_run().  They are bound to
+/// the files of the request which runs it, so that the workers do not have
+/// to redirect the file descriptors 0-2 of the whole process.
+#if defined(_NEWLIB_VERSION) && defined(__DYNAMIC_REENT__)
+/// newlib keeps the standard streams in the reentrancy structure of each
+/// thread, so a worker only has to switch its own.  The streams must have
+/// been opened by this thread before: the first stdio call of a thread
+/// initializes its structure, which would reset them.
+class ScopedStdio {
+ public:
+  ScopedStdio(TCCState* s1, FILE* in, FILE* out, FILE* err) {
+    struct _reent* r = _REENT;
+    saved_[0] = r->_stdin;
+    saved_[1] = r->_stdout;
+    saved_[2] = r->_stderr;
+    r->_stdin = in;
+    r->_stdout = out;
+    r->_stderr = err;
+  }
+  ~ScopedStdio() {
+    struct _reent* r = _REENT;
+    r->_stdin = saved_[0];
+    r->_stdout = saved_[1];
+    r->_stderr = saved_[2];
+  }
+ private:
+  FILE* saved_[3];
+};
+#else
+/// Elsewhere the standard streams are shared by all threads.  The program's
+/// references to stdin, stdout and stderr, and to the functions which use
+/// them implicitly, are bound to the streams of the running worker instead.
+static __thread FILE* tls_stdio[3];
+
+static int StdioPrintf(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int r = vfprintf(tls_stdio[1], fmt, ap);
+  va_end(ap);
+  return r;
+}
+
+static int StdioVprintf(const char* fmt, va_list ap) {
+  return vfprintf(tls_stdio[1], fmt, ap);
+}
+
+static int StdioPuts(const char* s) {
+  if (fputs(s, tls_stdio[1]) < 0)
+    return EOF;
+  return fputc('\n', tls_stdio[1]);
+}
+
+static int StdioPutchar(int c) {
+  return fputc(c, tls_stdio[1]);
+}
+
+static int StdioGetchar() {
+  return fgetc(tls_stdio[0]);
+}
+
+static int StdioScanf(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int r = vfscanf(tls_stdio[0], fmt, ap);
+  va_end(ap);
+  return r;
+}
+
+static int StdioVscanf(const char* fmt, va_list ap) {
+  return vfscanf(tls_stdio[0], fmt, ap);
+}
+
+static void StdioPerror(const char* s) {
+  const char* msg = strerror(errno);
+  if (s && *s)
+    fprintf(tls_stdio[2], "%s: %s\n", s, msg);
+  else
+    fprintf(tls_stdio[2], "%s\n", msg);
+}
+
+class ScopedStdio {
+ public:
+  ScopedStdio(TCCState* s1, FILE* in, FILE* out, FILE* err) {
+    tls_stdio[0] = in;
+    tls_stdio[1] = out;
+    tls_stdio[2] = err;
+    tcc_add_symbol(s1, "stdin", &tls_stdio[0]);
+    tcc_add_symbol(s1, "stdout", &tls_stdio[1]);
+    tcc_add_symbol(s1, "stderr", &tls_stdio[2]);
+    tcc_add_symbol(s1, "printf", (void*)&StdioPrintf);
+    tcc_add_symbol(s1, "vprintf", (void*)&StdioVprintf);
+    tcc_add_symbol(s1, "puts", (void*)&StdioPuts);
+    tcc_add_symbol(s1, "putchar", (void*)&StdioPutchar);
+    tcc_add_symbol(s1, "getchar", (void*)&StdioGetchar);
+    tcc_add_symbol(s1, "scanf", (void*)&StdioScanf);
+    tcc_add_symbol(s1, "vscanf", (void*)&StdioVscanf);
+    // glibc's headers redirect these in C99 mode
+    tcc_add_symbol(s1, "__isoc99_scanf", (void*)&StdioScanf);
+    tcc_add_symbol(s1, "__isoc99_vscanf", (void*)&StdioVscanf);
+    tcc_add_symbol(s1, "perror", (void*)&StdioPerror);
+  }
+  ~ScopedStdio() {
+    tls_stdio[0] = tls_stdio[1] = tls_stdio[2] = NULL;
+  }
+};
+#endif
 
 /// The Instance class.  One of these exists for each instance of your NaCl
 /// module on the web page.  The browser will ask the Module object to create
@@ -62,7 +200,10 @@ class TinyccInstance : public pp::Instance {
   /// @param[in] instance the handle to the browser-side plugin instance.
   explicit TinyccInstance(PP_Instance instance)
     : pp::Instance(instance),
-      id_(0) {
+      id_(0),
+      quit_(false) {
+    pthread_mutex_init(&queue_lock_, NULL);
+    pthread_cond_init(&queue_cond_, NULL);
     PostMessage(pp::Var("status:INITIALIZED"));
   }
 
@@ -70,10 +211,34 @@ class TinyccInstance : public pp::Instance {
     runner_.reset(new MainThreadRunner(this));
     pthread_t th;
     pthread_create(&th, NULL, &InitFileSystemThread, this);
+
+    int num_workers = kDefaultWorkers;
+    int cache_entries = kDefaultCacheEntries;
+    for (uint32_t i = 0; i < argc; i++) {
+      if (!strcmp(argn[i], "workers") && atoi(argv[i]) > 0)
+        num_workers = atoi(argv[i]);
+      if (!strcmp(argn[i], "cache") && atoi(argv[i]) >= 0)
+        cache_entries = atoi(argv[i]);
+    }
+    tcc_set_compile_cache(cache_entries, NULL);
+    for (int i = 0; i < num_workers; i++) {
+      pthread_create(&th, NULL, &WorkerThread, this);
+      workers_.push_back(th);
+    }
     return true;
   }
 
   virtual ~TinyccInstance() {
+    pthread_mutex_lock(&queue_lock_);
+    quit_ = true;
+    pthread_cond_broadcast(&queue_cond_);
+    pthread_mutex_unlock(&queue_lock_);
+    for (size_t i = 0; i < workers_.size(); i++)
+      pthread_join(workers_[i], NULL);
+    for (size_t i = 0; i < queue_.size(); i++)
+      delete queue_[i];
+    pthread_cond_destroy(&queue_cond_);
+    pthread_mutex_destroy(&queue_lock_);
   }
 
   /// Handler for messages coming in from the browser via postMessage().  The
@@ -93,11 +258,11 @@ class TinyccInstance : public pp::Instance {
       return;
     }
 
-    errors_.clear();
     const string& msg = var_message.AsString();
     size_t colon_offset = msg.find(':');
     if (colon_offset == string::npos) {
       PostMessage(pp::Var("invalid command: " + var_message.DebugString()));
+      return;
     }
 
     const string& cmd = msg.substr(0, colon_offset);
@@ -113,160 +278,19 @@ class TinyccInstance : public pp::Instance {
       return;
     }
 
-    string code, stdin_contents;
-    ParseStringArgs(msg.c_str() + colon_offset + 1, &code, &stdin_contents);
-
-    close(0);
-    close(1);
-    close(2);
-    int fd;
-    char stdin_filename[256];
-    sprintf(stdin_filename, "/tmp/stdin%d.txt", id_);
-    fd = open(stdin_filename, O_WRONLY | O_CREAT | O_TRUNC);
-    write(fd, stdin_contents.data(), stdin_contents.size());
-    close(fd);
-    fd = open(stdin_filename, O_RDONLY);
-    assert(fd == 0);
-    char stdout_filename[256];
-    sprintf(stdout_filename, "/tmp/stdout%d.txt", id_);
-    fd = open(stdout_filename, O_WRONLY | O_CREAT | O_TRUNC);
-    assert(fd == 1);
-    char stderr_filename[256];
-    sprintf(stderr_filename, "/tmp/stderr%d.txt", id_);
-    fd = open(stderr_filename, O_WRONLY | O_CREAT | O_TRUNC);
-    assert(fd == 2);
-
-    char input_filename[256];
-    sprintf(input_filename, "/tmp/input%d.c", id_++);
-    fd = open(input_filename, O_WRONLY | O_CREAT | O_TRUNC);
-    assert(fd >= 0);
-    write(fd, code.data(), code.size());
-    close(fd);
-
-    ScopedTCCState tcc_state;
-    TCCState* s1 = tcc_state.get();
-    tcc_set_error_func(s1, this, &TinyccInstance::HandleTCCError);
-    tcc_set_output_type(s1, output_type);
-    tcc_add_include_path(s1, "/data/usr/include");
-    tcc_add_include_path(s1, "/data/usr/lib/tcc/include");
-    FILE* fp = NULL;
-    if (output_type == TCC_OUTPUT_PREPROCESS) {
-      fp = fopen("/tmp/out", "wb");
-      tcc_set_outfile(s1, fp);
-    }
-    tcc_add_file(s1, input_filename);
-    if (output_type == TCC_OUTPUT_OBJ) {
-      tcc_output_file(s1, "/tmp/out");
-    }
-
-    int status = -1;
-    if (errors_.empty() && output_type == TCC_OUTPUT_MEMORY) {
-      char* argv[] = {
-        (char*)"./a.out", NULL
-      };
-      status = tcc_run(s1, 1, argv);
-    }
-
-    string out;
-
-    unlink(input_filename);
-
-    close(0);
-    close(1);
-    close(2);
-
-    if (errors_.empty()) {
-      fd = open(stdout_filename, O_RDONLY);
-      if (fd >= 0) {
-        string o;
-        ReadFromFD(fd, &o);
-        if (!o.empty()) {
-          out += "=== STDOUT ===\n";
-          out += o;
-        }
-      }
-      close(fd);
-      unlink(stdout_filename);
-      fd = open(stderr_filename, O_RDONLY);
-      if (fd >= 0) {
-        string o;
-        ReadFromFD(fd, &o);
-        if (!o.empty()) {
-          out += "=== STDERR ===\n";
-          out += o;
-        }
-      }
-      close(fd);
-      unlink(stderr_filename);
-      if (output_type == TCC_OUTPUT_MEMORY) {
-        out += "=== EXIT STATUS ===\n";
-        char buf[256];
-        sprintf(buf, "%d\n", status);
-        out += buf;
-      }
-    } else {
-      out += "=== COMPILE ERROR ===\n";
-      for (size_t i = 0; i < errors_.size(); i++) {
-          out += errors_[i];
-          out += '\n';
-      }
-    }
-
-    if (output_type == TCC_OUTPUT_OBJ ||
-        output_type == TCC_OUTPUT_PREPROCESS) {
-      if (!out.empty()) {
-        out += "\n=== OUTPUT ===\n";
-      }
-
-      if (output_type == TCC_OUTPUT_PREPROCESS) {
-        fclose(fp);
-      }
-      int fd = open("/tmp/out", O_RDONLY);
-      if (fd < 0) {
-        PostMessage(pp::Var(
-                      string("failed to read output: ") + strerror(errno)));
-        return;
-      }
-      string o;
-      ReadFromFD(fd, &o);
-
-      if (output_type == TCC_OUTPUT_PREPROCESS) {
-        PostMessageChecked(out + o);
-      } else {
-        string hex;
-        char buf[20];
-        for (int i = 0; i < (int)o.size(); i += 16) {
-          sprintf(buf, "%07x:", i);
-          hex += buf;
-          for (int j = 0; j < 16; j++) {
-            if (j % 2 == 0)
-              hex += ' ';
-            if (i + j < (int)o.size()) {
-              sprintf(buf, "%02x", (unsigned char)o[i+j]);
-              hex += buf;
-            }
-          }
-          hex += "  ";
-          for (int j = 0; j < 16 && i + j < (int)o.size(); j++) {
-            char c = o[i+j];
-            if (isprint(c))
-              hex += c;
-            else
-              hex += '.';
-          }
-          hex += "\n";
-        }
-        PostMessageChecked(out + hex);
-      }
-      return;
-    }
+    Request* req = new Request(id_++, output_type);
+    ParseStringArgs(msg.c_str() + colon_offset + 1,
+                    &req->code, &req->stdin_contents);
 
-    PostMessageChecked(out);
+    pthread_mutex_lock(&queue_lock_);
+    queue_.push_back(req);
+    pthread_cond_signal(&queue_cond_);
+    pthread_mutex_unlock(&queue_lock_);
   }
 
   static void HandleTCCError(void* data, const char* msg) {
-    TinyccInstance* self = (TinyccInstance*)data;
-    self->errors_.push_back(msg);
+    Request* req = (Request*)data;
+    req->errors.push_back(msg);
   }
 
   void InitFileSystem() {
@@ -278,7 +302,8 @@ class TinyccInstance : public pp::Instance {
     runner_->RunJob(job);
 
     PostMessageFromThread("status:WRITING DATA");
-    int fd = open("/data.tar", O_CREAT | O_WRONLY);
+    mkdir(TINYCC_ROOT, 0777);
+    int fd = open(TINYCC_ROOT "/data.tar", O_CREAT | O_WRONLY, 0666);
     if (fd < 0) {
       PostMessageFromThread("status:WRITE DATA FAILED");
       return;
@@ -286,11 +311,11 @@ class TinyccInstance : public pp::Instance {
     write(fd, &data[0], data.size());
     close(fd);
 
-    mkdir("/tmp", 0777);
-    mkdir("/data", 0777);
-    chdir("/data");
+    mkdir(TINYCC_ROOT "/tmp", 0777);
+    mkdir(TINYCC_ROOT "/data", 0777);
+    chdir(TINYCC_ROOT "/data");
     PostMessageFromThread("status:EXTRACTING DATA");
-    int r = simple_tar_extract("/data.tar");
+    int r = simple_tar_extract(TINYCC_ROOT "/data.tar");
     if (r != 0) {
       PostMessageFromThread("status:EXTRACT DATA FAILED");
     }
@@ -302,7 +327,39 @@ class TinyccInstance : public pp::Instance {
 #endif
   }
 
+  /// The loop of a worker thread: take the next request from the queue,
+  /// process it and post its result, until the instance goes away.
+  void RunWorker() {
+    for (;;) {
+      pthread_mutex_lock(&queue_lock_);
+      while (queue_.empty() && !quit_)
+        pthread_cond_wait(&queue_cond_, &queue_lock_);
+      if (quit_) {
+        pthread_mutex_unlock(&queue_lock_);
+        return;
+      }
+      Request* req = queue_.front();
+      queue_.pop_front();
+      pthread_mutex_unlock(&queue_lock_);
+
+      string out = ProcessRequest(req);
+      delete req;
+      PostMessageFromThread(out.empty() ? "=== NO OUTPUT ===" : out);
+    }
+  }
+
 private:
+  /// A compile request, and what was collected while processing it.
+  struct Request {
+    Request(int id, int output_type)
+      : id(id), output_type(output_type) {}
+    int id;
+    int output_type;
+    string code;
+    string stdin_contents;
+    vector<string> errors;
+  };
+
   class PostMessageJob : public MainThreadJob {
   public:
     PostMessageJob(const string& msg) : msg_(msg) {}
@@ -330,11 +387,143 @@ private:
     TCCState* s1_;
   };
 
-  void PostMessageChecked(const string& msg) {
-    if (msg.empty())
-      PostMessage("=== NO OUTPUT ===");
-    else
-      PostMessage(pp::Var(msg));
+  /// Compile (and run) a request on the current thread and return the text
+  /// to post back.
+  string ProcessRequest(Request* req) {
+    int output_type = req->output_type;
+    char input_filename[256];
+    sprintf(input_filename, TINYCC_ROOT "/tmp/input%d.c", req->id);
+    char output_filename[256];
+    sprintf(output_filename, TINYCC_ROOT "/tmp/out%d", req->id);
+
+    ScopedTCCState tcc_state;
+    TCCState* s1 = tcc_state.get();
+    tcc_set_error_func(s1, req, &TinyccInstance::HandleTCCError);
+    tcc_set_output_type(s1, output_type);
+    tcc_add_include_path(s1, TINYCC_ROOT "/data/usr/include");
+    tcc_add_include_path(s1, TINYCC_ROOT "/data/usr/lib/tcc/include");
+    if (output_type == TCC_OUTPUT_PREPROCESS) {
+      if (!WriteToFile(input_filename, req->code))
+        return string("failed to write input: ") + strerror(errno);
+      FILE* fp = fopen(output_filename, "wb");
+      tcc_set_outfile(s1, fp);
+      tcc_add_file(s1, input_filename);
+      unlink(input_filename);
+      fclose(fp);
+    } else {
+      // Compiled from memory, a resubmitted program is found in the
+      // compile cache whatever its request id.
+      tcc_compile_string(s1, req->code.c_str());
+    }
+    if (output_type == TCC_OUTPUT_OBJ) {
+      tcc_output_file(s1, output_filename);
+    }
+
+    string out;
+    if (!req->errors.empty()) {
+      out += "=== COMPILE ERROR ===\n";
+      for (size_t i = 0; i < req->errors.size(); i++) {
+          out += req->errors[i];
+          out += '\n';
+      }
+    } else if (output_type == TCC_OUTPUT_MEMORY) {
+      RunProgram(s1, req, &out);
+    }
+
+    if (output_type == TCC_OUTPUT_OBJ ||
+        output_type == TCC_OUTPUT_PREPROCESS) {
+      if (!out.empty()) {
+        out += "\n=== OUTPUT ===\n";
+      }
+
+      string o;
+      bool ok = ReadFromFile(output_filename, &o);
+      unlink(output_filename);
+      if (!ok)
+        return string("failed to read output: ") + strerror(errno);
+
+      if (output_type == TCC_OUTPUT_PREPROCESS) {
+        out += o;
+      } else {
+        out += HexDump(o);
+      }
+    }
+    return out;
+  }
+
+  /// Run the program compiled in @a s1 with the stdin of @a req, and append
+  /// its output and exit status to @a out.
+  void RunProgram(TCCState* s1, Request* req, string* out) {
+    char stdin_filename[256];
+    sprintf(stdin_filename, TINYCC_ROOT "/tmp/stdin%d.txt", req->id);
+    char stdout_filename[256];
+    sprintf(stdout_filename, TINYCC_ROOT "/tmp/stdout%d.txt", req->id);
+    char stderr_filename[256];
+    sprintf(stderr_filename, TINYCC_ROOT "/tmp/stderr%d.txt", req->id);
+    WriteToFile(stdin_filename, req->stdin_contents);
+    FILE* in = fopen(stdin_filename, "rb");
+    FILE* o = fopen(stdout_filename, "w+b");
+    FILE* e = fopen(stderr_filename, "w+b");
+    if (in && o && e) {
+      ScopedStdio stdio(s1, in, o, e);
+      char* argv[] = {
+        (char*)"./a.out", NULL
+      };
+      int status = tcc_run(s1, 1, argv);
+
+      string s;
+      ReadFromStream(o, &s);
+      if (!s.empty()) {
+        *out += "=== STDOUT ===\n";
+        *out += s;
+      }
+      ReadFromStream(e, &s);
+      if (!s.empty()) {
+        *out += "=== STDERR ===\n";
+        *out += s;
+      }
+      *out += "=== EXIT STATUS ===\n";
+      char buf[256];
+      sprintf(buf, "%d\n", status);
+      *out += buf;
+    } else {
+      *out += string("failed to open the standard streams: ") +
+          strerror(errno) + "\n";
+    }
+
+    if (in) fclose(in);
+    if (o) fclose(o);
+    if (e) fclose(e);
+    unlink(stdin_filename);
+    unlink(stdout_filename);
+    unlink(stderr_filename);
+  }
+
+  static string HexDump(const string& o) {
+    string hex;
+    char buf[20];
+    for (int i = 0; i < (int)o.size(); i += 16) {
+      sprintf(buf, "%07x:", i);
+      hex += buf;
+      for (int j = 0; j < 16; j++) {
+        if (j % 2 == 0)
+          hex += ' ';
+        if (i + j < (int)o.size()) {
+          sprintf(buf, "%02x", (unsigned char)o[i+j]);
+          hex += buf;
+        }
+      }
+      hex += "  ";
+      for (int j = 0; j < 16 && i + j < (int)o.size(); j++) {
+        char c = o[i+j];
+        if (isprint(c))
+          hex += c;
+        else
+          hex += '.';
+      }
+      hex += "\n";
+    }
+    return hex;
   }
 
   void PostMessageFromThread(const string& msg) {
@@ -342,21 +531,34 @@ private:
     runner_->RunJob(job);
   }
 
-  static void ReadFromFD(int fd, string* out) {
-    off_t size = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    char* buf = (char*)malloc(size + 1);
-    buf[size] = '\0';
-    read(fd, buf, size);
-    out->assign(buf, buf+size);
+  static bool WriteToFile(const char* file, const string& s) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+      return false;
+    write(fd, s.data(), s.size());
     close(fd);
+    return true;
+  }
+
+  static void ReadFromStream(FILE* fp, string* out) {
+    fflush(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < 0)
+      size = 0;
+    out->resize(size);
+    if (size > 0)
+      out->resize(fread(&(*out)[0], 1, size, fp));
   }
 
-  static string ReadFromFile(const char* file) {
-    int fd = open(file, O_RDONLY);
-    string s;
-    ReadFromFD(fd, &s);
-    return s;
+  static bool ReadFromFile(const char* file, string* out) {
+    FILE* fp = fopen(file, "rb");
+    if (!fp)
+      return false;
+    ReadFromStream(fp, out);
+    fclose(fp);
+    return true;
   }
 
   void ParseStringArgs(const char* p, string* code, string* stdin_contents) {
@@ -382,8 +584,14 @@ private:
 
   auto_ptr<MainThreadRunner> runner_;
   auto_ptr<MemMount> mount_;
-  vector<string> errors_;
+  // Only touched by HandleMessage() on the main thread.
   int id_;
+  // The pending requests, guarded by queue_lock_.
+  deque<Request*> queue_;
+  pthread_mutex_t queue_lock_;
+  pthread_cond_t queue_cond_;
+  bool quit_;
+  vector<pthread_t> workers_;
 };
 
 void* InitFileSystemThread(void* data) {
@@ -392,6 +600,12 @@ void* InitFileSystemThread(void* data) {
   return NULL;
 }
 
+void* WorkerThread(void* data) {
+  TinyccInstance* self = (TinyccInstance*)data;
+  self->RunWorker();
+  return NULL;
+}
+
 /// The Module class.  The browser calls the CreateInstance() method to create
 /// an instance of your NaCl module on the web page.  The browser creates a new
 /// instance for each <embed> tag with type="application/x-nacl".
@@ -583,7 +583,7 @@ ST_FUNC void asm_opcode(TCCState *s1, int opcode)
     Operand ops[MAX_OPERANDS], *pop;
     int op_type[3]; /* decoded op type */
 #ifdef I386_ASM_16
-    static int a32 = 0, o32 = 0, addr32 = 0, data32 = 0;
+    static ST_TLS int a32 = 0, o32 = 0, addr32 = 0, data32 = 0;
 #endif
 
     /* force synthetic ';' after prefix instruction, so we can handle */
@@ -21,18 +21,21 @@
 #ifdef TARGET_DEFS_ONLY
 
 /* number of available registers */
-#define NB_REGS         4
+#define NB_REGS         5
 #define NB_ASM_REGS     8
 
 /* a register can belong to several classes. The classes must be
    sorted from more general to more precise (see gv2() code which does
    assumptions on it). */
 #define RC_INT     0x0001 /* generic integer register */
-#define RC_FLOAT   0x0002 /* generic float register */
 #define RC_EAX     0x0004
 #define RC_ST0     0x0008 
 #define RC_ECX     0x0010
 #define RC_EDX     0x0020
+#define RC_XMM0    0x0040 /* only used with -msse2 */
+/* generic float register: %xmm0 with -msse2, %st0 otherwise. long
+   double always lives in %st0. */
+#define RC_FLOAT   (tcc_state->sse2 ? RC_XMM0 : RC_ST0)
 #define RC_IRET    RC_EAX /* function return: integer register */
 #define RC_LRET    RC_EDX /* function return: second integer register */
 #define RC_FRET    RC_ST0 /* function return: float register */
@@ -43,6 +46,7 @@ enum {
     TREG_ECX,
     TREG_EDX,
     TREG_ST0,
+    TREG_XMM0,
 };
 
 /* return registers for function */
@@ -92,17 +96,19 @@ ST_DATA const int reg_classes[NB_REGS] = {
     /* eax */ RC_INT | RC_EAX,
     /* ecx */ RC_INT | RC_ECX,
     /* edx */ RC_INT | RC_EDX,
-    /* st0 */ RC_FLOAT | RC_ST0,
+    /* st0 */ RC_ST0,
+    /* xmm0 */ RC_XMM0,
 };
 
-static unsigned long func_sub_sp_offset;
-static int func_ret_sub;
+static ST_TLS unsigned long func_sub_sp_offset;
+static ST_TLS int func_ret_sub;
+static ST_TLS int func_args_size; /* size of the parameters on the stack */
 #ifdef CONFIG_TCC_BCHECK
-static unsigned long func_bound_offset;
+static ST_TLS unsigned long func_bound_offset;
 #endif
 
 #ifdef __native_client__
-void opadding()
+ST_FUNC void opadding(void)
 {
     while (ind & 31)
         g(0x90);
@@ -234,10 +240,49 @@ static void gen_modrm(int op_reg, int r, Sym *sym, int c)
     }
 }
 
+/* emit the prefix and opcode of the SSE2 scalar instruction 'b' for
+   the float or double type 'ft' (the modrm byte follows) */
+static void osse(int ft, int b)
+{
+    gp(8);
+    g((ft & VT_BTYPE) == VT_DOUBLE ? 0xf2 : 0xf3);
+    g(0x0f);
+    g(b);
+}
+
+/* move a float or double between %st0 and %xmm0 through the stack */
+static void move_st0_xmm0(int ft, int to_xmm0)
+{
+    int d = (ft & VT_BTYPE) == VT_DOUBLE;
+    o(0x08ec83); /* sub $8, %esp */
+    if (to_xmm0) {
+        o(d ? 0x241cdd : 0x241cd9); /* fstp[ls] (%esp) */
+        osse(ft, 0x10); /* movs[sd] (%esp), %xmm0 */
+        g(0x04);
+        g(0x24);
+    } else {
+        osse(ft, 0x11); /* movs[sd] %xmm0, (%esp) */
+        g(0x04);
+        g(0x24);
+        o(d ? 0x2404dd : 0x2404d9); /* fld[ls] (%esp) */
+    }
+    o(0x08c483); /* add $8, %esp */
+}
+
+#ifdef CONFIG_TCC_RELAX
+/* true if 'v' is a local variable that the peephole pass may track */
+static int peep_local(SValue *v)
+{
+    int bt = v->type.t & VT_BTYPE;
+    return (v->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == (VT_LOCAL | VT_LVAL)
+        && !(v->type.t & VT_VOLATILE) && (bt == VT_INT || bt == VT_PTR);
+}
+#endif
+
 /* load 'r' from value 'sv' */
 ST_FUNC void load(int r, SValue *sv)
 {
-    int v, t, ft, fc, fr;
+    int v, t, ft, fc, fr, start;
     SValue v1;
 
 #ifdef TCC_TARGET_PE
@@ -246,6 +291,7 @@ ST_FUNC void load(int r, SValue *sv)
 #endif
 
     gp(8);
+    start = ind;
 
     fr = sv->r;
     ft = sv->type.t;
@@ -257,11 +303,26 @@ ST_FUNC void load(int r, SValue *sv)
             v1.type.t = VT_INT;
             v1.r = VT_LOCAL | VT_LVAL;
             v1.c.ul = fc;
+            if (r >= TREG_ST0) {
+                /* float target: borrow %eax for the pointer */
+                o(0x50); /* push %eax */
+                load(TREG_EAX, &v1);
+                v1.type.t = ft;
+                v1.r = TREG_EAX | VT_LVAL;
+                v1.c.ul = 0;
+                v1.sym = NULL;
+                load(r, &v1);
+                o(0x58); /* pop %eax */
+                return;
+            }
             load(r, &v1);
             gp(8);
             fr = r;
         }
-        if ((ft & VT_BTYPE) == VT_FLOAT) {
+        if (r == TREG_XMM0) {
+            osse(ft, 0x10); /* movs[sd] */
+            r = 0;
+        } else if ((ft & VT_BTYPE) == VT_FLOAT) {
             o(0xd9); /* flds */
             r = 0;
         } else if ((ft & VT_BTYPE) == VT_DOUBLE) {
@@ -282,6 +343,10 @@ ST_FUNC void load(int r, SValue *sv)
             o(0x8b);     /* movl */
         }
         gen_modrm(r, fr, sv->sym, fc);
+#ifdef CONFIG_TCC_RELAX
+        if (peep_local(sv))
+            add_peep(start, PEEP_LOAD, r, fc);
+#endif
     } else {
         if (v == VT_CONST) {
             o(0xb8 + r); /* mov $xx, r */
@@ -302,9 +367,15 @@ ST_FUNC void load(int r, SValue *sv)
             o(0x05eb); /* jmp after */
             gsym(fc);
             oad(0xb8 + r, t ^ 1); /* mov $0, r */
+        } else if (r == TREG_XMM0 || v == TREG_XMM0) {
+            if (v != r)
+                move_st0_xmm0(ft, r == TREG_XMM0);
         } else if (v != r) {
             o(0x89);
             o(0xc0 + r + v * 8); /* mov v, r */
+#ifdef CONFIG_TCC_RELAX
+            add_peep(start, PEEP_MOV, r, v);
+#endif
         }
     }
 }
@@ -312,7 +383,7 @@ ST_FUNC void load(int r, SValue *sv)
 /* store register 'r' in lvalue 'v' */
 ST_FUNC void store(int r, SValue *v)
 {
-    int fr, bt, ft, fc;
+    int fr, bt, ft, fc, start;
 
 #ifdef TCC_TARGET_PE
     SValue v2;
@@ -320,13 +391,17 @@ ST_FUNC void store(int r, SValue *v)
 #endif
 
     gp(8);
+    start = ind;
 
     ft = v->type.t;
     fc = v->c.ul;
     fr = v->r & VT_VALMASK;
     bt = ft & VT_BTYPE;
     /* XXX: incorrect if float reg to reg */
-    if (bt == VT_FLOAT) {
+    if (r == TREG_XMM0) {
+        osse(ft, 0x11); /* movs[sd] */
+        r = 0;
+    } else if (bt == VT_FLOAT) {
         o(0xd9); /* fsts */
         r = 2;
     } else if (bt == VT_DOUBLE) {
@@ -348,6 +423,10 @@ ST_FUNC void store(int r, SValue *v)
         fr == VT_LOCAL ||
         (v->r & VT_LVAL)) {
         gen_modrm(r, v->r, v->sym, fc);
+#ifdef CONFIG_TCC_RELAX
+        if (peep_local(v))
+            add_peep(start, PEEP_STORE, r, fc);
+#endif
     } else if (fr != r) {
         o(0xc0 + fr + r * 8); /* mov r, fr */
     }
@@ -391,12 +470,54 @@ static void gcall_or_jmp(int is_jmp)
     } else {
         /* otherwise, indirect call */
         r = gv(RC_INT);
+#ifdef __native_client__
+        /* nacljmp/naclcall */
+        if (!is_jmp) {
+            while ((ind + 5) & 31)
+                g(0x90);
+        } else {
+            gp(5);
+        }
+        o(0xe0e083 + (r << 8)); /* and $-32, r */
+#else
         gp(5);
+#endif
         o(0xff); /* call/jmp *r */
         o(0xd0 + r + (is_jmp << 4));
     }
 }
 
+/* copy the 'args_size' bytes of arguments pushed for a call over the
+   parameters of the current function, leave its frame and jump to
+   vtop */
+static void gtail_jmp(int args_size)
+{
+    int r, i;
+
+    if ((vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST)
+        gv(RC_INT);
+    r = TREG_ECX;
+    if ((vtop->r & VT_VALMASK) == r)
+        r = TREG_EDX;
+    for(i = 0; i < args_size; i += 4) {
+        /* mov i(%esp), r */
+        if (i == (char)i) {
+            gp(4);
+            o(0x24448b + (r << 11));
+            g(i);
+        } else {
+            gp(7);
+            o(0x24848b + (r << 11));
+            gen_le32(i);
+        }
+        gp(6);
+        o(0x89);
+        gen_modrm(r, VT_LOCAL, NULL, 8 + i);
+    }
+    o(0xc9); /* leave */
+    gcall_or_jmp(1);
+}
+
 static uint8_t fastcall_regs[3] = { TREG_EAX, TREG_EDX, TREG_ECX };
 static uint8_t fastcallw_regs[2] = { TREG_ECX, TREG_EDX };
 
@@ -405,9 +526,11 @@ static uint8_t fastcallw_regs[2] = { TREG_ECX, TREG_EDX };
    parameters and the function address. */
 ST_FUNC void gfunc_call(int nb_args)
 {
-    int size, align, r, args_size, i, func_call;
+    int size, align, r, args_size, i, func_call, tail;
     Sym *func_sym;
     
+    tail = tail_call;
+    tail_call = 0;
     args_size = 0;
     for(i = 0;i < nb_args; i++) {
         if ((vtop->type.t & VT_BTYPE) == VT_STRUCT) {
@@ -426,21 +549,28 @@ ST_FUNC void gfunc_call(int nb_args)
             vstore();
             args_size += size;
         } else if (is_float(vtop->type.t)) {
-            gv(RC_FLOAT); /* only one float register */
             if ((vtop->type.t & VT_BTYPE) == VT_FLOAT)
                 size = 4;
             else if ((vtop->type.t & VT_BTYPE) == VT_DOUBLE)
                 size = 8;
             else
                 size = 12;
+            /* only one float register */
+            r = gv(size == 12 ? RC_ST0 : RC_FLOAT);
             oad(0xec81, size); /* sub $xxx, %esp */
-            gp(6);
-            if (size == 12)
-                o(0x7cdb);
-            else
-                o(0x5cd9 + size - 4); /* fstp[s|l] 0(%esp) */
-            g(0x24);
-            g(0x00);
+            if (r == TREG_XMM0) {
+                osse(vtop->type.t, 0x11); /* movs[sd] %xmm0, 0(%esp) */
+                g(0x04);
+                g(0x24);
+            } else {
+                gp(6);
+                if (size == 12)
+                    o(0x7cdb);
+                else
+                    o(0x5cd9 + size - 4); /* fstp[s|l] 0(%esp) */
+                g(0x24);
+                g(0x00);
+            }
             args_size += size;
         } else {
             /* simple type (currently always same size) */
@@ -480,6 +610,12 @@ ST_FUNC void gfunc_call(int nb_args)
             args_size -= 4;
         }
     }
+    if (tail && func_call == FUNC_CDECL && func_ret_sub == 0 &&
+        args_size <= func_args_size) {
+        gtail_jmp(args_size);
+        vtop--;
+        return;
+    }
     gcall_or_jmp(0);
 
 #ifdef TCC_TARGET_PE
@@ -561,6 +697,7 @@ ST_FUNC void gfunc_prolog(CType *func_type)
                  VT_LOCAL | lvalue_type(type->t), param_addr);
         param_index++;
     }
+    func_args_size = addr - 8;
     func_ret_sub = 0;
     /* pascal type call ? */
     if (func_call == FUNC_STDCALL)
@@ -670,7 +807,11 @@ ST_FUNC void gfunc_epilog(void)
 /* generate a jump to a label */
 ST_FUNC int gjmp(int t)
 {
-    return psym(0xe9, t);
+    t = psym(0xe9, t);
+#ifdef CONFIG_TCC_RELAX
+    add_branch(ind - 4);
+#endif
+    return t;
 }
 
 /* generate a jump to a fixed address */
@@ -682,8 +823,14 @@ ST_FUNC void gjmp_addr(int a)
     if (r == (char)r) {
         g(0xeb);
         g(r);
+#ifdef CONFIG_TCC_RELAX
+        add_branch(ind - 1);
+#endif
     } else {
         oad(0xe9, a - ind - 5);
+#ifdef CONFIG_TCC_RELAX
+        add_branch(ind - 4);
+#endif
     }
 }
 
@@ -698,6 +845,9 @@ ST_FUNC int gtst(int inv, int t)
         /* fast case : can jump directly since flags are set */
         g(0x0f);
         t = psym((vtop->c.i - 16) ^ inv, t);
+#ifdef CONFIG_TCC_RELAX
+        add_branch(ind - 4);
+#endif
     } else if (v == VT_JMP || v == VT_JMPI) {
         /* && or || optimization */
         if ((v & 1) == inv) {
@@ -729,6 +879,9 @@ ST_FUNC int gtst(int inv, int t)
             gp(9);
             g(0x0f);
             t = psym(0x85 ^ inv, t);
+#ifdef CONFIG_TCC_RELAX
+            add_branch(ind - 4);
+#endif
         }
     }
     vtop--;
@@ -736,9 +889,371 @@ ST_FUNC int gtst(int inv, int t)
 }
 
 /* generate an integer binary operation */
+/* reg to reg instruction 'b' */
+static void orr(int b, int r, int fr)
+{
+    gp(8);
+    o(b);
+    o(0xc0 + r + fr * 8);
+}
+
+/* shift 'r' by 'c' ('opc' as in gen_opi) */
+static void oshift(int opc, int r, int c)
+{
+    gp(8);
+    o(0xc1);
+    o(opc | r);
+    g(c);
+}
+
+/* r = r * c with lea and shl for c = {3,5,9} * 2^n, imul $c else */
+static void gen_mulc(int r, int c)
+{
+    int n, m;
+
+    for(n = 0; n < 31 && !((c >> n) & 1); n++);
+    m = c >> n;
+    gp(8);
+    if (m == 3 || m == 5 || m == 9) {
+        o(0x8d); /* lea (r,r,m-1), r */
+        o(0x04 | (r << 3));
+        o((m == 3 ? 0x40 : m == 5 ? 0x80 : 0xc0) | r * 9);
+        if (n)
+            oshift(0xe0, r, n);
+    } else if (c == (char)c) {
+        o(0x6b); /* imul $c, r, r */
+        o(0xc0 + r * 9);
+        g(c);
+    } else {
+        o(0x69);
+        oad(0xc0 + r * 9, c);
+    }
+}
+
+/* divide %ecx by the constant 'd' (not 0, 1 or a power of two) with
+   a multiplication by its magic number, or by its inverse for exact
+   pointer differences. %eax and %edx are free. Return the result
+   register. */
+static int gen_divc(int op, int d, int uu)
+{
+    unsigned long long m;
+    unsigned int ud, im;
+    int r, s, a;
+
+    if (op == TOK_PDIV) {
+        for(s = 0; !(d & 1); s++)
+            d >>= 1;
+        ud = im = d;
+        for(a = 0; a < 5; a++)
+            im *= 2 - ud * im;
+        if (s)
+            oshift(0xf8, TREG_ECX, s); /* sar $s, %ecx */
+        gp(8);
+        o(0x69); /* imul $im, %ecx, %ecx */
+        oad(0xc9, im);
+        return TREG_ECX;
+    }
+    a = div_magic(uu ? (unsigned)d : d, 32, !uu, &m, &s);
+    gp(8);
+    oad(0xb8, m); /* mov $m, %eax */
+    gp(8);
+    o(0xf7);
+    o(uu ? 0xe1 : 0xe9); /* mul/imul %ecx */
+    if (uu) {
+        if (a) {
+            /* ((n - hi) >> 1 + hi) >> (s - 1) */
+            orr(0x89, TREG_EAX, TREG_ECX);
+            orr(0x29, TREG_EAX, TREG_EDX);
+            oshift(0xe8, TREG_EAX, 1);
+            orr(0x01, TREG_EAX, TREG_EDX);
+            if (s > 1)
+                oshift(0xe8, TREG_EAX, s - 1);
+            r = TREG_EAX;
+        } else {
+            if (s)
+                oshift(0xe8, TREG_EDX, s);
+            r = TREG_EDX;
+        }
+    } else {
+        if (d > 0 && (int)m < 0)
+            orr(0x01, TREG_EDX, TREG_ECX); /* add %ecx, %edx */
+        else if (d < 0 && (int)m > 0)
+            orr(0x29, TREG_EDX, TREG_ECX); /* sub %ecx, %edx */
+        if (s)
+            oshift(0xf8, TREG_EDX, s);
+        /* add one if negative */
+        orr(0x89, TREG_EAX, TREG_EDX);
+        oshift(0xe8, TREG_EAX, 31);
+        orr(0x01, TREG_EDX, TREG_EAX);
+        r = TREG_EDX;
+    }
+    if (op == '%' || op == TOK_UMOD) {
+        /* n - q * d */
+        gen_mulc(r, d);
+        orr(0x29, TREG_ECX, r); /* sub r, %ecx */
+        r = TREG_ECX;
+    }
+    return r;
+}
+
+/* long long division or modulo of vtop[-1] by vtop[0] when the high
+   word of the divisor is zero at run time, else the library call */
+static void gen_divl_var(int op)
+{
+    int t, a, b, func;
+
+    switch(op) {
+    case '/':
+        func = TOK___divdi3;
+        break;
+    case '%':
+        func = TOK___moddi3;
+        break;
+    case TOK_UDIV:
+        func = TOK___udivdi3;
+        break;
+    default:
+        func = TOK___umoddi3;
+        break;
+    }
+    t = vtop[-1].type.t;
+    /* push the divisor and the dividend as for the call */
+    for(a = 0; a < 2; a++) {
+        gv(RC_INT);
+        gp(2);
+        o(0x50 + vtop->r2); /* push r2 */
+        o(0x50 + vtop->r); /* push r */
+        vtop--;
+    }
+    save_regs(0);
+    gp(5);
+    o(0x0c247c83); /* cmpl $0, 12(%esp) */
+    g(0);
+    gp(6);
+    g(0x0f);
+    a = psym(0x85, 0); /* jne */
+#ifdef CONFIG_TCC_RELAX
+    add_branch(ind - 4);
+#endif
+    if (op == TOK_UDIV || op == TOK_UMOD) {
+        gp(4);
+        o(0x0424448b); /* mov 4(%esp), %eax */
+        o(0xd231); /* xor %edx, %edx */
+        gp(4);
+        o(0x082474f7); /* div 8(%esp) */
+        orr(0x89, TREG_ECX, TREG_EAX); /* mov %eax, %ecx */
+        gp(3);
+        o(0x24048b); /* mov (%esp), %eax */
+        gp(4);
+        o(0x082474f7); /* div 8(%esp) */
+        if (op == TOK_UDIV) {
+            orr(0x89, TREG_EDX, TREG_ECX); /* mov %ecx, %edx */
+        } else {
+            orr(0x89, TREG_EAX, TREG_EDX); /* mov %edx, %eax */
+            o(0xd231); /* xor %edx, %edx */
+        }
+    } else {
+        /* divide the absolute value */
+        gp(3);
+        o(0x240c8b); /* mov (%esp), %ecx */
+        gp(4);
+        o(0x0424448b); /* mov 4(%esp), %eax */
+        o(0x99); /* cltd */
+        orr(0x31, TREG_ECX, TREG_EDX); /* xor %edx, %ecx */
+        orr(0x31, TREG_EAX, TREG_EDX); /* xor %edx, %eax */
+        orr(0x29, TREG_ECX, TREG_EDX); /* sub %edx, %ecx */
+        orr(0x19, TREG_EAX, TREG_EDX); /* sbb %edx, %eax */
+        gp(4);
+        o(0x04245489); /* mov %edx, 4(%esp) */
+        o(0xd231); /* xor %edx, %edx */
+        gp(4);
+        o(0x082474f7); /* div 8(%esp) */
+        o(0x91); /* xchg %eax, %ecx */
+        gp(4);
+        o(0x082474f7); /* div 8(%esp) */
+        gp(4);
+        if (op == '/') {
+            o(0x0424548b); /* mov 4(%esp), %edx */
+            orr(0x31, TREG_EAX, TREG_EDX); /* xor %edx, %eax */
+            orr(0x31, TREG_ECX, TREG_EDX); /* xor %edx, %ecx */
+            orr(0x29, TREG_EAX, TREG_EDX); /* sub %edx, %eax */
+            orr(0x19, TREG_ECX, TREG_EDX); /* sbb %edx, %ecx */
+            orr(0x89, TREG_EDX, TREG_ECX); /* mov %ecx, %edx */
+        } else {
+            o(0x0424448b); /* mov 4(%esp), %eax */
+            orr(0x89, TREG_ECX, TREG_EAX); /* mov %eax, %ecx */
+            orr(0x31, TREG_EDX, TREG_EAX); /* xor %eax, %edx */
+            orr(0x29, TREG_EDX, TREG_EAX); /* sub %eax, %edx */
+            orr(0x19, TREG_ECX, TREG_EAX); /* sbb %eax, %ecx */
+            orr(0x89, TREG_EAX, TREG_EDX); /* mov %edx, %eax */
+            orr(0x89, TREG_EDX, TREG_ECX); /* mov %ecx, %edx */
+        }
+    }
+    b = gjmp(0);
+    gsym(a);
+    vpush_global_sym(&func_old_type, func);
+    gcall_or_jmp(0);
+    vtop--;
+    gsym(b);
+    gadd_sp(16);
+    vpushi(0);
+    vtop->r = TREG_EAX;
+    vtop->r2 = TREG_EDX;
+    vtop->type.t = t;
+}
+
+/* long long division or modulo of vtop[-1] by vtop[0] without library
+   call if the divisor is a constant whose absolute value fits in 32
+   bits (two 64/32 bit divisions), or if its high word is zero at run
+   time. Return 0 if not possible. */
+ST_FUNC int gen_divl(int op)
+{
+    long long d;
+    int t, uu, neg;
+
+    if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST) {
+        gen_divl_var(op);
+        return 1;
+    }
+    d = vtop->c.ll;
+    uu = op == TOK_UDIV || op == TOK_UMOD;
+    neg = !uu && d < 0;
+    if (neg)
+        d = -d;
+    if ((unsigned long long)d > 0xffffffff || (unsigned long long)d < 2)
+        return 0;
+    vtop--;
+    t = vtop->type.t;
+    lexpand();
+    gv2(RC_ECX, RC_EAX);
+    save_reg(TREG_EDX);
+    if (!uu) {
+        /* divide the absolute value */
+        gp(8);
+        o(0x99); /* cltd */
+        orr(0x31, TREG_ECX, TREG_EDX); /* xor %edx, %ecx */
+        orr(0x31, TREG_EAX, TREG_EDX); /* xor %edx, %eax */
+        orr(0x29, TREG_ECX, TREG_EDX); /* sub %edx, %ecx */
+        orr(0x19, TREG_EAX, TREG_EDX); /* sbb %edx, %eax */
+        gp(8);
+        o(0x52); /* push %edx */
+    }
+    gp(8);
+    oad(0x68, d); /* push $d */
+    gp(8);
+    o(0xd231); /* xor %edx, %edx */
+    gp(8);
+    o(0x2434f7); /* div (%esp) */
+    gp(8);
+    o(0x91); /* xchg %eax, %ecx */
+    gp(8);
+    o(0x2434f7); /* div (%esp) */
+    /* quotient in %ecx:%eax, remainder in %edx */
+    vtop--;
+    if (uu) {
+        gp(8);
+        o(0x04c483); /* add $4, %esp */
+        if (op == TOK_UMOD)
+            orr(0x31, TREG_ECX, TREG_ECX); /* xor %ecx, %ecx */
+    } else if (op == '%') {
+        gp(8);
+        o(0x5858); /* pop %eax, pop %eax */
+        orr(0x89, TREG_ECX, TREG_EAX); /* mov %eax, %ecx */
+        orr(0x31, TREG_EDX, TREG_EAX); /* xor %eax, %edx */
+        orr(0x29, TREG_EDX, TREG_EAX); /* sub %eax, %edx */
+        orr(0x19, TREG_ECX, TREG_EAX); /* sbb %eax, %ecx */
+    } else {
+        gp(8);
+        o(0x5a5a); /* pop %edx, pop %edx */
+        if (neg) {
+            gp(8);
+            o(0xd2f7); /* not %edx */
+        }
+        orr(0x31, TREG_EAX, TREG_EDX); /* xor %edx, %eax */
+        orr(0x31, TREG_ECX, TREG_EDX); /* xor %edx, %ecx */
+        orr(0x29, TREG_EAX, TREG_EDX); /* sub %edx, %eax */
+        orr(0x19, TREG_ECX, TREG_EDX); /* sbb %edx, %ecx */
+    }
+    vtop->r = op == '%' || op == TOK_UMOD ? TREG_EDX : TREG_EAX;
+    vtop->r2 = TREG_ECX;
+    vtop->type.t = t;
+    return 1;
+}
+
+/* long long shift of vtop[-1] by vtop[0] with shld/shrd. Return 0 for
+   constant shifts of 32 or more, which are simpler in gen_opl(). */
+ST_FUNC int gen_shiftl(int op)
+{
+    int t, c, lo, hi;
+
+    t = vtop[-1].type.t;
+    if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+        c = vtop->c.i & 63;
+        if (c >= 32)
+            return 0;
+        vpop();
+        lexpand();
+        gv2(RC_INT, RC_INT);
+        lo = vtop[-1].r;
+        hi = vtop[0].r;
+        gp(8);
+        if (op == TOK_SHL) {
+            o(0xa40f); /* shld $c, lo, hi */
+            o(0xc0 + hi + lo * 8);
+            g(c);
+            oshift(0xe0, lo, c);
+        } else {
+            o(0xac0f); /* shrd $c, hi, lo */
+            o(0xc0 + lo + hi * 8);
+            g(c);
+            oshift(op == TOK_SAR ? 0xf8 : 0xe8, hi, c);
+        }
+    } else {
+        vswap();
+        lexpand();
+        vrotb(3);
+        gv(RC_ECX);
+        vrott(3);
+        gv2(RC_EAX, RC_EDX);
+        lo = TREG_EAX;
+        hi = TREG_EDX;
+        gp(8);
+        if (op == TOK_SHL) {
+            o(0xc2a50f); /* shld %cl, %eax, %edx */
+            o(0xe0d3); /* shl %cl, %eax */
+        } else {
+            o(0xd0ad0f); /* shrd %cl, %edx, %eax */
+            o(op == TOK_SAR ? 0xfad3 : 0xead3); /* sar/shr %cl, %edx */
+        }
+        /* the count is modulo 32: move the words for 32 and more */
+        gp(10);
+        o(0x20c1f6); /* test $32, %cl */
+        g(0x74); /* je */
+        g(op == TOK_SAR ? 5 : 4);
+        if (op == TOK_SHL) {
+            o(0xc289); /* mov %eax, %edx */
+            o(0xc031); /* xor %eax, %eax */
+        } else {
+            o(0xd089); /* mov %edx, %eax */
+            if (op == TOK_SAR)
+                o(0x1ffac1); /* sar $31, %edx */
+            else
+                o(0xd231); /* xor %edx, %edx */
+        }
+        vrotb(3);
+        vpop();
+    }
+    vtop--;
+    vtop->r = lo;
+    vtop->r2 = hi;
+    vtop->type.t = t;
+    return 1;
+}
+
 ST_FUNC void gen_opi(int op)
 {
     int r, fr, opc, c;
+    unsigned int ud;
 
     gp(8);
 
@@ -803,6 +1318,14 @@ ST_FUNC void gen_opi(int op)
         opc = 1;
         goto gen_op8;
     case '*':
+        if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+            vswap();
+            r = gv(RC_INT);
+            vswap();
+            gen_mulc(r, vtop->c.i);
+            vtop--;
+            break;
+        }
         gv2(RC_INT, RC_INT);
         gp(8);
         r = vtop[-1].r;
@@ -847,6 +1370,22 @@ ST_FUNC void gen_opi(int op)
     case '%':
     case TOK_UMOD:
     case TOK_UMULL:
+        if (op != TOK_UMULL &&
+            (vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+            /* constant divisor: multiply by its magic number */
+            c = vtop->c.i;
+            ud = op == TOK_UDIV || op == TOK_UMOD || c > 0 ? c : -c;
+            if (ud > 1 && (ud & (ud - 1))) {
+                vswap();
+                gv(RC_ECX);
+                vswap();
+                vtop--;
+                save_reg(TREG_EAX);
+                save_reg(TREG_EDX);
+                vtop->r = gen_divc(op, c, op == TOK_UDIV || op == TOK_UMOD);
+                break;
+            }
+        }
         /* first operand must be in eax */
         /* XXX: need better constraint for second operand */
         gv2(RC_EAX, RC_ECX);
@@ -881,6 +1420,126 @@ ST_FUNC void gen_opi(int op)
     }
 }
 
+/* float or double operation with -msse2: t1 is in %xmm0, t2 is
+   either used from memory or loaded into %xmm1 */
+static void gen_opf_sse(int op)
+{
+    int a, ft, fc, swapped, r;
+
+    /* function results arrive in %st0 */
+    if ((vtop[-1].r & (VT_VALMASK | VT_LVAL)) == TREG_ST0) {
+        vswap();
+        gv(RC_FLOAT);
+        vswap();
+    }
+    if ((vtop[0].r & (VT_VALMASK | VT_LVAL)) == TREG_ST0)
+        gv(RC_FLOAT);
+
+    /* convert constants to memory references */
+    if ((vtop[-1].r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
+        vswap();
+        gv(RC_FLOAT);
+        vswap();
+    }
+    if ((vtop[0].r & (VT_VALMASK | VT_LVAL)) == VT_CONST)
+        gv(RC_FLOAT);
+
+    /* must put at least one value in the floating point register */
+    if ((vtop[-1].r & VT_LVAL) &&
+        (vtop[0].r & VT_LVAL)) {
+        vswap();
+        gv(RC_FLOAT);
+        vswap();
+    }
+    swapped = 0;
+    /* swap the stack if needed so that t1 is the register and t2 is
+       the memory reference */
+    if (vtop[-1].r & VT_LVAL) {
+        vswap();
+        swapped = 1;
+    }
+
+    ft = vtop->type.t;
+    fc = vtop->c.ul;
+    /* if saved lvalue, then we must reload it */
+    r = vtop->r;
+    if ((r & VT_VALMASK) == VT_LLOCAL) {
+        SValue v1;
+        r = get_reg(RC_INT);
+        v1.type.t = VT_INT;
+        v1.r = VT_LOCAL | VT_LVAL;
+        v1.c.ul = fc;
+        load(r, &v1);
+        fc = 0;
+    }
+
+    if (op >= TOK_ULT && op <= TOK_GT) {
+        if (op == TOK_EQ || op == TOK_NE) {
+            save_reg(TREG_EAX); /* eax is used to test for unordered */
+            swapped = 0;
+        } else {
+            if (op == TOK_LE || op == TOK_LT)
+                swapped = !swapped;
+            op = (op == TOK_LE || op == TOK_GE) ? TOK_UGE : TOK_UGT;
+        }
+        if (swapped) {
+            osse(ft, 0x10); /* movs[sd] t2, %xmm1 */
+            gen_modrm(1, r, vtop->sym, fc);
+            gp(4);
+            if ((ft & VT_BTYPE) == VT_DOUBLE)
+                g(0x66);
+            o(0xc82e0f); /* ucomis[sd] %xmm0, %xmm1 */
+        } else {
+            gp(8);
+            if ((ft & VT_BTYPE) == VT_DOUBLE)
+                g(0x66);
+            o(0x2e0f); /* ucomis[sd] t2, %xmm0 */
+            gen_modrm(0, r, vtop->sym, fc);
+        }
+        if (op == TOK_EQ || op == TOK_NE) {
+            /* same flags as fnstsw: unordered sets ZF, PF and CF */
+            gp(7);
+            o(0x9f); /* lahf */
+            o(0x45e480); /* and $0x45, %ah */
+            if (op == TOK_EQ)
+                o(0x40fC80); /* cmp $0x40, %ah */
+            else
+                o(0x40f480); /* xor $0x40, %ah */
+        }
+        vtop--;
+        vtop->r = VT_CMP;
+        vtop->c.i = op;
+    } else {
+        switch(op) {
+        default:
+        case '+':
+            a = 0;
+            break;
+        case '-':
+            a = 4;
+            break;
+        case '*':
+            a = 1;
+            break;
+        case '/':
+            a = 6;
+            break;
+        }
+        if (swapped && (op == '-' || op == '/')) {
+            gp(3);
+            o(0xc8280f); /* movaps %xmm0, %xmm1 */
+            osse(ft, 0x10); /* movs[sd] t2, %xmm0 */
+            gen_modrm(0, r, vtop->sym, fc);
+            osse(ft, 0x58 + a); /* op %xmm1, %xmm0 */
+            g(0xc1);
+        } else {
+            osse(ft, 0x58 + a); /* op t2, %xmm0 */
+            gen_modrm(0, r, vtop->sym, fc);
+        }
+        vtop--;
+    }
+}
+
 /* generate a floating point operation 'v = t1 op t2' instruction. The
    two operands are guaranted to have the same floating point type */
 /* XXX: need to use ST1 too */
@@ -888,20 +1547,25 @@ ST_FUNC void gen_opf(int op)
 {
     int a, ft, fc, swapped, r;
 
+    if (tcc_state->sse2 && (vtop->type.t & VT_BTYPE) != VT_LDOUBLE) {
+        gen_opf_sse(op);
+        return;
+    }
+
     /* convert constants to memory references */
     if ((vtop[-1].r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
         vswap();
-        gv(RC_FLOAT);
+        gv(RC_ST0);
         vswap();
     }
     if ((vtop[0].r & (VT_VALMASK | VT_LVAL)) == VT_CONST)
-        gv(RC_FLOAT);
+        gv(RC_ST0);
 
     /* must put at least one value in the floating point register */
     if ((vtop[-1].r & VT_LVAL) &&
         (vtop[0].r & VT_LVAL)) {
         vswap();
-        gv(RC_FLOAT);
+        gv(RC_ST0);
         vswap();
     }
     swapped = 0;
@@ -996,10 +1660,267 @@ ST_FUNC void gen_opf(int op)
     }
 }
 
+/* emit the SSE instruction 'pfx 0f opc' between %xmm'xr' and the
+   vector lvalue 'sv': a frame slot or a pointer held in a register */
+static void gen_vmodrm(int pfx, int opc, int xr, SValue *sv)
+{
+    gp(16);
+    if (pfx)
+        g(pfx);
+    g(0x0f);
+    g(opc);
+    gen_modrm(xr, sv->r, NULL, sv->c.ul);
+}
+
+/* emit the SSE instruction 'pfx 0f opc modrm' between two registers
+   (an immediate byte may follow) */
+static void orv(int pfx, int opc, int modrm)
+{
+    gp(5);
+    if (pfx)
+        g(pfx);
+    g(0x0f);
+    g(opc);
+    g(modrm);
+}
+
+/* GCC vectors: 'dest = vtop[-1] op vtop[0]' on 16 byte vectors with
+   -msse2, or 'dest = vtop[0]' if op is '='. The operands are frame
+   slots or pointers held in registers. The stack is only 4 byte
+   aligned, so unaligned moves are used. Return 0 if there is no SSE2
+   instruction for 'op' on these lanes. */
+ST_FUNC int gen_opv(int op, SValue *dest)
+{
+    int bt, size, align, pfx, opc;
+
+    if (!tcc_state->sse2)
+        return 0;
+    if (op == '=') {
+        gen_vmodrm(0, 0x10, 1, vtop); /* movups */
+    } else {
+        bt = vtop->type.ref->next->type.t & VT_BTYPE;
+        size = type_size(&vtop->type.ref->next->type, &align);
+        pfx = 0x66;
+        opc = 0;
+        if (bt == VT_FLOAT || bt == VT_DOUBLE) {
+            if (bt == VT_FLOAT)
+                pfx = 0;
+            switch(op) {
+            case '+': opc = 0x58; break; /* addp[sd] */
+            case '-': opc = 0x5c; break; /* subp[sd] */
+            case '*': opc = 0x59; break; /* mulp[sd] */
+            case '/': opc = 0x5e; break; /* divp[sd] */
+            }
+        } else {
+            switch(op) {
+            case '+': /* padd[bwdq] */
+                opc = size == 1 ? 0xfc : size == 2 ? 0xfd : size == 4 ? 0xfe : 0xd4;
+                break;
+            case '-': /* psub[bwdq] */
+                opc = size == 1 ? 0xf8 : size == 2 ? 0xf9 : size == 4 ? 0xfa : 0xfb;
+                break;
+            case '*':
+                if (size == 2)
+                    opc = 0xd5; /* pmullw */
+                else if (size == 4)
+                    opc = 0xf4; /* pmuludq, see below */
+                break;
+            case '&': opc = 0xdb; break; /* pand */
+            case '|': opc = 0xeb; break; /* por */
+            case '^': opc = 0xef; break; /* pxor */
+            }
+        }
+        if (!opc)
+            return 0;
+        gen_vmodrm(0, 0x10, 1, vtop - 1);
+        gen_vmodrm(0, 0x10, 2, vtop);
+        if (opc == 0xf4) {
+            /* no pmulld in SSE2: multiply the even and the odd lanes
+               into quadwords and gather their low halves */
+            orv(0x66, 0x70, 0xd9); /* pshufd $0xf5, %xmm1, %xmm3 */
+            g(0xf5);
+            orv(0x66, 0x70, 0xe2); /* pshufd $0xf5, %xmm2, %xmm4 */
+            g(0xf5);
+            orv(0x66, 0xf4, 0xca); /* pmuludq %xmm2, %xmm1 */
+            orv(0x66, 0xf4, 0xdc); /* pmuludq %xmm4, %xmm3 */
+            orv(0x66, 0x70, 0xc9); /* pshufd $8, %xmm1, %xmm1 */
+            g(0x08);
+            orv(0x66, 0x70, 0xdb); /* pshufd $8, %xmm3, %xmm3 */
+            g(0x08);
+            orv(0x66, 0x62, 0xcb); /* punpckldq %xmm3, %xmm1 */
+        } else {
+            orv(pfx, opc, 0xca); /* op %xmm2, %xmm1 */
+        }
+    }
+    gen_vmodrm(0, 0x11, 1, dest); /* movups */
+    return 1;
+}
+
+/* emit the load (opc 0x8b) or the store (opc 0x89) of 'size' bytes
+   between register 'r' and 'off' bytes into the lvalue 'sv', a frame
+   slot or a pointer held in a register. 16 bytes go through %xmm1. */
+static void gen_memmov(int opc, int size, int r, SValue *sv, int off)
+{
+    int b, c;
+
+    b = sv->r & VT_VALMASK;
+    c = off;
+    if (b == VT_LOCAL)
+        c += sv->c.ul;
+    gp(8);
+    if (size == 2)
+        g(0x66);
+    if (size == 16) {
+        r = 1;
+        g(0x0f);
+        opc = opc == 0x8b ? 0x10 : 0x11; /* movups */
+    } else if (size == 1) {
+        opc--;
+    }
+    g(opc);
+    if (b == VT_LOCAL) {
+        gen_modrm(r, VT_LOCAL, NULL, c);
+    } else if (!c) {
+        g(r << 3 | b);
+    } else if (c == (char)c) {
+        g(0x40 | r << 3 | b);
+        g(c);
+    } else {
+        g(0x80 | r << 3 | b);
+        gen_le32(c);
+    }
+}
+
+/* largest move for the 'n' remaining bytes of a copy */
+static int mem_chunk(int n)
+{
+    if (n >= 16 && tcc_state->sse2)
+        return 16;
+    return n >= 4 ? 4 : n >= 2 ? 2 : 1;
+}
+
+#ifndef __native_client__
+/* load the address of the lvalue 'sv' into register 'r' */
+static void gen_memaddr(int r, SValue *sv)
+{
+    int b = sv->r & VT_VALMASK;
+
+    if (b == VT_LOCAL) {
+        o(0x8d); /* lea */
+        gen_modrm(r, VT_LOCAL, NULL, sv->c.ul);
+    } else {
+        orr(0x89, r, b); /* mov */
+    }
+}
+
+/* emit 'rep movsl' (op 0xa5) or 'rep stosl' (op 0xab) for 'size'
+   bytes, then the string moves of the 2 and 1 byte tail */
+static void gen_memrep(int op, int size)
+{
+    save_reg(TREG_ECX);
+    oad(0xb9, size >> 2); /* mov $xxx, %ecx */
+    o(0xf3 | op << 8); /* rep movsl / stosl */
+    if (size & 2)
+        o(0x66 | op << 8);
+    if (size & 1)
+        o(op - 1);
+}
+#endif
+
+/* memcpy() of 'size' bytes from the lvalue vtop to the lvalue
+   vtop[-1], both frame slots or pointers held in registers. Small
+   copies are unrolled, larger ones use 'rep movsl' */
+ST_FUNC int gen_memcpy(int size)
+{
+    int r, n, off;
+
+    if (size > tcc_state->inline_copy_limit) {
+#ifdef __native_client__
+        return 0;
+#else
+        o(0x5756); /* push %esi; push %edi */
+        gen_memaddr(6, vtop); /* %esi */
+        gen_memaddr(7, vtop - 1); /* %edi */
+        gen_memrep(0xa5, size);
+        o(0x5e5f); /* pop %edi; pop %esi */
+        return 1;
+#endif
+    }
+    r = 0;
+    if (mem_chunk(size) != 16 || (size & 15))
+        r = get_reg(RC_INT);
+    for (off = 0; off < size; off += n) {
+        n = mem_chunk(size - off);
+        gen_memmov(0x8b, n, r, vtop, off);
+        gen_memmov(0x89, n, r, vtop - 1, off);
+    }
+    return 1;
+}
+
+/* memset() of 'size' bytes of the lvalue vtop[-1] with the constant
+   byte vtop */
+ST_FUNC int gen_memset(int size)
+{
+    unsigned int v;
+    int r, n, off;
+
+    v = (vtop->c.i & 0xff) * 0x01010101;
+    if (size > tcc_state->inline_copy_limit) {
+#ifdef __native_client__
+        return 0;
+#else
+        o(0x57); /* push %edi */
+        gen_memaddr(7, vtop - 1); /* %edi */
+        save_reg(TREG_EAX);
+        r = TREG_EAX;
+#endif
+    } else {
+        r = get_reg(RC_INT);
+    }
+    if (v)
+        oad(0xb8 + r, v); /* mov $xxx, %r */
+    else
+        o(0xc031 + r * 0x900); /* xor %r, %r */
+    if (size > tcc_state->inline_copy_limit) {
+#ifndef __native_client__
+        gen_memrep(0xab, size);
+        o(0x5f); /* pop %edi */
+#endif
+        return 1;
+    }
+    if (mem_chunk(size) == 16) {
+        if (v) {
+            orv(0x66, 0x6e, 0xc8 | r); /* movd %r, %xmm1 */
+            orv(0x66, 0x70, 0xc9); /* pshufd $0, %xmm1, %xmm1 */
+            g(0x00);
+        } else {
+            orv(0x66, 0xef, 0xc9); /* pxor %xmm1, %xmm1 */
+        }
+    }
+    for (off = 0; off < size; off += n) {
+        n = mem_chunk(size - off);
+        gen_memmov(0x89, n, r, vtop - 1, off);
+    }
+    return 1;
+}
+
 /* convert integers to fp 't' type. Must handle 'int', 'unsigned int'
    and 'long long' cases. */
 ST_FUNC void gen_cvt_itof(int t)
 {
+    if (tcc_state->sse2 && (t & VT_BTYPE) != VT_LDOUBLE &&
+        (vtop->type.t & VT_BTYPE) != VT_LLONG &&
+        (vtop->type.t & (VT_BTYPE | VT_UNSIGNED)) != (VT_INT | VT_UNSIGNED)) {
+        /* int to float/double */
+        save_reg(TREG_XMM0);
+        gv(RC_INT);
+        osse(t, 0x2a); /* cvtsi2s[sd] r, %xmm0 */
+        g(0xc0 + (vtop->r & VT_VALMASK));
+        vtop->r = TREG_XMM0;
+        return;
+    }
+    /* the other cases go through the x87 stack; the result is moved
+       to %xmm0 when needed */
     save_reg(TREG_ST0);
     gv(RC_INT);
     if ((vtop->type.t & VT_BTYPE) == VT_LLONG) {
@@ -1035,10 +1956,21 @@ ST_FUNC void gen_cvt_ftoi(int t)
     Sym *sym;
     CType ushort_type;
 
+    if (tcc_state->sse2 && t == VT_INT &&
+        (vtop->type.t & VT_BTYPE) != VT_LDOUBLE) {
+        size = vtop->type.t;
+        gv(RC_FLOAT);
+        r = get_reg(RC_INT);
+        osse(size, 0x2c); /* cvtts[sd]2si %xmm0, r */
+        g(0xc0 + r * 8);
+        vtop->r = r;
+        return;
+    }
+
     ushort_type.t = VT_SHORT | VT_UNSIGNED;
     ushort_type.ref = 0;
 
-    gv(RC_FLOAT);
+    gv(RC_ST0);
     if (t != VT_INT)
         size = 8;
     else 
@@ -1084,13 +2016,47 @@ ST_FUNC void gen_cvt_ftoi(int t)
 /* convert from one floating point type to another */
 ST_FUNC void gen_cvt_ftof(int t)
 {
-    /* all we have to do on i386 is to put the float in a register */
-    gv(RC_FLOAT);
+    int bt = vtop->type.t & VT_BTYPE;
+    int size;
+
+    t &= VT_BTYPE;
+    if (!tcc_state->sse2 || t == VT_LDOUBLE || bt == VT_LDOUBLE) {
+        /* all we have to do on x87 is to put the float in a register,
+           except that a narrowing cast must drop the excess precision */
+        gv(RC_ST0);
+        if (t == VT_FLOAT ? bt != VT_FLOAT : t == VT_DOUBLE && bt == VT_LDOUBLE) {
+            size = t == VT_FLOAT ? 4 : 8;
+            loc = (loc - size) & -size;
+            gp(6);
+            o(t == VT_FLOAT ? 0xd9 : 0xdd); /* fstps or fstpl */
+            gen_modrm(3, VT_LOCAL, NULL, loc);
+            vtop->r = VT_LOCAL | VT_LVAL;
+            vtop->c.ul = loc;
+        }
+    } else {
+        gv(RC_FLOAT);
+        if (bt != t) {
+            osse(bt, 0x5a); /* cvts[sd]2s[ds] %xmm0, %xmm0 */
+            g(0xc0);
+        }
+    }
 }
 
 /* computed goto support */
 ST_FUNC void ggoto(void)
 {
+#ifdef __native_client__
+    int r;
+    if ((vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST) {
+        r = gv(RC_INT);
+        /* nacljmp */
+        gp(5);
+        o(0xe0e083 + (r << 8)); /* and $-32, r */
+        o(0xe0ff + (r << 8)); /* jmp *r */
+        vtop--;
+        return;
+    }
+#endif
     gcall_or_jmp(1);
     vtop--;
 }
@@ -39,6 +39,7 @@ ST_DATA struct TCCState *tcc_state;
 #include "tccgen.c"
 #include "tccelf.c"
 #include "tccrun.c"
+#include "tcccache.c"
 #ifdef TCC_TARGET_I386
 #include "i386-gen.c"
 #endif
@@ -597,6 +598,10 @@ static void error1(TCCState *s1, int is_warning, const char *fmt, va_list ap)
     } else {
         s1->error_func(s1->error_opaque, buf);
     }
+    if (s1->cache_log) {
+        cstr_cat(s1->cache_log, buf);
+        cstr_ccat(s1->cache_log, '\0');
+    }
     if (!is_warning || s1->warn_error)
         s1->nb_errors++;
 }
@@ -651,9 +656,161 @@ PUB_FUNC void tcc_warning(const char *fmt, ...)
     va_end(ap);
 }
 
+static void error_state(TCCState *s1, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    error1(s1, 0, fmt, ap);
+    va_end(ap);
+}
+
+/* the compilation state of 's1' is kept in the globals of the thread
+   which created it, until the next tcc_new() there. Report its use
+   from elsewhere and return non zero. */
+ST_FUNC int tcc_check_state(TCCState *s1)
+{
+#ifdef TCC_HAVE_THREADS
+    if (!tcc_thread_equal(s1->owner, tcc_thread_self())) {
+        error_state(s1, "TCCState used by another thread than its creator");
+        return -1;
+    }
+#endif
+    if (s1 != tcc_state) {
+        error_state(s1, "TCCState used after tcc_new() in the same thread");
+        return -1;
+    }
+    return 0;
+}
+
 /********************************************************/
 /* I/O layer */
 
+#define FILE_DATA_HASH_SIZE 256
+#define FILE_DATA_CACHE_SIZE (64 * 1024 * 1024)
+
+static ST_TLS FileData *file_data_hash[FILE_DATA_HASH_SIZE];
+static ST_TLS unsigned long file_data_cached; /* bytes held by unused entries */
+
+static void file_data_free(FileData *fd)
+{
+#if !defined _WIN32 && !defined __native_client__
+    if (fd->map_size) {
+        munmap(fd->data, fd->map_size);
+    } else
+#endif
+        tcc_free(fd->data);
+    tcc_free(fd);
+}
+
+/* drop the cached contents of the files no longer read */
+static void file_data_flush(void)
+{
+    FileData **pfd, *fd;
+    int i;
+
+    for(i = 0; i < FILE_DATA_HASH_SIZE; i++) {
+        pfd = &file_data_hash[i];
+        while ((fd = *pfd) != NULL) {
+            if (fd->refcount == 0) {
+                *pfd = fd->next;
+                file_data_free(fd);
+            } else {
+                pfd = &fd->next;
+            }
+        }
+    }
+    file_data_cached = 0;
+}
+
+/* return the whole contents of the regular file open on 'fd', or NULL
+   if it must be read through the buffer */
+static FileData *file_data_get(int fd)
+{
+    struct stat st;
+    FileData *e, **pe;
+    uint8_t *data;
+    unsigned long map_size;
+    time_t now;
+    int len, recent;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size != (int)st.st_size)
+        return NULL;
+    /* a file modified within the last second may be rewritten again
+       without its times changing, or be truncated under a mapping: it
+       is read into memory and not kept */
+    now = time(NULL);
+    recent = st.st_mtime >= now - 1 || st.st_ctime >= now - 1;
+    pe = &file_data_hash[(unsigned)st.st_ino % FILE_DATA_HASH_SIZE];
+    for(e = recent ? NULL : *pe; e; e = e->next) {
+        if (e->ino == st.st_ino && e->dev == st.st_dev &&
+            e->size == st.st_size && e->mtime == st.st_mtime &&
+            e->ctime == st.st_ctime) {
+            if (e->refcount++ == 0)
+                file_data_cached -= e->size;
+            return e;
+        }
+    }
+
+    map_size = 0;
+    data = NULL;
+#if !defined _WIN32 && !defined __native_client__
+    /* the CH_EOB sentinel goes in the zero filled tail of the last
+       page, so the mapping needs one */
+    if ((st.st_size & (PAGESIZE - 1)) && !recent) {
+        map_size = st.st_size;
+        data = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+            map_size = 0;
+        }
+    }
+#endif
+    if (!data) {
+        data = tcc_malloc(st.st_size + 1);
+        len = read(fd, data, st.st_size);
+        lseek(fd, 0, SEEK_SET);
+        if (len != st.st_size) {
+            tcc_free(data);
+            return NULL;
+        }
+    }
+    data[st.st_size] = CH_EOB;
+
+    e = tcc_malloc(sizeof(FileData));
+    e->refcount = 1;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->ctime = st.st_ctime;
+    e->data = data;
+    e->map_size = map_size;
+    e->next = NULL;
+    /* without inode numbers, files can not be told apart */
+    e->kept = st.st_ino && !recent;
+    if (e->kept) {
+        e->next = *pe;
+        *pe = e;
+    }
+    return e;
+}
+
+static void file_data_release(FileData *e)
+{
+    if (--e->refcount)
+        return;
+    if (!e->kept) {
+        file_data_free(e);
+        return;
+    }
+    file_data_cached += e->size;
+    if (file_data_cached > FILE_DATA_CACHE_SIZE)
+        file_data_flush();
+}
+
 ST_FUNC void tcc_open_bf(TCCState *s1, const char *filename, int initlen)
 {
     BufferedFile *bf;
@@ -671,6 +828,7 @@ ST_FUNC void tcc_open_bf(TCCState *s1, const char *filename, int initlen)
     bf->ifndef_macro = 0;
     bf->ifdef_stack_ptr = s1->ifdef_stack_ptr;
     bf->fd = -1;
+    bf->fdata = NULL;
     bf->prev = file;
     file = bf;
 }
@@ -682,12 +840,15 @@ ST_FUNC void tcc_close(void)
         close(bf->fd);
         total_lines += bf->line_num;
     }
+    if (bf->fdata)
+        file_data_release(bf->fdata);
     file = bf->prev;
     tcc_free(bf);
 }
 
 ST_FUNC int tcc_open(TCCState *s1, const char *filename)
 {
+    FileData *fdata;
     int fd;
     if (strcmp(filename, "-") == 0)
         fd = 0, filename = "stdin";
@@ -699,13 +860,23 @@ ST_FUNC int tcc_open(TCCState *s1, const char *filename)
     if (fd < 0)
         return -1;
 
-    tcc_open_bf(s1, filename, 0);
+    fdata = fd > 0 ? file_data_get(fd) : NULL;
+    if (fdata) {
+        /* the lexer reads the whole file in place: no buffer needed */
+        tcc_open_bf(s1, filename, 1);
+        file->fdata = fdata;
+        file->buf_ptr = fdata->data;
+        file->buf_end = fdata->data + fdata->size;
+        total_bytes += fdata->size;
+    } else {
+        tcc_open_bf(s1, filename, 0);
+    }
     file->fd = fd;
     return fd;
 }
 
 /* compile the C file opened in 'file'. Return non zero if errors. */
-static int tcc_compile(TCCState *s1)
+static int tcc_compile_file(TCCState *s1)
 {
     Sym *define_start;
     SValue *pvtop;
@@ -716,6 +887,7 @@ static int tcc_compile(TCCState *s1)
     printf("%s: **** new file\n", file->filename);
 #endif
     preprocess_init(s1);
+    tok_arena_enable();
 
     cur_text_section = NULL;
     funcname = "";
@@ -787,6 +959,7 @@ static int tcc_compile(TCCState *s1)
         tok_flags = TOK_FLAG_BOL | TOK_FLAG_BOF;
         parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM;
         pvtop = vtop;
+        tcc_pp_snapshot_replay();
         next();
         decl(VT_CONST);
         if (tok != TOK_EOF)
@@ -811,13 +984,23 @@ static int tcc_compile(TCCState *s1)
 
     sym_pop(&global_stack, NULL);
     sym_pop(&local_stack, NULL);
+    /* all token strings of the file are gone */
+    tok_arena_reset();
 
     return s1->nb_errors != 0 ? -1 : 0;
 }
 
+static int tcc_compile(TCCState *s1)
+{
+    return tcc_cache_compile(s1, tcc_compile_file);
+}
+
 LIBTCCAPI int tcc_compile_string(TCCState *s, const char *str)
 {
     int len, ret;
+
+    if (tcc_check_state(s))
+        return -1;
     len = strlen(str);
 
     tcc_open_bf(s, "<string>", len);
@@ -827,10 +1010,61 @@ LIBTCCAPI int tcc_compile_string(TCCState *s, const char *str)
     return ret;
 }
 
+LIBTCCAPI int tcc_save_pp_snapshot(TCCState *s, const char *prelude,
+                                   const char *filename)
+{
+    int len, ret;
+
+    if (tcc_check_state(s))
+        return -1;
+    len = strlen(prelude);
+
+    tcc_open_bf(s, "<prelude>", len);
+    memcpy(file->buffer, prelude, len);
+    ret = -1;
+    if (setjmp(s->error_jmp_buf) == 0) {
+        s->nb_errors = 0;
+        s->error_set_jmp_enabled = 1;
+        ret = tcc_pp_snapshot_save(s, filename);
+    }
+    s->error_set_jmp_enabled = 0;
+    tcc_close();
+    return ret < 0 || s->nb_errors != 0 ? -1 : 0;
+}
+
+LIBTCCAPI int tcc_load_pp_snapshot(TCCState *s, const char *filename)
+{
+    if (tcc_check_state(s))
+        return -1;
+    return tcc_pp_snapshot_load(s, filename);
+}
+
+LIBTCCAPI void tcc_flush_include_cache(void)
+{
+    include_cache_flush();
+}
+
+/* keep a hash of the -D/-U given, for the compile cache */
+static void defines_hash_add(TCCState *s1, const char *op,
+                             const char *sym, const char *value)
+{
+    HashState c;
+
+    hash_init(&c);
+    hash_update(&c, s1->defines_hash, HASH_SIZE);
+    hash_str(&c, op);
+    hash_str(&c, sym);
+    hash_str(&c, value);
+    hash_final(&c, s1->defines_hash);
+}
+
 /* define a preprocessor symbol. A value can also be provided with the '=' operator */
 LIBTCCAPI void tcc_define_symbol(TCCState *s1, const char *sym, const char *value)
 {
     int len1, len2;
+
+    if (tcc_check_state(s1))
+        return;
     /* default value */
     if (!value)
         value = "1";
@@ -849,6 +1083,7 @@ LIBTCCAPI void tcc_define_symbol(TCCState *s1, const char *sym, const char *valu
     parse_define();
 
     tcc_close();
+    defines_hash_add(s1, "D", sym, value);
 }
 
 /* undefine a preprocessor symbol */
@@ -856,11 +1091,15 @@ LIBTCCAPI void tcc_undefine_symbol(TCCState *s1, const char *sym)
 {
     TokenSym *ts;
     Sym *s;
+
+    if (tcc_check_state(s1))
+        return;
     ts = tok_alloc(sym, strlen(sym));
     s = define_find(ts->tok);
     /* undefine symbol by putting an invalid name */
     if (s)
         define_undef(s);
+    defines_hash_add(s1, "U", sym, "");
 }
 
 static void tcc_cleanup(void)
@@ -873,12 +1112,15 @@ static void tcc_cleanup(void)
 
     /* free -D defines */
     free_defines(NULL);
+    tcc_pp_snapshot_free();
 
     /* free tokens */
     n = tok_ident - TOK_IDENT;
     for(i = 0; i < n; i++)
         tcc_free(table_ident[i]);
     tcc_free(table_ident);
+    tok_hash_free();
+    tok_arena_free();
 
     /* free sym_pools */
     dynarray_reset(&sym_pools, &nb_sym_pools);
@@ -902,6 +1144,9 @@ LIBTCCAPI TCCState *tcc_new(void)
     if (!s)
         return NULL;
     tcc_state = s;
+#ifdef TCC_HAVE_THREADS
+    s->owner = tcc_thread_self();
+#endif
 #ifdef _WIN32
     tcc_set_lib_path_w32(s);
 #else
@@ -1015,6 +1260,8 @@ LIBTCCAPI TCCState *tcc_new(void)
                                       ".dynhashtab", SHF_PRIVATE);
     s->alacarte_link = 1;
     s->nocommon = 1;
+    s->inline_copy_limit = 64;
+    s->optimize_sibling_calls = 1;
 
 #ifdef CHAR_IS_UNSIGNED
     s->char_is_unsigned = 1;
@@ -1035,20 +1282,12 @@ LIBTCCAPI void tcc_delete(TCCState *s1)
 {
     int i;
 
-    for(i = 1; i < s1->nb_sections; i++) {
-        Section *s = s1->sections[i];
-        if (0 == (s->sh_flags & SHF_ALLOC))
-            continue;
-        if (s->sh_flags & SHF_EXECINSTR) {
-            nacl_dyncode_delete((void *)s->sh_addr,
-                                (s->data_offset + 31) & ~31);
-        } else if (s->data_offset) {
-            munmap((void *)s->sh_addr,
-                   (s->data_offset + 0xffff) & ~0xffff);
-        }
-    }
-
-    tcc_cleanup();
+#ifdef __native_client__
+    tcc_free_runtime(s1);
+#endif
+    /* the globals may hold the state of a newer TCCState */
+    if (s1 == tcc_state)
+        tcc_cleanup();
 
     /* free all sections */
     for(i = 1; i < s1->nb_sections; i++)
@@ -1141,6 +1380,11 @@ ST_FUNC int tcc_add_file_internal(TCCState *s1, const char *filename, int flags)
         goto the_end;
     }
 
+    if (flags & AFF_SCAN_DEPS) {
+        ret = tcc_preprocess_deps(s1);
+        goto the_end;
+    }
+
     if (!ext[0] || !PATHCMP(ext, "c")) {
         /* C file assumed */
         ret = tcc_compile(s1);
@@ -1234,12 +1478,28 @@ the_end:
 
 LIBTCCAPI int tcc_add_file(TCCState *s, const char *filename)
 {
+    if (tcc_check_state(s))
+        return -1;
     if (s->output_type == TCC_OUTPUT_PREPROCESS)
         return tcc_add_file_internal(s, filename, AFF_PRINT_ERROR | AFF_PREPROCESS);
     else
         return tcc_add_file_internal(s, filename, AFF_PRINT_ERROR);
 }
 
+LIBTCCAPI int tcc_scan_deps(TCCState *s, const char *filename, char ***pdeps)
+{
+    int start;
+
+    if (tcc_check_state(s))
+        return -1;
+
+    start = s->nb_target_deps;
+    if (tcc_add_file_internal(s, filename, AFF_PRINT_ERROR | AFF_SCAN_DEPS) < 0)
+        return -1;
+    *pdeps = s->target_deps + start;
+    return s->nb_target_deps - start;
+}
+
 LIBTCCAPI int tcc_add_library_path(TCCState *s, const char *pathname)
 {
     tcc_split_path(s, (void ***)&s->library_paths, &s->nb_library_paths, pathname);
@@ -1281,6 +1541,8 @@ ST_FUNC int tcc_add_crt(TCCState *s, const char *filename)
 /* the library name is the same as the argument of the '-l' option */
 LIBTCCAPI int tcc_add_library(TCCState *s, const char *libraryname)
 {
+    if (tcc_check_state(s))
+        return -1;
 #ifdef TCC_TARGET_PE
     const char *libs[] = { "%s/%s.def", "%s/lib%s.def", "%s/%s.dll", "%s/lib%s.dll", "%s/lib%s.a", NULL };
     const char **pp = s->static_link ? libs + 4 : libs;
@@ -1299,6 +1561,8 @@ LIBTCCAPI int tcc_add_library(TCCState *s, const char *libraryname)
 
 LIBTCCAPI int tcc_add_symbol(TCCState *s, const char *name, const void *val)
 {
+    if (tcc_check_state(s))
+        return -1;
 #ifdef TCC_TARGET_PE
     pe_putimport(s, 0, name, val);
 #else
@@ -1311,6 +1575,8 @@ LIBTCCAPI int tcc_add_symbol(TCCState *s, const char *name, const void *val)
 
 LIBTCCAPI int tcc_set_output_type(TCCState *s, int output_type)
 {
+    if (tcc_check_state(s))
+        return -1;
     s->output_type = output_type;
 
     if (!s->nostdinc) {
@@ -1335,6 +1601,12 @@ LIBTCCAPI int tcc_set_output_type(TCCState *s, int output_type)
     if (s->char_is_unsigned) {
         tcc_define_symbol(s, "__CHAR_UNSIGNED__", NULL);
     }
+#ifdef TCC_TARGET_I386
+    if (s->sse2) {
+        tcc_define_symbol(s, "__SSE_MATH__", NULL);
+        tcc_define_symbol(s, "__SSE2_MATH__", NULL);
+    }
+#endif
 
     /* add debug sections */
     if (s->do_debug) {
@@ -1429,15 +1701,31 @@ static const FlagDef flag_defs[] = {
     { offsetof(TCCState, char_is_unsigned), FD_INVERT, "signed-char" },
     { offsetof(TCCState, nocommon), FD_INVERT, "common" },
     { offsetof(TCCState, leading_underscore), 0, "leading-underscore" },
+    { offsetof(TCCState, optimize_sibling_calls), 0, "optimize-sibling-calls" },
 };
 
 /* set/reset a flag */
 PUB_FUNC int tcc_set_flag(TCCState *s, const char *flag_name, int value)
 {
+    if (!strncmp(flag_name, "inline-copy-limit=", 18)) {
+        s->inline_copy_limit = atoi(flag_name + 18);
+        return 0;
+    }
     return set_flag(s, flag_defs, countof(flag_defs),
                     flag_name, value);
 }
 
+static const FlagDef m_defs[] = {
+    { offsetof(TCCState, sse2), 0, "sse2" },
+};
+
+/* set/reset a target flag (-m) */
+PUB_FUNC int tcc_set_mflag(TCCState *s, const char *flag_name, int value)
+{
+    return set_flag(s, m_defs, countof(m_defs),
+                    flag_name, value);
+}
+
 
 static int strstart(const char *str, const char *val, char **ptr)
 {
@@ -1605,7 +1893,9 @@ PUB_FUNC const char * tcc_set_linker(TCCState *s, char *option, int multi)
 
 PUB_FUNC void tcc_print_stats(TCCState *s, int64_t total_time)
 {
-    double tt;
+    double tt, avg_probes;
+    int size, used, max_chain;
+
     tt = (double)total_time / 1000000.0;
     if (tt < 0.001)
         tt = 0.001;
@@ -1615,6 +1905,9 @@ PUB_FUNC void tcc_print_stats(TCCState *s, int64_t total_time)
            tok_ident - TOK_IDENT, total_lines, total_bytes,
            tt, (int)(total_lines / tt),
            total_bytes / tt / 1000000.0);
+    tok_hash_stats(&size, &used, &max_chain, &avg_probes);
+    printf("%d hash buckets, %d used, longest chain %d, %0.2f probes/ident\n",
+           size, used, max_chain, avg_probes);
 }
 
 /* set CONFIG_TCCDIR at runtime */
@@ -1687,3 +1980,10 @@ PUB_FUNC void tcc_gen_makedeps(TCCState *s, const char *target, const char *file
 PUB_FUNC void tcc_set_outfile(TCCState *s,  FILE *fp) {
   s->outfile = fp;
 }
+
+LIBTCCAPI void tcc_set_preprocess_func(TCCState *s, void *opaque,
+                        void (*write_func)(void *opaque, const char *buf, int len))
+{
+    s->pp_opaque = opaque;
+    s->pp_write_func = write_func;
+}
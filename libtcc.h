@@ -13,10 +13,14 @@ struct TCCState;
 
 typedef struct TCCState TCCState;
 
-/* create a new TCC compilation context */
+/* create a new TCC compilation context. Its compilation state lives
+   in the thread which creates it, and only until that thread calls
+   tcc_new() again: a TCCState must stay on its thread, and be done with
+   (up to tcc_relocate(), tcc_get_symbol() or tcc_output_file()) before
+   the next one is created there. Other uses fail with an error. */
 LIBTCCAPI TCCState *tcc_new(void);
 
-/* free a TCC compilation context */
+/* free a TCC compilation context (from any thread) */
 LIBTCCAPI void tcc_delete(TCCState *s);
 
 /* add debug information in the generated code */
@@ -47,6 +51,31 @@ LIBTCCAPI void tcc_define_symbol(TCCState *s, const char *sym, const char *value
 /* undefine preprocess symbol 'sym' */
 LIBTCCAPI void tcc_undefine_symbol(TCCState *s, const char *sym);
 
+/* preprocess the source text 'prelude' (typically some #include
+   lines) and save the resulting macros, include guards and
+   declarations to 'filename'. Return non zero if error. */
+LIBTCCAPI int tcc_save_pp_snapshot(TCCState *s, const char *prelude,
+                                   const char *filename);
+
+/* load a snapshot saved by tcc_save_pp_snapshot(), as if its prelude
+   was included at the top of each compiled file. Return non zero if
+   error. */
+LIBTCCAPI int tcc_load_pp_snapshot(TCCState *s, const char *filename);
+
+/* forget where include files were found. Lookups are otherwise
+   remembered across compilations and only redone when one of the
+   directories searched is modified. */
+LIBTCCAPI void tcc_flush_include_cache(void);
+
+/* cache compiled C files under the hash of their source, the options,
+   the defines and the include paths, and load them again instead of
+   compiling while the files they included are unchanged. Up to
+   'max_entries' files are kept in memory and, if 'dir' is not NULL,
+   any number in the directory 'dir'. The cache is shared by all
+   TCCStates; 0 and NULL turn it off (the default). Set it up before
+   compiling from several threads. */
+LIBTCCAPI void tcc_set_compile_cache(int max_entries, const char *dir);
+
 /*****************************/
 /* compiling */
 
@@ -58,6 +87,11 @@ LIBTCCAPI int tcc_add_file(TCCState *s, const char *filename);
    error. */
 LIBTCCAPI int tcc_compile_string(TCCState *s, const char *buf);
 
+/* run only the preprocessor directives of 'filename' and set '*deps'
+   to the list of files it depends on, itself first. The list is valid
+   until the next call. Return the number of files, or -1 if error. */
+LIBTCCAPI int tcc_scan_deps(TCCState *s, const char *filename, char ***deps);
+
 /*****************************/
 /* linking commands */
 
@@ -104,6 +138,11 @@ LIBTCCAPI void tcc_set_lib_path(TCCState *s, const char *path);
 /* set outfile for preprocessor */
 LIBTCCAPI void tcc_set_outfile(TCCState *s,  FILE *fp);
 
+/* pass the preprocessor output to 'write_func' instead of writing it
+   to the outfile */
+LIBTCCAPI void tcc_set_preprocess_func(TCCState *s, void *opaque,
+                        void (*write_func)(void *opaque, const char *buf, int len));
+
 #ifdef __cplusplus
 }
 #endif
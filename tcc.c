@@ -33,6 +33,7 @@ static int reloc_output;
 static char *outfile;
 static int do_bench = 0;
 static int gen_deps;
+static int scan_deps; /* 1 for -M, 2 for -MM */
 static const char *deps_outfile;
 static const char *m_option;
 
@@ -54,6 +55,12 @@ static void help(void)
            "  -fflag      set or reset (with 'no-' prefix) 'flag' (see man page)\n"
            "  -Wwarning   set or reset (with 'no-' prefix) 'warning' (see man page)\n"
            "  -w          disable all warnings\n"
+#if defined CONFIG_TCC_RELAX || defined CONFIG_TCC_REGVARS
+           "  -O          optimize generated code\n"
+#endif
+#ifdef TCC_TARGET_I386
+           "  -msse2      use SSE2 registers for float and double\n"
+#endif
            "Preprocessor options:\n"
            "  -E          preprocess only\n"
            "  -Idir       add include path 'dir'\n"
@@ -79,6 +86,8 @@ static void help(void)
            "Misc options:\n"
            "  -MD         generate target dependencies for make\n"
            "  -MF depfile put generated dependencies here\n"
+           "  -M          only output dependencies, without compiling\n"
+           "  -MM         like -M, but omit system headers\n"
            );
 }
 
@@ -126,6 +135,8 @@ enum {
     TCC_OPTION_E,
     TCC_OPTION_MD,
     TCC_OPTION_MF,
+    TCC_OPTION_MM,
+    TCC_OPTION_M,
     TCC_OPTION_x,
 };
 
@@ -173,6 +184,8 @@ static const TCCOption tcc_options[] = {
     { "E", TCC_OPTION_E, 0},
     { "MD", TCC_OPTION_MD, 0},
     { "MF", TCC_OPTION_MF, TCC_OPTION_HAS_ARG },
+    { "MM", TCC_OPTION_MM, 0},
+    { "M", TCC_OPTION_M, 0},
     { "x", TCC_OPTION_x, TCC_OPTION_HAS_ARG },
     { NULL },
 };
@@ -391,7 +404,11 @@ static int parse_args(TCCState *s, int argc, char **argv)
                 s->soname = optarg;
                 break;
             case TCC_OPTION_m:
-                m_option = optarg;
+                if (tcc_set_mflag(s, optarg, 1) < 0)
+                    m_option = optarg;
+                break;
+            case TCC_OPTION_O:
+                s->optimize = *optarg >= '0' && *optarg <= '9' ? atoi(optarg) : 1;
                 break;
             case TCC_OPTION_o:
                 multiple_files = 1;
@@ -457,6 +474,14 @@ static int parse_args(TCCState *s, int argc, char **argv)
             case TCC_OPTION_MF:
                 deps_outfile = optarg;
                 break;
+            case TCC_OPTION_MM:
+                scan_deps = 2;
+                output_type = TCC_OUTPUT_PREPROCESS;
+                break;
+            case TCC_OPTION_M:
+                scan_deps = 1;
+                output_type = TCC_OUTPUT_PREPROCESS;
+                break;
             case TCC_OPTION_x:
                 break;
             default:
@@ -493,6 +518,36 @@ int unlink(const char* path)
 
 #endif
 
+/* -M: print the make rule of 'filename' without compiling it */
+static int print_deps(TCCState *s, const char *filename)
+{
+    char **deps, *target, *path;
+    int i, j, n, len;
+
+    n = tcc_scan_deps(s, filename, &deps);
+    if (n < 0)
+        return -1;
+    target = tcc_default_target(s, filename);
+    fprintf(s->outfile, "%s : \\\n", target);
+    for(i = 0; i < n; i++) {
+        if (scan_deps == 2) {
+            /* -MM: skip the files of the system include paths */
+            for(j = 0; j < s->nb_sysinclude_paths; j++) {
+                path = s->sysinclude_paths[j];
+                len = strlen(path);
+                if (!strncmp(deps[i], path, len) && deps[i][len] == '/')
+                    break;
+            }
+            if (j < s->nb_sysinclude_paths)
+                continue;
+        }
+        fprintf(s->outfile, "\t%s \\\n", deps[i]);
+    }
+    fprintf(s->outfile, "\n");
+    tcc_free(target);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -556,6 +611,10 @@ int main(int argc, char **argv)
     }
     
     if (output_type == TCC_OUTPUT_PREPROCESS) {
+        if (scan_deps && deps_outfile) {
+            tcc_free(outfile);
+            outfile = tcc_strdup(deps_outfile);
+        }
         if (!outfile) {
             s->outfile = stdout;
         } else {
@@ -585,7 +644,10 @@ int main(int argc, char **argv)
         } else {
             if (1 == s->verbose)
                 printf("-> %s\n", filename);
-            if (tcc_add_file(s, filename) < 0)
+            if (scan_deps) {
+                if (print_deps(s, filename) < 0)
+                    ret = 1;
+            } else if (tcc_add_file(s, filename) < 0)
                 ret = 1;
             if (!default_file)
                 default_file = filename;
@@ -39,6 +39,7 @@
 #include <math.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <setjmp.h>
 #include <time.h>
 
@@ -69,6 +70,32 @@
 
 #ifdef __native_client__
 #include <nacl/nacl_dyncode.h>
+#include <pthread.h>
+#endif
+
+/* the state of a compilation is per thread (see ST_TLS), so that
+   TCCStates used by different threads can compile at the same time */
+#if defined __GNUC__ && !defined __TINYC__ && !defined CONFIG_TCC_NO_THREADS
+#define TCC_HAVE_THREADS
+#ifdef _WIN32
+typedef DWORD tcc_thread_t;
+#define tcc_thread_self() GetCurrentThreadId()
+#define tcc_thread_equal(a, b) ((a) == (b))
+#else
+#include <pthread.h>
+typedef pthread_t tcc_thread_t;
+#define tcc_thread_self() pthread_self()
+#define tcc_thread_equal(a, b) pthread_equal(a, b)
+#endif
+#endif
+
+/* vector units used by the lexer fast paths */
+#if defined __GNUC__ && !defined __TINYC__
+# if defined __AVX2__
+#  include <immintrin.h>
+# elif defined __SSE2__
+#  include <emmintrin.h>
+# endif
 #endif
 
 #endif /* !CONFIG_TCCBOOT */
@@ -133,6 +160,20 @@
 #define CONFIG_TCC_ASM
 #endif
 
+/* define it to shrink x86 branches to their rel8 form (NaCl bundles
+   and win64 unwind data are laid out before, so not there) */
+#if (defined(TCC_TARGET_I386) || defined(TCC_TARGET_X86_64)) && \
+    !defined(__native_client__) && \
+    !(defined(TCC_TARGET_PE) && defined(TCC_TARGET_X86_64))
+#define CONFIG_TCC_RELAX
+#endif
+
+/* define it to keep the scalar locals whose address is never taken in
+   callee saved registers at -O */
+#if defined(TCC_TARGET_X86_64) && !defined(TCC_TARGET_PE)
+#define CONFIG_TCC_REGVARS
+#endif
+
 /* object format selection */
 #if defined(TCC_TARGET_C67)
 #define TCC_TARGET_COFF
@@ -221,7 +262,7 @@ typedef int BOOL;
 #define STRING_MAX_SIZE     1024
 #define PACK_STACK_SIZE     8
 
-#define TOK_HASH_SIZE       8192 /* must be a power of two */
+#define TOK_HASH_SIZE       8192 /* initial size, must be a power of two */
 #define TOK_ALLOC_INCR      512  /* must be a power of two */
 #define TOK_MAX_SIZE        4 /* token max size in int unit when stored in string */
 
@@ -250,6 +291,14 @@ typedef struct CString {
     void *data_allocated; /* if non NULL, data has been malloced */
 } CString;
 
+/* SHA-256, for the compile cache */
+#define HASH_SIZE 32
+typedef struct HashState {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+} HashState;
+
 /* type definition */
 typedef struct CType {
     int t;
@@ -284,7 +333,10 @@ typedef struct SValue {
 /* symbol management */
 typedef struct Sym {
     int v;    /* symbol token */
-    char *asm_label;    /* associated asm label */
+    union {
+        char *asm_label;    /* associated asm label */
+        struct MacroMemo *memo; /* expansion of an object-like macro */
+    };
     long r;    /* associated register */
     union {
         long c;    /* associated number */
@@ -350,6 +402,7 @@ typedef struct AttributeDef {
       fill          : 11;
     struct Section *section;
     int alias_target;    /* token */
+    int vector_size;     /* vector_size attribute, in bytes */
 } AttributeDef;
 
 /* gr: wrappers for casting sym->r for other purposes */
@@ -396,10 +449,26 @@ typedef struct AttributeDef {
 
 #define IO_BUF_SIZE 8192
 
+/* whole contents of a source file, shared by the BufferedFiles reading
+   it and kept across compilations while the file is unchanged */
+typedef struct FileData {
+    struct FileData *next;
+    int refcount;
+    int kept;               /* in the table, kept when no longer used */
+    dev_t dev;
+    ino_t ino;              /* 0 if the file system has none */
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    uint8_t *data;          /* 'size' bytes followed by CH_EOB */
+    unsigned long map_size; /* length of the mapping, 0 if allocated */
+} FileData;
+
 typedef struct BufferedFile {
     uint8_t *buf_ptr;
     uint8_t *buf_end;
     int fd;
+    FileData *fdata; /* whole file, if not read through 'buffer' */
     struct BufferedFile *prev;
     int line_num;    /* current line number - here to simplify code */
     int ifndef_macro;  /* #ifndef macro / #endif search */
@@ -408,7 +477,7 @@ typedef struct BufferedFile {
     char inc_type;          /* type of include */
     char inc_filename[512]; /* filename specified by the user */
     char filename[1024];    /* current filename - here to simplify code */
-    unsigned char buffer[IO_BUF_SIZE + 1]; /* extra size for CH_EOB char */
+    unsigned char buffer[1]; /* extra size for CH_EOB char */
 } BufferedFile;
 
 #define CH_EOB   '\\'       /* end of buffer or '\0' char in file */
@@ -442,7 +511,11 @@ typedef struct InlineFunc {
    inclusion if the include file is protected by #ifndef ... #endif */
 typedef struct CachedInclude {
     int ifndef_macro;
+    int once; /* #pragma once */
+    dev_t dev; /* file identity, if ino != 0 */
+    ino_t ino;
     int hash_next; /* -1 if none */
+    int id_hash_next;
     char type; /* '"' or '>' to give include type */
     char filename[1]; /* path specified in #include */
 } CachedInclude;
@@ -563,6 +636,14 @@ struct TCCState {
     int verbose;
     /* compile with debug symbol (and use them if error during execution) */
     int do_debug;
+    /* optimization level (-O) */
+    int optimize;
+    /* keep float and double in SSE2 registers (-msse2, i386) */
+    int sse2;
+    /* largest copy or fill expanded to moves (-finline-copy-limit) */
+    int inline_copy_limit;
+    /* turn calls in tail position into jumps (-foptimize-sibling-calls) */
+    int optimize_sibling_calls;
 #ifdef CONFIG_TCC_BCHECK
     /* compile with built-in memory and bounds checker */
     int do_bounds_check;
@@ -588,6 +669,7 @@ struct TCCState {
 
     /* see cached_includes */
     int cached_includes_hash[CACHED_INCLUDES_HASH_SIZE];
+    int cached_includes_id_hash[CACHED_INCLUDES_HASH_SIZE];
 
     /* pack stack */
     int pack_stack[PACK_STACK_SIZE];
@@ -595,14 +677,35 @@ struct TCCState {
 
     /* output file for preprocessing */
     FILE *outfile;
+    /* or function receiving the preprocessed text */
+    void *pp_opaque;
+    void (*pp_write_func)(void *opaque, const char *buf, int len);
 
     /* automatically collected dependencies for this compilation */
     char **target_deps;
     int nb_target_deps;
 
+    /* for the compile cache: hash of the -D/-U given so far, the
+       messages of the compilation being cached, and whether it
+       expanded __DATE__ or __TIME__ */
+    uint8_t defines_hash[HASH_SIZE];
+    CString *cache_log;
+    int uncacheable;
+
+#ifdef TCC_HAVE_THREADS
+    /* the thread whose globals hold the compilation state */
+    tcc_thread_t owner;
+#endif
+
     /* for tcc_relocate */
     int runtime_added;
     void *runtime_mem;
+#ifdef __native_client__
+    unsigned long runtime_size;
+    /* extent of the data sections */
+    void *runtime_data;
+    unsigned long runtime_data_size;
+#endif
 #ifdef HAVE_SELINUX
     void *write_mem;
     unsigned long mem_size;
@@ -648,6 +751,7 @@ struct TCCState {
 #define VT_CMP       0x0033  /* the value is stored in processor flags (in vc) */
 #define VT_JMP       0x0034  /* value is the consequence of jmp true (even) */
 #define VT_JMPI      0x0035  /* value is the consequence of jmp false (odd) */
+#define VT_REGVAR    0x0036  /* lvalue held in the callee saved register vc */
 #define VT_REF       0x0040  /* value is pointer to structure rather than address */
 #define VT_LVAL      0x0100  /* var is an lvalue */
 #define VT_SYM       0x0200  /* a symbol value is added */
@@ -735,6 +839,7 @@ struct TCCState {
 #define TOK_LSTR     0xb8
 #define TOK_CFLOAT   0xb9 /* float constant */
 #define TOK_LINENUM  0xba /* line number info */
+#define TOK_PACK     0xbb /* '#pragma pack' value, see regvar_scan() */
 #define TOK_CDOUBLE  0xc0 /* double constant */
 #define TOK_CLDOUBLE 0xc1 /* long double constant */
 #define TOK_UMULL    0xc2 /* unsigned 32x32 -> 64 mul */
@@ -932,14 +1037,20 @@ static inline int toup(int c)
 # define PUB_FUNC
 #endif
 
+#ifdef TCC_HAVE_THREADS
+#define ST_TLS __thread
+#else
+#define ST_TLS
+#endif
+
 #ifdef ONE_SOURCE
 #define ST_INLN static inline
 #define ST_FUNC static
-#define ST_DATA static
+#define ST_DATA static ST_TLS
 #else
 #define ST_INLN
 #define ST_FUNC
-#define ST_DATA extern
+#define ST_DATA extern ST_TLS
 #endif
 
 /* ------------ libtcc.c ------------ */
@@ -960,6 +1071,7 @@ ST_DATA void *rt_prog_main;
 #define AFF_PRINT_ERROR     0x0001 /* print error if file not found */
 #define AFF_REFERENCED_DLL  0x0002 /* load a referenced dll from another dll */
 #define AFF_PREPROCESS      0x0004 /* preprocess file */
+#define AFF_SCAN_DEPS       0x0008 /* only collect dependencies */
 
 /* public functions currently used by the tcc main function */
 PUB_FUNC char *pstrcpy(char *buf, int buf_size, const char *s);
@@ -983,6 +1095,7 @@ PUB_FUNC void dynarray_reset(void *pp, int *n);
 PUB_FUNC void tcc_error_noabort(const char *fmt, ...);
 PUB_FUNC void tcc_error(const char *fmt, ...);
 PUB_FUNC void tcc_warning(const char *fmt, ...);
+ST_FUNC int tcc_check_state(TCCState *s1);
 
 /* other utilities */
 ST_INLN void cstr_ccat(CString *cstr, int ch);
@@ -1023,6 +1136,7 @@ ST_FUNC int tcc_add_dll(TCCState *s, const char *filename, int flags);
 #endif
 
 PUB_FUNC int tcc_set_flag(TCCState *s, const char *flag_name, int value);
+PUB_FUNC int tcc_set_mflag(TCCState *s, const char *flag_name, int value);
 PUB_FUNC void tcc_print_stats(TCCState *s, int64_t total_time);
 PUB_FUNC char *tcc_default_target(TCCState *s, const char *default_file);
 PUB_FUNC void tcc_gen_makedeps(TCCState *s, const char *target, const char *filename);
@@ -1066,6 +1180,7 @@ ST_FUNC void restore_parse_state(ParseState *s);
 ST_INLN void tok_str_new(TokenString *s);
 ST_FUNC void tok_str_free(int *str);
 ST_FUNC void tok_str_add(TokenString *s, int t);
+ST_FUNC void tok_str_add2(TokenString *s, int t, CValue *cv);
 ST_FUNC void tok_str_add_tok(TokenString *s);
 ST_INLN void define_push(int v, int macro_type, int *str, Sym *first_arg);
 ST_FUNC void define_undef(Sym *s);
@@ -1082,6 +1197,18 @@ ST_INLN void unget_tok(int last_tok);
 ST_FUNC void preprocess_init(TCCState *s1);
 ST_FUNC void preprocess_new();
 ST_FUNC int tcc_preprocess(TCCState *s1);
+ST_FUNC int tcc_preprocess_deps(TCCState *s1);
+ST_FUNC int tcc_pp_snapshot_save(TCCState *s1, const char *filename);
+ST_FUNC int tcc_pp_snapshot_load(TCCState *s1, const char *filename);
+ST_FUNC void tcc_pp_snapshot_replay(void);
+ST_FUNC void tcc_pp_snapshot_free(void);
+ST_FUNC const void *tcc_pp_snapshot_data(unsigned long *psize);
+ST_FUNC void include_cache_flush(void);
+ST_FUNC void tok_hash_stats(int *size, int *used, int *max_chain, double *avg_probes);
+ST_FUNC void tok_hash_free(void);
+ST_FUNC void tok_arena_enable(void);
+ST_FUNC void tok_arena_reset(void);
+ST_FUNC void tok_arena_free(void);
 ST_FUNC void skip(int c);
 ST_FUNC void expect(const char *msg);
 
@@ -1121,6 +1248,7 @@ ST_DATA int nocode_wanted; /* true if no code generation wanted for an expressio
 ST_DATA int global_expr;  /* true if compound literals must be allocated globally (used during initializers parsing */
 ST_DATA CType func_vt; /* current function return type (used by return instruction) */
 ST_DATA int func_vc;
+ST_DATA int tail_call; /* gfunc_call() may leave the frame and jump to the function */
 ST_DATA int last_line_num, last_ind, func_ind; /* debug last line number and pc */
 ST_DATA char *funcname;
 
@@ -1133,7 +1261,9 @@ ST_FUNC Sym *external_global_sym(int v, CType *type, int r);
 ST_FUNC void vset(CType *type, int r, int v);
 ST_FUNC void vswap(void);
 ST_FUNC void vpush_global_sym(CType *type, int v);
+ST_FUNC void vrotb(int n);
 ST_FUNC void vrott(int n);
+ST_FUNC void lexpand(void);
 #ifdef TCC_TARGET_ARM
 ST_FUNC int get_reg_ex(int rc, int rc2);
 ST_FUNC void vnrott(int n);
@@ -1147,6 +1277,8 @@ ST_FUNC int gv(int rc);
 ST_FUNC void gv2(int rc1, int rc2);
 ST_FUNC void vpop(void);
 ST_FUNC void gen_op(int op);
+ST_FUNC int div_magic(unsigned long long d, int bits, int is_signed,
+                      unsigned long long *pm, int *ps);
 ST_FUNC int type_size(CType *type, int *a);
 ST_FUNC void mk_pointer(CType *type);
 ST_FUNC void vstore(void);
@@ -1161,6 +1293,22 @@ ST_FUNC void gexpr(void);
 ST_FUNC int expr_const(void);
 ST_FUNC void gen_inline_functions(void);
 ST_FUNC void decl(int l);
+#ifdef CONFIG_TCC_RELAX
+ST_FUNC void add_branch(int pos);
+/* instructions seen by the peephole pass (with hardware registers) */
+#define PEEP_LOAD  1 /* r = c(%ebp) */
+#define PEEP_STORE 2 /* c(%ebp) = r */
+#define PEEP_MOV   3 /* r = c (register) */
+#define PEEP_LL    4 /* 64 bit operands */
+ST_FUNC void add_peep(int start, int op, int r, int c);
+#ifdef CONFIG_TCC_REGVARS
+ST_FUNC void del_code(int pos, int size);
+#endif
+#endif
+#ifdef CONFIG_TCC_REGVARS
+ST_DATA int func_regvars; /* true if locals may be kept in registers */
+ST_FUNC int alloc_regvar(int v, CType *type);
+#endif
 #if defined CONFIG_TCC_BCHECK || defined TCC_TARGET_C67
 ST_FUNC Sym *get_sym_ref(CType *type, Section *sec, unsigned long offset, unsigned long size);
 #endif
@@ -1196,6 +1344,8 @@ ST_FUNC void relocate_section(TCCState *s1, Section *s);
 
 ST_FUNC void tcc_add_linker_symbols(TCCState *s1);
 ST_FUNC int tcc_load_object_file(TCCState *s1, int fd, unsigned long file_offset);
+ST_FUNC int tcc_load_object_mem(TCCState *s1, const void *data, unsigned long size);
+ST_FUNC int tcc_output_object(TCCState *s1, FILE *f);
 ST_FUNC int tcc_load_archive(TCCState *s1, int fd);
 ST_FUNC void *tcc_get_symbol_err(TCCState *s, const char *name);
 ST_FUNC void tcc_add_bcheck(TCCState *s1);
@@ -1262,6 +1412,16 @@ ST_FUNC void gen_le16(int c);
 ST_FUNC void gen_le32(int c);
 ST_FUNC void gen_addr32(int r, Sym *sym, int c);
 ST_FUNC void gen_addrpc32(int r, Sym *sym, int c);
+ST_FUNC int gen_opv(int op, SValue *dest);
+ST_FUNC int gen_memcpy(int size);
+ST_FUNC int gen_memset(int size);
+#ifdef __native_client__
+ST_FUNC void opadding(void);
+#endif
+#endif
+#ifdef TCC_TARGET_I386
+ST_FUNC int gen_divl(int op);
+ST_FUNC int gen_shiftl(int op);
 #endif
 
 #ifdef CONFIG_TCC_BCHECK
@@ -1272,6 +1432,10 @@ ST_FUNC void gen_bounded_ptr_deref(void);
 /* ------------ x86_64-gen.c ------------ */
 #ifdef TCC_TARGET_X86_64
 ST_FUNC void gen_addr64(int r, Sym *sym, int64_t c);
+#ifdef CONFIG_TCC_REGVARS
+ST_FUNC int get_regvar(void);
+ST_FUNC void free_regvar(int r);
+#endif
 #endif
 
 /* ------------ arm-gen.c ------------ */
@@ -1321,6 +1485,13 @@ ST_FUNC void pe_add_unwind_data(unsigned start, unsigned end, unsigned stack);
 #endif
 #endif
 
+/* ------------ tcccache.c ----------------- */
+ST_FUNC void hash_init(HashState *c);
+ST_FUNC void hash_update(HashState *c, const void *data, unsigned long size);
+ST_FUNC void hash_final(HashState *c, uint8_t *out);
+ST_FUNC void hash_str(HashState *c, const char *str);
+ST_FUNC int tcc_cache_compile(TCCState *s1, int (*compile)(TCCState *s1));
+
 /* ------------ tccrun.c ----------------- */
 #ifdef CONFIG_TCC_STATIC
 #define RTLD_LAZY       0x001
@@ -1335,6 +1506,9 @@ ST_FUNC void *resolve_sym(TCCState *s1, const char *symbol);
 #elif !defined TCC_TARGET_PE || !defined _WIN32
 ST_FUNC void *resolve_sym(TCCState *s1, const char *symbol);
 #endif
+#ifdef __native_client__
+ST_FUNC void tcc_free_runtime(TCCState *s1);
+#endif
 /********************************************************/
 /* include the target specific definitions */
 
@@ -1359,9 +1533,9 @@ ST_DATA const int reg_classes[NB_REGS];
 /********************************************************/
 #undef ST_DATA
 #ifdef ONE_SOURCE
-#define ST_DATA static
+#define ST_DATA static ST_TLS
 #else
-#define ST_DATA
+#define ST_DATA ST_TLS
 #endif
 /********************************************************/
 #endif /* _TCC_H */
@@ -0,0 +1,808 @@
+/*
+ *  TCC - Tiny C Compiler - Cache of compiled files
+ *
+ *  Copyright (c) 2001-2004 Fabrice Bellard
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "tcc.h"
+#ifdef _WIN32
+#include <process.h> /* getpid */
+#endif
+
+/* A compiled C file is cached under the hash of what decides its
+   compilation: the tcc build, the options, the -D/-U given, the
+   include paths, the preprocessor snapshot, the file name and the
+   source text.  The entry holds the object file produced, the
+   warnings printed, and the files and directories the compilation
+   depended on: the files included, the include paths and the
+   directories a quoted include looks into first.  It is used again as long as those are
+   unchanged: loading the object then replaces preprocessing, parsing
+   and code generation.  The code is still relocated for each
+   TCCState since it does not land at the same address twice.  A
+   compilation which expands __DATE__ or __TIME__ is not cached.
+
+   The entries are kept in memory in LRU order and, optionally, in a
+   directory where they outlive the process.  The cache is shared by
+   all threads. */
+
+#define CACHE_MAGIC "TCCCACH1"
+#define CACHE_BUCKETS 256
+
+/* the build: a cache directory may outlive it */
+static const char cache_build[] =
+    "tcc " TCC_VERSION " " __DATE__ " " __TIME__;
+
+typedef struct CacheHeader {
+    char magic[8];
+    uint8_t key[HASH_SIZE];
+    uint8_t obj_hash[HASH_SIZE]; /* checked when read from disk */
+    uint32_t nb_deps;
+    uint32_t deps_size;          /* CacheDep records */
+    uint32_t log_size;           /* warnings, each one nul terminated */
+    uint32_t obj_size;
+} CacheHeader;
+
+/* a file or include directory the compilation depended on, followed
+   by its nul terminated name, padded to 8 bytes */
+typedef struct CacheDep {
+    int64_t mtime;               /* CACHE_NO_MTIME: compare the contents */
+    uint64_t size;
+    uint8_t hash[HASH_SIZE];     /* of the contents of a file */
+    uint32_t is_dir;
+    uint32_t len;                /* of the record */
+} CacheDep;
+
+#define CACHE_NO_MTIME ((int64_t)-1)
+#define CACHE_DIR_MISSING ((int64_t)-2)
+
+typedef struct CacheEntry {
+    struct CacheEntry *hash_next;
+    struct CacheEntry *lru_prev, *lru_next;
+    int refcount;                /* users, plus one while cached */
+    uint8_t key[HASH_SIZE];
+    uint8_t *data;               /* CacheHeader, deps, log and object */
+    unsigned long size;
+} CacheEntry;
+
+/* shared by all threads and guarded by the cache lock */
+static CacheEntry *cache_hash[CACHE_BUCKETS];
+static CacheEntry cache_lru = { NULL, &cache_lru, &cache_lru };
+static int cache_nb_entries;
+static int cache_max_entries;
+static char *cache_dir;
+
+#ifndef TCC_HAVE_THREADS
+#define cache_lock()
+#define cache_unlock()
+#elif defined _WIN32
+static CRITICAL_SECTION cache_mutex;
+static int cache_mutex_init;
+/* set up by the first tcc_set_compile_cache() */
+#define cache_lock() \
+    (cache_mutex_init ? EnterCriticalSection(&cache_mutex) : (void)0)
+#define cache_unlock() \
+    (cache_mutex_init ? LeaveCriticalSection(&cache_mutex) : (void)0)
+#else
+#include <pthread.h>
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define cache_lock() pthread_mutex_lock(&cache_mutex)
+#define cache_unlock() pthread_mutex_unlock(&cache_mutex)
+#endif
+
+/* ------------------------------------------------------------- */
+/* SHA-256 */
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha_block(HashState *c, const uint8_t *p)
+{
+    uint32_t w[64], v[8], t1, t2, s0, s1;
+    int i;
+
+    for(i = 0; i < 16; i++, p += 4)
+        w[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    for(; i < 64; i++) {
+        s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    memcpy(v, c->h, sizeof v);
+    for(i = 0; i < 64; i++) {
+        t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25)) +
+            ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha_k[i] + w[i];
+        t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22)) +
+            ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for(i = 0; i < 8; i++)
+        c->h[i] += v[i];
+}
+
+ST_FUNC void hash_init(HashState *c)
+{
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->h, h0, sizeof h0);
+    c->len = 0;
+}
+
+ST_FUNC void hash_update(HashState *c, const void *data, unsigned long size)
+{
+    const uint8_t *p = data;
+    int n;
+
+    n = c->len & 63;
+    c->len += size;
+    if (n) {
+        if (size < 64 - n) {
+            memcpy(c->buf + n, p, size);
+            return;
+        }
+        memcpy(c->buf + n, p, 64 - n);
+        sha_block(c, c->buf);
+        p += 64 - n;
+        size -= 64 - n;
+    }
+    for(; size >= 64; p += 64, size -= 64)
+        sha_block(c, p);
+    memcpy(c->buf, p, size);
+}
+
+ST_FUNC void hash_final(HashState *c, uint8_t *out)
+{
+    uint64_t bits;
+    uint8_t pad[72];
+    int i, n;
+
+    bits = c->len * 8;
+    n = c->len & 63;
+    n = (n < 56 ? 56 : 120) - n;
+    memset(pad, 0, n);
+    pad[0] = 0x80;
+    for(i = 0; i < 8; i++)
+        pad[n + i] = bits >> (56 - 8 * i);
+    hash_update(c, pad, n + 8);
+    for(i = 0; i < 8; i++) {
+        out[4*i] = c->h[i] >> 24;
+        out[4*i+1] = c->h[i] >> 16;
+        out[4*i+2] = c->h[i] >> 8;
+        out[4*i+3] = c->h[i];
+    }
+}
+
+/* strings are hashed with their nul so that they cannot run together */
+ST_FUNC void hash_str(HashState *c, const char *str)
+{
+    hash_update(c, str, strlen(str) + 1);
+}
+
+static void hash_int(HashState *c, int v)
+{
+    hash_update(c, &v, sizeof v);
+}
+
+/* ------------------------------------------------------------- */
+
+/* read a whole file, or return NULL */
+static uint8_t *cache_read_file(const char *filename, unsigned long *psize)
+{
+    struct stat st;
+    uint8_t *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        return NULL;
+    data = NULL;
+    if (fstat(fd, &st) == 0) {
+        data = tcc_malloc(st.st_size + 1);
+        if (read(fd, data, st.st_size) != st.st_size) {
+            tcc_free(data);
+            data = NULL;
+        }
+        *psize = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+static int cache_hash_file(const char *filename, uint8_t *hash)
+{
+    HashState c;
+    unsigned long size;
+    uint8_t *data;
+
+    data = cache_read_file(filename, &size);
+    if (!data)
+        return -1;
+    hash_init(&c);
+    hash_update(&c, data, size);
+    hash_final(&c, hash);
+    tcc_free(data);
+    return 0;
+}
+
+/* true if nothing was compiled into 's1' yet, so that its object file
+   holds only the file being compiled */
+static int cache_state_empty(TCCState *s1)
+{
+    Section *s;
+    int i;
+
+    for(i = 1; i < s1->nb_sections; i++) {
+        s = s1->sections[i];
+        if (s == symtab_section) {
+            if (s->data_offset > sizeof(ElfW(Sym)))
+                return 0;
+        } else if (s != symtab_section->link && s != symtab_section->hash) {
+            if (s->data_offset)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static void cache_key(TCCState *s1, uint8_t *key)
+{
+    HashState c;
+    const void *snapshot;
+    unsigned long size;
+    int i;
+
+    hash_init(&c);
+    hash_str(&c, cache_build);
+    hash_int(&c, EM_TCC_TARGET);
+    hash_int(&c, PTR_SIZE);
+    hash_int(&c, s1->output_type);
+    hash_int(&c, s1->char_is_unsigned);
+    hash_int(&c, s1->leading_underscore);
+    hash_int(&c, s1->nocommon);
+    hash_int(&c, s1->nostdinc);
+    hash_int(&c, s1->do_debug);
+#ifdef CONFIG_TCC_BCHECK
+    hash_int(&c, s1->do_bounds_check);
+#endif
+    hash_int(&c, s1->optimize);
+    hash_int(&c, s1->sse2);
+    hash_int(&c, s1->inline_copy_limit);
+    hash_int(&c, s1->optimize_sibling_calls);
+    hash_int(&c, s1->warn_write_strings);
+    hash_int(&c, s1->warn_unsupported);
+    hash_int(&c, s1->warn_error);
+    hash_int(&c, s1->warn_none);
+    hash_int(&c, s1->warn_implicit_function_declaration);
+    hash_update(&c, s1->defines_hash, HASH_SIZE);
+    hash_int(&c, s1->nb_include_paths);
+    for(i = 0; i < s1->nb_include_paths; i++)
+        hash_str(&c, s1->include_paths[i]);
+    hash_int(&c, s1->nb_sysinclude_paths);
+    for(i = 0; i < s1->nb_sysinclude_paths; i++)
+        hash_str(&c, s1->sysinclude_paths[i]);
+    snapshot = tcc_pp_snapshot_data(&size);
+    hash_int(&c, snapshot != NULL);
+    if (snapshot)
+        hash_update(&c, snapshot, size);
+    hash_str(&c, file->filename);
+    hash_update(&c, file->buf_ptr, file->buf_end - file->buf_ptr);
+    hash_final(&c, key);
+}
+
+static void cache_path(char *buf, int size, const uint8_t *key)
+{
+    char hex[2 * HASH_SIZE + 1];
+    int i;
+
+    for(i = 0; i < HASH_SIZE; i++)
+        sprintf(hex + 2 * i, "%02x", key[i]);
+    snprintf(buf, size, "%s/%s.tcache", cache_dir, hex);
+}
+
+/* check the layout of an entry read from disk */
+static int cache_check(const uint8_t *data, unsigned long size,
+                       const uint8_t *key)
+{
+    const CacheHeader *hdr;
+    const CacheDep *dep;
+    HashState c;
+    uint8_t hash[HASH_SIZE];
+    unsigned long off, end;
+    uint32_t i;
+
+    hdr = (const CacheHeader *)data;
+    if (size < sizeof(CacheHeader) ||
+        memcmp(hdr->magic, CACHE_MAGIC, sizeof hdr->magic) ||
+        memcmp(hdr->key, key, HASH_SIZE) ||
+        size != sizeof(CacheHeader) + (unsigned long)hdr->deps_size +
+                hdr->log_size + hdr->obj_size)
+        return -1;
+    off = sizeof(CacheHeader);
+    end = off + hdr->deps_size;
+    for(i = 0; i < hdr->nb_deps; i++) {
+        dep = (const CacheDep *)(data + off);
+        if (end - off < sizeof(CacheDep) || dep->len > end - off ||
+            dep->len <= sizeof(CacheDep) || (dep->len & 7) ||
+            data[off + dep->len - 1] != '\0')
+            return -1;
+        off += dep->len;
+    }
+    if (off != end ||
+        (hdr->log_size && data[end + hdr->log_size - 1] != '\0'))
+        return -1;
+    hash_init(&c);
+    hash_update(&c, data + end + hdr->log_size, hdr->obj_size);
+    hash_final(&c, hash);
+    return memcmp(hash, hdr->obj_hash, HASH_SIZE) ? -1 : 0;
+}
+
+static void cache_unref(CacheEntry *e)
+{
+    if (--e->refcount == 0) {
+        tcc_free(e->data);
+        tcc_free(e);
+    }
+}
+
+static void cache_remove(CacheEntry *e)
+{
+    CacheEntry **pe;
+
+    for(pe = &cache_hash[e->key[0]]; *pe != e; pe = &(*pe)->hash_next);
+    *pe = e->hash_next;
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    cache_nb_entries--;
+    cache_unref(e);
+}
+
+static void cache_trim(void)
+{
+    while (cache_nb_entries > cache_max_entries)
+        cache_remove(cache_lru.lru_prev);
+}
+
+static CacheEntry *cache_find(const uint8_t *key)
+{
+    CacheEntry *e;
+
+    for(e = cache_hash[key[0]]; e; e = e->hash_next) {
+        if (!memcmp(e->key, key, HASH_SIZE))
+            return e;
+    }
+    return NULL;
+}
+
+/* cache the entry 'data' under 'key', replacing the one there, and
+   return it with a reference for the caller. The data is taken over,
+   unless the memory cache is off and NULL is returned. */
+static CacheEntry *cache_insert(const uint8_t *key,
+                                uint8_t *data, unsigned long size)
+{
+    CacheEntry *e;
+
+    cache_lock();
+    if (cache_max_entries <= 0) {
+        cache_unlock();
+        return NULL;
+    }
+    e = cache_find(key);
+    if (e)
+        cache_remove(e);
+    e = tcc_mallocz(sizeof(CacheEntry));
+    memcpy(e->key, key, HASH_SIZE);
+    e->data = data;
+    e->size = size;
+    e->refcount = 2;
+    e->hash_next = cache_hash[key[0]];
+    cache_hash[key[0]] = e;
+    e->lru_next = cache_lru.lru_next;
+    e->lru_prev = &cache_lru;
+    e->lru_next->lru_prev = e;
+    cache_lru.lru_next = e;
+    cache_nb_entries++;
+    cache_trim();
+    cache_unlock();
+    return e;
+}
+
+static void cache_release(CacheEntry *e)
+{
+    cache_lock();
+    cache_unref(e);
+    cache_unlock();
+}
+
+/* find the entry for 'key' in memory, then on disk */
+static CacheEntry *cache_lookup(const uint8_t *key)
+{
+    CacheEntry *e;
+    char path[1024];
+    uint8_t *data;
+    unsigned long size;
+
+    cache_lock();
+    e = cache_find(key);
+    if (e) {
+        /* most recently used */
+        e->lru_prev->lru_next = e->lru_next;
+        e->lru_next->lru_prev = e->lru_prev;
+        e->lru_next = cache_lru.lru_next;
+        e->lru_prev = &cache_lru;
+        e->lru_next->lru_prev = e;
+        cache_lru.lru_next = e;
+        e->refcount++;
+        cache_unlock();
+        return e;
+    }
+    path[0] = '\0';
+    if (cache_dir)
+        cache_path(path, sizeof path, key);
+    cache_unlock();
+
+    if (!path[0])
+        return NULL;
+    data = cache_read_file(path, &size);
+    if (!data)
+        return NULL;
+    if (cache_check(data, size, key) < 0) {
+        tcc_free(data);
+        return NULL;
+    }
+    e = cache_insert(key, data, size);
+    if (!e) {
+        /* not kept in memory: a private entry */
+        e = tcc_mallocz(sizeof(CacheEntry));
+        memcpy(e->key, key, HASH_SIZE);
+        e->data = data;
+        e->size = size;
+        e->refcount = 1;
+    }
+    return e;
+}
+
+/* true if the files and directories of the entry are unchanged */
+static int cache_valid(const uint8_t *data)
+{
+    const CacheHeader *hdr;
+    const CacheDep *dep;
+    const char *name;
+    struct stat st;
+    uint8_t hash[HASH_SIZE];
+    unsigned long off;
+    uint32_t i;
+
+    hdr = (const CacheHeader *)data;
+    off = sizeof(CacheHeader);
+    for(i = 0; i < hdr->nb_deps; i++, off += dep->len) {
+        dep = (const CacheDep *)(data + off);
+        name = (const char *)(dep + 1);
+        if (stat(name, &st) != 0) {
+            if (dep->is_dir && dep->mtime == CACHE_DIR_MISSING)
+                continue;
+            return 0;
+        }
+        if (dep->is_dir) {
+            if (dep->mtime != (int64_t)st.st_mtime)
+                return 0;
+            continue;
+        }
+        if (dep->size != (uint64_t)st.st_size)
+            return 0;
+        if (dep->mtime != CACHE_NO_MTIME &&
+            dep->mtime == (int64_t)st.st_mtime)
+            continue;
+        if (cache_hash_file(name, hash) < 0 ||
+            memcmp(hash, dep->hash, HASH_SIZE))
+            return 0;
+    }
+    return 1;
+}
+
+static void cache_cat(CString *cstr, const void *data, int size)
+{
+    const uint8_t *p = data;
+
+    while (size-- > 0)
+        cstr_ccat(cstr, *p++);
+}
+
+/* add a dependency record to 'deps'. Return non zero if the entry
+   cannot be made. */
+static int cache_add_dep(CString *deps, const char *name, int is_dir,
+                         time_t now)
+{
+    CacheDep dep;
+    struct stat st;
+    int len;
+
+    memset(&dep, 0, sizeof dep);
+    len = strlen(name) + 1;
+    dep.len = (sizeof dep + len + 7) & -8;
+    dep.is_dir = is_dir;
+    if (stat(name, &st) != 0) {
+        if (!is_dir)
+            return -1;
+        dep.mtime = CACHE_DIR_MISSING;
+    } else if (is_dir) {
+        /* a change within the same second could not be seen */
+        if (st.st_mtime >= now - 1)
+            return -1;
+        dep.mtime = st.st_mtime;
+    } else {
+        if (cache_hash_file(name, dep.hash) < 0)
+            return -1;
+        dep.size = st.st_size;
+        /* a recent file is compared by contents only */
+        dep.mtime = st.st_mtime >= now - 1 ? CACHE_NO_MTIME : st.st_mtime;
+    }
+    cache_cat(deps, &dep, sizeof dep);
+    cache_cat(deps, name, len);
+    while (deps->size & 7)
+        cstr_ccat(deps, '\0');
+    return 0;
+}
+
+/* add a dependency record for the directory of the file 'name' */
+static int cache_add_dir_of(CString *deps, const char *name, time_t now)
+{
+    char dir[1024];
+    int len;
+
+    len = tcc_basename(name) - name;
+    if (len == 0)
+        pstrcpy(dir, sizeof dir, ".");
+    else
+        pstrncpy(dir, name, len < sizeof dir ? len : sizeof dir - 1);
+    return cache_add_dep(deps, dir, 1, now);
+}
+
+/* write an entry to the cache directory, through a temporary file so
+   that readers never see a partial one */
+static void cache_write(const char *path, const uint8_t *data,
+                        unsigned long size)
+{
+    char tmp[1100];
+    FILE *f;
+    int ok;
+
+    snprintf(tmp, sizeof tmp, "%s.%d.%lx", path, (int)getpid(),
+             (unsigned long)(uplong)tmp);
+    f = fopen(tmp, "wb");
+    if (!f)
+        return;
+    ok = fwrite(data, 1, size, f) == size;
+    ok &= fclose(f) == 0;
+    if (ok) {
+#ifdef _WIN32
+        unlink(path);
+#endif
+        ok = rename(tmp, path) == 0;
+    }
+    if (!ok)
+        unlink(tmp);
+}
+
+/* make the entry for the file 'src' just compiled, from the
+   dependencies in s1->target_deps[first..] */
+static void cache_store(TCCState *s1, const uint8_t *key, const char *src,
+                        CString *log, int first)
+{
+    CacheHeader hdr;
+    CString deps;
+    HashState c;
+    CacheEntry *e;
+    FILE *f;
+    uint8_t *data, *obj;
+    unsigned long size, obj_size;
+    char path[1024];
+    const char *name;
+    time_t now;
+    int i, j, len, ok;
+
+    cstr_new(&deps);
+    memset(&hdr, 0, sizeof hdr);
+    now = time(NULL);
+    obj = NULL;
+    obj_size = 0;
+
+    /* the include directories first: they are cheap to check and one
+       just modified makes the entry impossible */
+    ok = 1;
+    for(i = 0; ok && i < s1->nb_include_paths; i++, hdr.nb_deps++)
+        ok = cache_add_dep(&deps, s1->include_paths[i], 1, now) == 0;
+    for(i = 0; ok && i < s1->nb_sysinclude_paths; i++, hdr.nb_deps++)
+        ok = cache_add_dep(&deps, s1->sysinclude_paths[i], 1, now) == 0;
+    /* a quoted include looks first in the directory of the includer */
+    if (ok) {
+        ok = cache_add_dir_of(&deps, src, now) == 0;
+        hdr.nb_deps++;
+    }
+    for(i = first; ok && i < s1->nb_target_deps; i++) {
+        name = s1->target_deps[i];
+        len = tcc_basename(name) - name;
+        for(j = first; j < i; j++) {
+            if (tcc_basename(s1->target_deps[j]) - s1->target_deps[j] == len
+                && !strncmp(s1->target_deps[j], name, len))
+                break;
+        }
+        if (j < i)
+            continue;
+        ok = cache_add_dir_of(&deps, name, now) == 0;
+        hdr.nb_deps++;
+    }
+    /* the files included */
+    for(i = first; ok && i < s1->nb_target_deps; i++) {
+        for(j = first; j < i; j++) {
+            if (!strcmp(s1->target_deps[i], s1->target_deps[j]))
+                break;
+        }
+        if (j < i)
+            continue;
+        ok = cache_add_dep(&deps, s1->target_deps[i], 0, now) == 0;
+        hdr.nb_deps++;
+    }
+
+    /* the object file */
+    if (ok) {
+        f = tmpfile();
+        ok = f && tcc_output_object(s1, f) == 0;
+        if (ok) {
+            obj_size = ftell(f);
+            obj = tcc_malloc(obj_size);
+            rewind(f);
+            ok = fread(obj, 1, obj_size, f) == obj_size;
+        }
+        if (f)
+            fclose(f);
+    }
+
+    if (ok) {
+        memcpy(hdr.magic, CACHE_MAGIC, sizeof hdr.magic);
+        memcpy(hdr.key, key, HASH_SIZE);
+        hdr.deps_size = deps.size;
+        hdr.log_size = log->size;
+        hdr.obj_size = obj_size;
+        hash_init(&c);
+        hash_update(&c, obj, obj_size);
+        hash_final(&c, hdr.obj_hash);
+
+        size = sizeof hdr + deps.size + log->size + obj_size;
+        data = tcc_malloc(size);
+        memcpy(data, &hdr, sizeof hdr);
+        memcpy(data + sizeof hdr, deps.data, deps.size);
+        memcpy(data + sizeof hdr + deps.size, log->data, log->size);
+        memcpy(data + sizeof hdr + deps.size + log->size, obj, obj_size);
+
+        path[0] = '\0';
+        cache_lock();
+        if (cache_dir)
+            cache_path(path, sizeof path, key);
+        cache_unlock();
+        if (path[0])
+            cache_write(path, data, size);
+        e = cache_insert(key, data, size);
+        if (e)
+            cache_release(e);
+        else
+            tcc_free(data);
+    }
+    cstr_free(&deps);
+    tcc_free(obj);
+}
+
+/* load the object of a valid entry into 's1' */
+static int cache_load(TCCState *s1, const uint8_t *data)
+{
+    const CacheHeader *hdr;
+    const CacheDep *dep;
+    const char *p, *end;
+    unsigned long off;
+    uint32_t i;
+
+    hdr = (const CacheHeader *)data;
+    off = sizeof(CacheHeader);
+    for(i = 0; i < hdr->nb_deps; i++, off += dep->len) {
+        dep = (const CacheDep *)(data + off);
+        if (!dep->is_dir)
+            dynarray_add((void ***)&s1->target_deps, &s1->nb_target_deps,
+                         tcc_strdup((const char *)(dep + 1)));
+    }
+    /* print the warnings again */
+    p = (const char *)data + off;
+    end = p + hdr->log_size;
+    for(; p < end; p += strlen(p) + 1) {
+        if (!s1->error_func)
+            fprintf(stderr, "%s\n", p);
+        else
+            s1->error_func(s1->error_opaque, p);
+    }
+    return tcc_load_object_mem(s1, end, hdr->obj_size);
+}
+
+/* compile the current file with 'compile', or load it from the cache */
+ST_FUNC int tcc_cache_compile(TCCState *s1, int (*compile)(TCCState *s1))
+{
+    uint8_t key[HASH_SIZE];
+    char src[1024];
+    CacheEntry *e;
+    CString log;
+    int ret, first, empty;
+
+    cache_lock();
+    ret = cache_max_entries <= 0 && !cache_dir;
+    cache_unlock();
+    /* the whole source must be in memory */
+    if (ret || (!file->fdata && file->fd >= 0))
+        return compile(s1);
+
+    cache_key(s1, key);
+    e = cache_lookup(key);
+    if (e) {
+        if (cache_valid(e->data)) {
+            ret = cache_load(s1, e->data);
+            cache_release(e);
+            return ret;
+        }
+        cache_release(e);
+    }
+
+    empty = cache_state_empty(s1);
+    pstrcpy(src, sizeof src, file->filename);
+    first = s1->nb_target_deps;
+    cstr_new(&log);
+    s1->cache_log = &log;
+    s1->uncacheable = 0;
+    ret = compile(s1);
+    s1->cache_log = NULL;
+    if (ret == 0 && empty && !s1->uncacheable)
+        cache_store(s1, key, src, &log, first);
+    cstr_free(&log);
+    return ret;
+}
+
+LIBTCCAPI void tcc_set_compile_cache(int max_entries, const char *dir)
+{
+#if defined TCC_HAVE_THREADS && defined _WIN32
+    if (!cache_mutex_init) {
+        InitializeCriticalSection(&cache_mutex);
+        cache_mutex_init = 1;
+    }
+#endif
+    cache_lock();
+    cache_max_entries = max_entries;
+    cache_trim();
+    tcc_free(cache_dir);
+    cache_dir = dir ? tcc_strdup(dir) : NULL;
+    cache_unlock();
+}
@@ -20,7 +20,7 @@
 
 #include "tcc.h"
 
-static int new_undef_sym = 0; /* Is there a new undefined sym since last new_undef_sym() */
+static ST_TLS int new_undef_sym = 0; /* Is there a new undefined sym since last new_undef_sym() */
 
 ST_FUNC int put_elf_str(Section *s, const char *sym)
 {
@@ -175,6 +175,8 @@ static void *get_elf_sym_addr(TCCState *s, const char *name, int err)
 /* return elf symbol value */
 LIBTCCAPI void *tcc_get_symbol(TCCState *s, const char *name)
 {
+    if (tcc_check_state(s))
+        return NULL;
     return get_elf_sym_addr(s, name, 0);
 }
 
@@ -1415,7 +1417,8 @@ ST_FUNC void fill_got(TCCState *s1)
 
 /* output an ELF file */
 /* XXX: suppress unneeded sections */
-static int elf_output_file(TCCState *s1, const char *filename)
+static int elf_output_file(TCCState *s1, int file_type,
+                           const char *filename, FILE *fout)
 {
     ElfW(Ehdr) ehdr;
     FILE *f;
@@ -1429,13 +1432,12 @@ static int elf_output_file(TCCState *s1, const char *filename)
     Section *interp, *dynamic, *dynstr;
     unsigned long saved_dynamic_data_offset;
     ElfW(Sym) *sym;
-    int type, file_type;
+    int type;
     unsigned long rel_addr, rel_size;
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     unsigned long bss_addr, bss_size;
 #endif
 
-    file_type = s1->output_type;
     s1->nb_errors = 0;
 
     if (file_type != TCC_OUTPUT_OBJ) {
@@ -2065,19 +2067,23 @@ static int elf_output_file(TCCState *s1, const char *filename)
         fill_got(s1);
 
     /* write elf file */
-    if (file_type == TCC_OUTPUT_OBJ)
-        mode = 0666;
-    else
-        mode = 0777;
-    unlink(filename);
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode); 
-    if (fd < 0) {
-        tcc_error_noabort("could not write '%s'", filename);
-        goto fail;
+    if (fout) {
+        f = fout;
+    } else {
+        if (file_type == TCC_OUTPUT_OBJ)
+            mode = 0666;
+        else
+            mode = 0777;
+        unlink(filename);
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode); 
+        if (fd < 0) {
+            tcc_error_noabort("could not write '%s'", filename);
+            goto fail;
+        }
+        f = fdopen(fd, "wb");
+        if (s1->verbose)
+            printf("<- %s\n", filename);
     }
-    f = fdopen(fd, "wb");
-    if (s1->verbose)
-        printf("<- %s\n", filename);
 
 #ifdef TCC_TARGET_COFF
     if (s1->output_format == TCC_OUTPUT_FORMAT_COFF) {
@@ -2176,7 +2182,8 @@ static int elf_output_file(TCCState *s1, const char *filename)
     } else {
         tcc_output_binary(s1, f, section_order);
     }
-    fclose(f);
+    if (!fout)
+        fclose(f);
 
     ret = 0;
  the_end:
@@ -2190,24 +2197,65 @@ static int elf_output_file(TCCState *s1, const char *filename)
 LIBTCCAPI int tcc_output_file(TCCState *s, const char *filename)
 {
     int ret;
+
+    if (tcc_check_state(s))
+        return -1;
 #ifdef TCC_TARGET_PE
     if (s->output_type != TCC_OUTPUT_OBJ) {
         ret = pe_output_file(s, filename);
     } else
 #endif
     {
-        ret = elf_output_file(s, filename);
+        ret = elf_output_file(s, s->output_type, filename, NULL);
+    }
+    return ret;
+}
+
+/* write what was compiled so far as an object file to 'f', whatever
+   the output type is, and leave the state usable for it */
+ST_FUNC int tcc_output_object(TCCState *s1, FILE *f)
+{
+    int ret, nb_sections;
+    Section *s;
+
+    nb_sections = s1->nb_sections;
+    ret = elf_output_file(s1, TCC_OUTPUT_OBJ, NULL, f);
+    /* drop the section name table and rehash the sorted symbols */
+    while (s1->nb_sections > nb_sections) {
+        s = s1->sections[--s1->nb_sections];
+        tcc_free(s->data);
+        tcc_free(s);
     }
+    rebuild_hash(symtab_section, ((int *)symtab_section->hash->data)[0]);
     return ret;
 }
 
+/* object file being loaded from memory instead of a file descriptor */
+static ST_TLS const unsigned char *load_mem;
+static ST_TLS unsigned long load_mem_size;
+
+static int load_read(int fd, unsigned long file_offset,
+                     void *data, unsigned long size)
+{
+    if (load_mem) {
+        if (file_offset > load_mem_size ||
+            size > load_mem_size - file_offset) {
+            memset(data, 0, size);
+            return -1;
+        }
+        memcpy(data, load_mem + file_offset, size);
+        return size;
+    }
+    lseek(fd, file_offset, SEEK_SET);
+    return read(fd, data, size);
+}
+
 static void *load_data(int fd, unsigned long file_offset, unsigned long size)
 {
     void *data;
 
     data = tcc_malloc(size);
-    lseek(fd, file_offset, SEEK_SET);
-    read(fd, data, size);
+    load_read(fd, file_offset, data, size);
     return data;
 }
 
@@ -2239,7 +2287,7 @@ ST_FUNC int tcc_load_object_file(TCCState *s1,
 
     stab_index = stabstr_index = 0;
 
-    if (read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr))
+    if (load_read(fd, file_offset, &ehdr, sizeof(ehdr)) != sizeof(ehdr))
         goto fail1;
     if (ehdr.e_ident[0] != ELFMAG0 ||
         ehdr.e_ident[1] != ELFMAG1 ||
@@ -2366,9 +2414,8 @@ ST_FUNC int tcc_load_object_file(TCCState *s1,
         size = sh->sh_size;
         if (sh->sh_type != SHT_NOBITS) {
             unsigned char *ptr;
-            lseek(fd, file_offset + sh->sh_offset, SEEK_SET);
             ptr = section_ptr_add(s, size);
-            read(fd, ptr, size);
+            load_read(fd, file_offset + sh->sh_offset, ptr, size);
         } else {
             s->data_offset += size;
         }
@@ -2496,6 +2543,19 @@ ST_FUNC int tcc_load_object_file(TCCState *s1,
     return ret;
 }
 
+/* load an object file held in memory */
+ST_FUNC int tcc_load_object_mem(TCCState *s1,
+                                const void *data, unsigned long size)
+{
+    int ret;
+
+    load_mem = data;
+    load_mem_size = size;
+    ret = tcc_load_object_file(s1, -1, 0);
+    load_mem = NULL;
+    return ret;
+}
+
 typedef struct ArchiveHeader {
     char ar_name[16];           /* name of this member */
     char ar_date[12];           /* file mtime */
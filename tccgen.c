@@ -61,12 +61,26 @@ ST_DATA int nocode_wanted; /* true if no code generation wanted for an expressio
 ST_DATA int global_expr;  /* true if compound literals must be allocated globally (used during initializers parsing */
 ST_DATA CType func_vt; /* current function return type (used by return instruction) */
 ST_DATA int func_vc;
+ST_DATA int tail_call; /* gfunc_call() may leave the frame and jump to the function */
 ST_DATA int last_line_num, last_ind, func_ind; /* debug last line number and pc */
 ST_DATA char *funcname;
 
 ST_DATA CType char_pointer_type, func_old_type, int_type;
 
 /* ------------------------------------------------------------------------- */
+/* case labels of a switch statement */
+typedef struct CaseLabel {
+    long long v1, v2; /* value range */
+    int ind; /* code address */
+} CaseLabel;
+
+typedef struct SwitchInfo {
+    CaseLabel **cases;
+    int nb_cases;
+    int def_ind; /* default label, -1 if none */
+    int ll; /* the value is a long long */
+} SwitchInfo;
+
 static void gen_cast(CType *type);
 static inline CType *pointed_type(CType *type);
 static int is_compatible_types(CType *type1, CType *type2);
@@ -74,7 +88,7 @@ static int parse_btype(CType *type, AttributeDef *ad);
 static void type_decl(CType *type, AttributeDef *ad, int *v, int td);
 static void parse_expr_type(CType *type);
 static void decl_initializer(CType *type, Section *sec, unsigned long c, int first, int size_only);
-static void block(int *bsym, int *csym, int *case_sym, int *def_sym, int case_reg, int is_expr);
+static void block(int *bsym, int *csym, SwitchInfo *sw, int is_expr);
 static void decl_initializer_alloc(CType *type, AttributeDef *ad, int r, int has_init, int v, char *asm_label, int scope);
 static int decl0(int l, int is_for_loop_init);
 static void expr_eq(void);
@@ -82,6 +96,13 @@ static void unary_type(CType *type);
 static void vla_runtime_type_size(CType *type, int *a);
 static int is_compatible_parameter_types(CType *type1, CType *type2);
 static void expr_type(CType *type);
+static void type_to_str(char *buf, int buf_size, CType *type, const char *varstr);
+
+/* true while no local address may be live, so that the frame can be
+   left before a call in tail position */
+static ST_TLS int func_tail_ok;
+/* set by 'return' until the first unary() of its expression */
+static ST_TLS int return_expr;
 
 ST_INLN int is_float(int t)
 {
@@ -90,6 +111,21 @@ ST_INLN int is_float(int t)
     return bt == VT_LDOUBLE || bt == VT_DOUBLE || bt == VT_FLOAT;
 }
 
+/* GCC vectors are anonymous structures with one unnamed field per
+   lane. The structure symbol is tagged with TOK_VECTOR_SIZE1 where
+   'struct' and 'union' put TOK_STRUCT and TOK_UNION. */
+static inline int is_vector(CType *type)
+{
+    return (type->t & VT_BTYPE) == VT_STRUCT &&
+        type->ref->type.t == TOK_VECTOR_SIZE1;
+}
+
+/* return the lane type of the vector 'type' */
+static inline CType *vector_elem(CType *type)
+{
+    return &type->ref->next->type;
+}
+
 /* we use our own 'finite' function to avoid potential problems with
    non standard math libs */
 /* XXX: endianness dependent */
@@ -737,6 +773,10 @@ ST_FUNC int gv(int rc)
             gbound();
 #endif
 
+        /* the address of a local may escape */
+        if ((vtop->r & (VT_VALMASK | VT_LVAL)) == VT_LOCAL)
+            func_tail_ok = 0;
+
         r = vtop->r & VT_VALMASK;
 #ifndef TCC_TARGET_X86_64
         rc2 = RC_INT;
@@ -888,7 +928,7 @@ static int reg_fret(int t)
 }
 
 /* expand long long on stack in two int registers */
-static void lexpand(void)
+ST_FUNC void lexpand(void)
 {
     int u;
 
@@ -942,7 +982,7 @@ static void lbuild(int t)
 /* rotate n first stack elements to the bottom 
    I1 ... In -> I2 ... In I1 [top is right]
 */
-static void vrotb(int n)
+ST_FUNC void vrotb(int n)
 {
     int i;
     SValue tmp;
@@ -1029,7 +1069,7 @@ static void gv_dup(void)
         sv.type.t = VT_INT;
         if (is_float(t)) {
             rc = RC_FLOAT;
-#ifdef TCC_TARGET_X86_64
+#if defined TCC_TARGET_X86_64 || defined TCC_TARGET_I386
             if ((t & VT_BTYPE) == VT_LDOUBLE) {
                 rc = RC_ST0;
             }
@@ -1058,6 +1098,11 @@ static void gen_opl(int op)
     unsigned short reg_lret = REG_LRET;
     SValue tmp;
 
+#ifdef TCC_TARGET_I386
+    if ((op == '/' || op == TOK_PDIV || op == TOK_UDIV ||
+         op == '%' || op == TOK_UMOD) && gen_divl(op))
+        return;
+#endif
     switch(op) {
     case '/':
     case TOK_PDIV:
@@ -1151,6 +1196,10 @@ static void gen_opl(int op)
     case TOK_SAR:
     case TOK_SHR:
     case TOK_SHL:
+#ifdef TCC_TARGET_I386
+        if (gen_shiftl(op))
+            break;
+#endif
         if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
             t = vtop[-1].type.t;
             vswap();
@@ -1256,6 +1305,9 @@ static void gen_opl(int op)
             } else {
 #if defined(TCC_TARGET_I386)
                 b = psym(0x850f, 0);
+#ifdef CONFIG_TCC_RELAX
+                add_branch(ind - 4);
+#endif
 #elif defined(TCC_TARGET_ARM)
                 b = ind;
                 o(0x1A000000 | encbranch(ind, 0, 1));
@@ -1285,6 +1337,123 @@ static void gen_opl(int op)
 }
 #endif
 
+/* compute the magic number 'pm' and shift 'ps' so that the division
+   of a 'bits' wide integer by the constant 'd' is the high word of its
+   product by 'pm' shifted right by 'ps' (Hacker's Delight, 10-4 and
+   10-8). Return 1 if the unsigned magic number needs 'bits' + 1 bits. */
+ST_FUNC int div_magic(unsigned long long d, int bits, int is_signed,
+                      unsigned long long *pm, int *ps)
+{
+    unsigned long long mask, two, ad, anc, q1, r1, q2, r2, delta;
+    int p, a;
+
+    mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+    two = 1ULL << (bits - 1);
+    d &= mask;
+    p = bits - 1;
+    a = 0;
+    if (is_signed) {
+        ad = (d & two) ? -d & mask : d;
+        anc = two + !!(d & two);
+        anc = anc - 1 - anc % ad;
+        q1 = two / anc;
+        r1 = two - q1 * anc;
+        q2 = two / ad;
+        r2 = two - q2 * ad;
+        do {
+            p++;
+            q1 = (q1 * 2) & mask;
+            r1 = (r1 * 2) & mask;
+            if (r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 = (q2 * 2) & mask;
+            r2 = (r2 * 2) & mask;
+            if (r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        q2++;
+        if (d & two)
+            q2 = -q2;
+    } else {
+        anc = mask - (-d & mask) % d;
+        q1 = two / anc;
+        r1 = two - q1 * anc;
+        q2 = (two - 1) / d;
+        r2 = (two - 1) - q2 * d;
+        do {
+            p++;
+            if (r1 >= anc - r1) {
+                q1 = (q1 * 2 + 1) & mask;
+                r1 = (r1 * 2 - anc) & mask;
+            } else {
+                q1 = (q1 * 2) & mask;
+                r1 = (r1 * 2) & mask;
+            }
+            if (r2 + 1 >= d - r2) {
+                if (q2 >= two - 1)
+                    a = 1;
+                q2 = (q2 * 2 + 1) & mask;
+                r2 = (r2 * 2 + 1 - d) & mask;
+            } else {
+                if (q2 >= two)
+                    a = 1;
+                q2 = (q2 * 2) & mask;
+                r2 = (r2 * 2 + 1) & mask;
+            }
+            delta = d - 1 - r2;
+        } while (p < 2 * bits &&
+                 (q1 < delta || (q1 == delta && r1 == 0)));
+        q2++;
+    }
+    *pm = q2 & mask;
+    *ps = p - bits;
+    return a;
+}
+
+/* signed division or modulo of vtop[-1] by the constant vtop[0] =
+   +/-2^n: round towards zero by adding 2^n-1 to negative dividends */
+static void gen_sdiv2(int op, long long c, int bits)
+{
+    unsigned long long a;
+    int n;
+
+    a = c < 0 ? -(unsigned long long)c : c;
+    for (n = 0; a > 1; n++)
+        a >>= 1;
+    vpop();
+    gv_dup();
+    if (op == '%')
+        gv_dup();
+    if (n > 1) {
+        vpushi(bits - 1);
+        gen_op(TOK_SAR);
+    }
+    vpushi(bits - n);
+    gen_op(TOK_SHR);
+    gen_op('+');
+    if (op == '%') {
+        if (bits == 32)
+            vpushi((int)(-1LL << n));
+        else
+            vpushll(-1LL << n);
+        gen_op('&');
+        gen_op('-');
+    } else {
+        vpushi(n);
+        gen_op(TOK_SAR);
+        if (c < 0) {
+            vpushi(0);
+            vswap();
+            gen_op('-');
+        }
+    }
+}
+
 /* handle integer constant optimizations and various machine
    independent opt */
 static void gen_opic(int op)
@@ -1384,6 +1553,22 @@ static void gen_opic(int op)
                     l2 == -1))) {
             /* nothing to do */
             vtop--;
+        } else if (c2 && (op == '*' || op == '&') && l2 == 0 &&
+                   !(vtop[-1].type.t & VT_VOLATILE)) {
+            /* x*0 and x&0 */
+            vswap();
+            vpop();
+        } else if (c2 && op == TOK_UMOD && l2 > 0 && (l2 & (l2 - 1)) == 0) {
+            /* x % 2^n -> x & (2^n - 1) */
+            vtop->c.ll = l2 - 1;
+            op = '&';
+            goto general_case;
+        } else if (c2 && (op == '/' || op == '%') && !nocode_wanted &&
+                   l2 != 0 && l2 != 1 && l2 != -1 &&
+                   (((l2 < 0 ? -(U)l2 : (U)l2) - 1) &
+                    (l2 < 0 ? -(U)l2 : (U)l2)) == 0) {
+            /* signed division by a power of two with shifts */
+            gen_sdiv2(op, l2, t1 == VT_LLONG || t2 == VT_LLONG ? 64 : 32);
         } else if (c2 && (op == '*' || op == TOK_PDIV || op == TOK_UDIV)) {
             /* try to use shifts instead of muls or divs */
             if (l2 > 0 && (l2 & (l2 - 1)) == 0) {
@@ -1562,6 +1747,180 @@ static void check_comparison_pointer_types(SValue *p1, SValue *p2, int op)
     }
 }
 
+/* make the lvalue on top of the stack addressable by gen_opv() and
+   gen_memcpy(): either a frame slot or a pointer held in a register */
+static void lval_addr(void)
+{
+    CType type;
+
+    if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == (VT_LOCAL | VT_LVAL))
+        return;
+    type = vtop->type;
+    vtop->type.t = VT_PTR;
+    gaddrof();
+    gv(RC_INT);
+    vtop->type = type;
+    vtop->r |= VT_LVAL;
+}
+
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+/* true if copies and fills of known size may be expanded inline */
+static int inline_mem_ok(void)
+{
+#ifdef CONFIG_TCC_BCHECK
+    if (tcc_state->do_bounds_check)
+        return 0;
+#endif
+    return tcc_state->inline_copy_limit > 0;
+}
+
+/* copy 'size' bytes from the lvalue on top of the stack to the lvalue
+   below it without calling memcpy(). Return 0 if not possible: the
+   operands are still valid lvalues then */
+static int inline_memcpy(int size)
+{
+    if (!inline_mem_ok())
+        return 0;
+    lval_addr();
+    vswap();
+    lval_addr();
+    vswap();
+    return gen_memcpy(size);
+}
+
+/* same for memset(): fill 'size' bytes of the lvalue below the top
+   of the stack with the constant byte on top of it */
+static int inline_memset(int size)
+{
+    if (!inline_mem_ok() ||
+        (vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST)
+        return 0;
+    vswap();
+    lval_addr();
+    vswap();
+    return gen_memset(size);
+}
+#endif
+
+/* copy the vector on top of the stack to a new frame slot unless it
+   already lives in one */
+static void vec_local(void)
+{
+    CType type;
+    int size, align, l;
+
+    if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == (VT_LOCAL | VT_LVAL))
+        return;
+    type = vtop->type;
+    size = type_size(&type, &align);
+    loc = (loc - size) & -align;
+    l = loc;
+    vset(&type, VT_LOCAL | VT_LVAL, l);
+    vswap();
+    vstore();
+    vpop();
+    vset(&type, VT_LOCAL | VT_LVAL, l);
+}
+
+/* replace the scalar on top of the stack by a vector of 'type' with
+   the scalar in every lane */
+static void vec_broadcast(CType *type)
+{
+    int size, esize, align, l, i;
+    CType *et;
+
+    et = vector_elem(type);
+    esize = type_size(et, &align);
+    size = type_size(type, &align);
+    gen_cast(et);
+    gv(is_float(et->t) ? RC_FLOAT : RC_INT);
+    loc = (loc - size) & -align;
+    l = loc;
+    for (i = 0; i < size; i += esize) {
+        vset(et, VT_LOCAL | lvalue_type(et->t), l + i);
+        vpushv(vtop - 1);
+        vstore();
+        vtop--; /* NOT vpop(): the scalar is still below */
+    }
+    vpop();
+    vset(type, VT_LOCAL | VT_LVAL, l);
+}
+
+/* element-wise operation on GCC vectors. The result goes to a new
+   frame slot; a scalar operand is first broadcast to every lane. */
+static void gen_opvec(int op)
+{
+    CType type, *et;
+    int size, esize, align, l, i;
+
+    if (!is_vector(&vtop->type)) {
+        vec_broadcast(&vtop[-1].type);
+    } else if (!is_vector(&vtop[-1].type)) {
+        vswap();
+        vec_broadcast(&vtop[-1].type);
+        vswap();
+    }
+    type = vtop[-1].type;
+    type.t &= ~(VT_CONSTANT | VT_VOLATILE);
+    et = vector_elem(&type);
+    if (!is_compatible_parameter_types(&vtop[-1].type, &vtop->type))
+        goto invalid_operands;
+    switch(op) {
+    case '+': case '-': case '*': case '/':
+        break;
+    case '%': case '&': case '|': case '^': case TOK_SHL: case TOK_SAR:
+        if (!is_float(et->t))
+            break;
+    default:
+    invalid_operands:
+        tcc_error("invalid operands to binary %s", get_tok_str(op, NULL));
+    }
+    if (nocode_wanted) {
+        vpop();
+        return;
+    }
+    size = type_size(&type, &align);
+    lval_addr();
+    vswap();
+    lval_addr();
+    vswap();
+    loc = (loc - size) & -align;
+    l = loc;
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+    if (size == 16) {
+        SValue dest;
+        dest.type = type;
+        dest.r = VT_LOCAL | VT_LVAL;
+        dest.r2 = VT_CONST;
+        dest.c.ul = l;
+        dest.sym = NULL;
+        if (gen_opv(op, &dest)) {
+            vpop();
+            vpop();
+            vset(&type, VT_LOCAL | VT_LVAL, l);
+            return;
+        }
+    }
+#endif
+    /* no SIMD instruction: one lane at a time */
+    vec_local();
+    vswap();
+    vec_local();
+    vswap();
+    esize = type_size(et, &align);
+    for (i = 0; i < size; i += esize) {
+        vset(et, VT_LOCAL | lvalue_type(et->t), l + i);
+        vset(et, VT_LOCAL | lvalue_type(et->t), vtop[-2].c.ul + i);
+        vset(et, VT_LOCAL | lvalue_type(et->t), vtop[-2].c.ul + i);
+        gen_op(op);
+        vstore();
+        vpop();
+    }
+    vpop();
+    vpop();
+    vset(&type, VT_LOCAL | VT_LVAL, l);
+}
+
 /* generic gen_op: handles types problems */
 ST_FUNC void gen_op(int op)
 {
@@ -1573,7 +1932,9 @@ ST_FUNC void gen_op(int op)
     bt1 = t1 & VT_BTYPE;
     bt2 = t2 & VT_BTYPE;
         
-    if (bt1 == VT_PTR || bt2 == VT_PTR) {
+    if (is_vector(&vtop[-1].type) || is_vector(&vtop->type)) {
+        gen_opvec(op);
+    } else if (bt1 == VT_PTR || bt2 == VT_PTR) {
         /* at least one operand is a pointer */
         /* relationnal op: must be both pointers */
         if (op >= TOK_ULT && op <= TOK_LOR) {
@@ -1817,6 +2178,20 @@ static void gen_cast(CType *type)
         gv(RC_INT);
     }
 
+    /* vectors only convert to vectors of the same size, keeping the
+       bits */
+    if (is_vector(type) || is_vector(&vtop->type)) {
+        if (!is_vector(type) || !is_vector(&vtop->type) ||
+            type->ref->c != vtop->type.ref->c) {
+            char buf1[256], buf2[256];
+            type_to_str(buf1, sizeof(buf1), &vtop->type, NULL);
+            type_to_str(buf2, sizeof(buf2), type, NULL);
+            tcc_error("cannot cast '%s' to '%s'", buf1, buf2);
+        }
+        vtop->type = *type;
+        return;
+    }
+
     dbt = type->t & (VT_BTYPE | VT_UNSIGNED);
     sbt = vtop->type.t & (VT_BTYPE | VT_UNSIGNED);
 
@@ -2076,6 +2451,36 @@ ST_FUNC void mk_pointer(CType *type)
     type->ref = s;
 }
 
+/* modify type so that it is a vector of 'size' bytes of type */
+static void mk_vector(CType *type, int size)
+{
+    int bt, esize, align, i;
+    Sym *s, *ss, **ps;
+    CType et, st;
+
+    et.t = type->t & (VT_BTYPE | VT_UNSIGNED);
+    et.ref = NULL;
+    bt = et.t & VT_BTYPE;
+    if (bt != VT_BYTE && bt != VT_SHORT && bt != VT_INT &&
+        bt != VT_LLONG && bt != VT_FLOAT && bt != VT_DOUBLE)
+        tcc_error("invalid vector type");
+    esize = type_size(&et, &align);
+    if (size < esize)
+        tcc_error("vector size is smaller than its element");
+    st.t = TOK_VECTOR_SIZE1;
+    st.ref = NULL;
+    s = sym_push(anon_sym++ | SYM_STRUCT, &st, 0, size);
+    s->r = size;
+    ps = &s->next;
+    for (i = 0; i < size; i += esize) {
+        ss = sym_push(SYM_FIELD, &et, 0, i);
+        *ps = ss;
+        ps = &ss->next;
+    }
+    type->t = VT_STRUCT | (type->t & ~(VT_BTYPE | VT_UNSIGNED));
+    type->ref = s;
+}
+
 /* compare function types. OLD functions match any new functions */
 static int is_compatible_func(CType *type1, CType *type2)
 {
@@ -2132,6 +2537,9 @@ static int compare_types(CType *type1, CType *type2, int unqualified)
         type2 = pointed_type(type2);
         return is_compatible_types(type1, type2);
     } else if (bt1 == VT_STRUCT) {
+        if (is_vector(type1) && is_vector(type2))
+            return type1->ref->c == type2->ref->c &&
+                compare_types(vector_elem(type1), vector_elem(type2), 0);
         return (type1->ref == type2->ref);
     } else if (bt1 == VT_FUNC) {
         return is_compatible_func(type1, type2);
@@ -2211,6 +2619,14 @@ static void type_to_str(char *buf, int buf_size,
         break;
     case VT_ENUM:
     case VT_STRUCT:
+        if (is_vector(type)) {
+            type_to_str(buf1, sizeof(buf1), vector_elem(type), NULL);
+            pstrcat(buf, buf_size, buf1);
+            snprintf(buf1, sizeof(buf1), " __attribute__((vector_size(%ld)))",
+                     type->ref->c);
+            pstrcat(buf, buf_size, buf1);
+            break;
+        }
         if (bt == VT_STRUCT)
             tstr = "struct ";
         else
@@ -2354,9 +2770,27 @@ ST_FUNC void vstore(void)
     if (sbt == VT_STRUCT) {
         /* if structure, only generate pointer */
         /* structure assignment : generate memcpy */
-        /* XXX: optimize if small size */
         if (!nocode_wanted) {
             size = type_size(&vtop->type, &align);
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+            if (size == 16 && is_vector(&vtop->type)) {
+                /* copy through a SIMD register */
+                lval_addr();
+                vswap();
+                lval_addr();
+                vswap();
+                if (gen_opv('=', vtop - 1)) {
+                    vswap();
+                    vpop();
+                    return;
+                }
+            }
+            if (inline_memcpy(size)) {
+                vswap();
+                vpop();
+                return;
+            }
+#endif
 
             /* destination */
             vswap();
@@ -2446,7 +2880,7 @@ ST_FUNC void vstore(void)
             rc = RC_INT;
             if (is_float(ft)) {
                 rc = RC_FLOAT;
-#ifdef TCC_TARGET_X86_64
+#if defined TCC_TARGET_X86_64 || defined TCC_TARGET_I386
                 if ((ft & VT_BTYPE) == VT_LDOUBLE) {
                     rc = RC_ST0;
                 }
@@ -2566,6 +3000,15 @@ static void parse_attribute(AttributeDef *ad)
         case TOK_PACKED2:
             ad->packed = 1;
             break;
+        case TOK_VECTOR_SIZE1:
+        case TOK_VECTOR_SIZE2:
+            skip('(');
+            n = expr_const();
+            if (n <= 0 || (n & (n - 1)) != 0)
+                tcc_error("vector size must be a positive power of two");
+            ad->vector_size = n;
+            skip(')');
+            break;
         case TOK_WEAK1:
         case TOK_WEAK2:
             ad->weak = 1;
@@ -3055,6 +3498,10 @@ the_end:
         t = (t & ~VT_BTYPE) | VT_LLONG;
 #endif
     type->t = t;
+    if (ad->vector_size) {
+        mk_vector(type, ad->vector_size);
+        ad->vector_size = 0;
+    }
     return type_found;
 }
 
@@ -3291,6 +3738,10 @@ static void type_decl(CType *type, AttributeDef *ad, int *v, int td)
     type->t |= storage;
     if (tok == TOK_ATTRIBUTE1 || tok == TOK_ATTRIBUTE2)
         parse_attribute(ad);
+    if (ad->vector_size) {
+        mk_vector(type, ad->vector_size);
+        ad->vector_size = 0;
+    }
     
     if (!type1.t)
         return;
@@ -3405,16 +3856,35 @@ static void vpush_tokc(int t)
     vsetc(&type, VT_CONST, &tokc);
 }
 
+/* true if the frame can be left before calling vtop[-nb_args] with
+   the arguments above it, its result being returned as is */
+static int can_tail_call(int nb_args, CType *ret_type)
+{
+    SValue *sv;
+
+    if (!func_tail_ok || vtop != vstack + nb_args ||
+        (ret_type->t & VT_BTYPE) == VT_STRUCT ||
+        !is_compatible_parameter_types(ret_type, &func_vt))
+        return 0;
+    for(sv = vstack + 1; sv <= vtop; sv++) {
+        if ((sv->r & (VT_VALMASK | VT_LVAL)) == VT_LOCAL)
+            return 0;
+    }
+    return 1;
+}
+
 ST_FUNC void unary(void)
 {
-    int n, t, align, size, r, sizeof_caller;
+    int n, t, align, size, r, sizeof_caller, tail;
     CType type;
     Sym *s;
     AttributeDef ad;
-    static int in_sizeof = 0;
+    static ST_TLS int in_sizeof = 0;
 
     sizeof_caller = in_sizeof;
     in_sizeof = 0;
+    tail = return_expr;
+    return_expr = 0;
     /* XXX: GCC 2.95.3 does not generate a table although it should be
        better here */
  tok_next:
@@ -3523,7 +3993,8 @@ ST_FUNC void unary(void)
             save_regs(0); 
             /* statement expression : we do not accept break/continue
                inside as GCC does */
-            block(NULL, NULL, NULL, NULL, 0, 1);
+            func_tail_ok = 0; /* nor know if we are in a loop */
+            block(NULL, NULL, NULL, 1);
             skip(')');
         } else {
             gexpr();
@@ -3646,6 +4117,84 @@ ST_FUNC void unary(void)
             type.t = VT_VOID;
             mk_pointer(&type);
             vset(&type, VT_LOCAL, 0);
+            func_tail_ok = 0;
+        }
+        break;
+    case TOK_builtin_memcpy:
+    case TOK_builtin_memset:
+        {
+            CType type, type1;
+            SValue sz;
+            int t1, n;
+
+            t1 = tok;
+            next();
+            skip('(');
+            type.t = VT_VOID;
+            mk_pointer(&type);
+            expr_eq();
+            gen_assign_cast(&type);
+            skip(',');
+            expr_eq();
+            if (t1 == TOK_builtin_memcpy) {
+                type1.t = VT_VOID | VT_CONSTANT;
+                mk_pointer(&type1);
+            } else {
+                type1 = int_type;
+            }
+            gen_assign_cast(&type1);
+            skip(',');
+            expr_eq();
+#ifdef TCC_TARGET_X86_64
+            type1.t = VT_LLONG | VT_UNSIGNED;
+#else
+            type1.t = VT_INT | VT_UNSIGNED;
+#endif
+            gen_assign_cast(&type1);
+            skip(')');
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+            if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST &&
+#ifdef TCC_TARGET_X86_64
+                vtop->c.ull <= 0x7fffffff &&
+#else
+                vtop->c.ui <= 0x7fffffff &&
+#endif
+                !nocode_wanted) {
+                /* constant size: try to expand it inline */
+                sz = *vtop;
+                n = sz.c.i;
+                vpop();
+                vswap();
+                indir();
+                vswap();
+                if (t1 == TOK_builtin_memcpy) {
+                    indir();
+                    if (inline_memcpy(n)) {
+                        vpop();
+                        gaddrof();
+                        vtop->type = type;
+                        break;
+                    }
+                    gaddrof();
+                    vtop->type = type;
+                } else if (inline_memset(n)) {
+                    vpop();
+                    gaddrof();
+                    vtop->type = type;
+                    break;
+                }
+                vswap();
+                gaddrof();
+                vtop->type = type;
+                vswap();
+                vpushv(&sz);
+            }
+#endif
+            vpush_global_sym(&func_old_type,
+                             t1 == TOK_builtin_memcpy ? TOK_memcpy : TOK_memset);
+            vrott(4);
+            gfunc_call(3);
+            vset(&type, REG_IRET, 0);
         }
         break;
 #ifdef TCC_TARGET_X86_64
@@ -3807,6 +4356,15 @@ ST_FUNC void unary(void)
             next();
         } else if (tok == '[') {
             next();
+            if (is_vector(&vtop->type)) {
+                /* lane of a vector: index it as an array of lanes */
+                CType type = *vector_elem(&vtop->type);
+                type.t |= vtop->type.t & (VT_CONSTANT | VT_VOLATILE);
+                test_lvalue();
+                gaddrof();
+                mk_pointer(&type);
+                vtop->type = type;
+            }
             gexpr();
             gen_op('+');
             indir();
@@ -3830,6 +4388,11 @@ ST_FUNC void unary(void)
             } else {
                 vtop->r &= ~VT_LVAL; /* no lvalue */
             }
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+            /* alloca() memory lives in the frame */
+            if ((vtop->r & VT_SYM) && vtop->sym->v == TOK_alloca)
+                func_tail_ok = 0;
+#endif
             /* get return type */
             s = vtop->type.ref;
             next();
@@ -3876,7 +4439,11 @@ ST_FUNC void unary(void)
                 tcc_error("too few arguments to function");
             skip(')');
             if (!nocode_wanted) {
+                /* 'return f(...);' */
+                tail_call = tail && tok == ';' &&
+                    can_tail_call(nb_args, &ret.type);
                 gfunc_call(nb_args);
+                tail_call = 0;
             } else {
                 vtop -= (nb_args + 1);
             }
@@ -4086,7 +4653,7 @@ static void expr_cond(void)
                    each branch */
                 if (is_float(vtop->type.t)) {
                     rc = RC_FLOAT;
-#ifdef TCC_TARGET_X86_64
+#if defined TCC_TARGET_X86_64 || defined TCC_TARGET_I386
                     if ((vtop->type.t & VT_BTYPE) == VT_LDOUBLE) {
                         rc = RC_ST0;
                     }
@@ -4161,7 +4728,7 @@ static void expr_cond(void)
             rc = RC_INT;
             if (is_float(type.t)) {
                 rc = RC_FLOAT;
-#ifdef TCC_TARGET_X86_64
+#if defined TCC_TARGET_X86_64 || defined TCC_TARGET_I386
                 if ((type.t & VT_BTYPE) == VT_LDOUBLE) {
                     rc = RC_ST0;
                 }
@@ -4294,8 +4861,695 @@ static int is_label(void)
     }
 }
 
-static void block(int *bsym, int *csym, int *case_sym, int *def_sym, 
-                  int case_reg, int is_expr)
+#ifdef CONFIG_TCC_RELAX
+/* branches and jump tables of the current function */
+static ST_TLS int *func_branches, nb_func_branches;
+static ST_TLS int *func_tables, nb_func_tables; /* offset, size pairs */
+static ST_TLS int *func_peeps, nb_func_peeps; /* see add_peep() */
+static ST_TLS int *func_dels, nb_func_dels; /* bytes removed: start, size pairs */
+static ST_TLS int func_has_asm;
+static ST_TLS unsigned long func_reloc_offset, func_sym_offset, func_stab_offset;
+/* code changes, sorted by address */
+static ST_TLS int *relax_pos, *relax_size, *relax_delta;
+static ST_TLS int nb_relax;
+
+static void int_add(int **ptab, int *nb_ptr, int v)
+{
+    int nb = *nb_ptr;
+    if ((nb & (nb - 1)) == 0)
+        *ptab = tcc_realloc(*ptab, (nb ? nb * 2 : 1) * sizeof(int));
+    (*ptab)[nb++] = v;
+    *nb_ptr = nb;
+}
+
+/* remember the displacement field of a jmp/jcc at 'pos' */
+ST_FUNC void add_branch(int pos)
+{
+    int_add(&func_branches, &nb_func_branches, pos);
+}
+
+/* remember an instruction from 'start' to 'ind' for the peephole
+   pass: 'op' is one of PEEP_xxx */
+ST_FUNC void add_peep(int start, int op, int r, int c)
+{
+    if (!tcc_state->optimize)
+        return;
+    int_add(&func_peeps, &nb_func_peeps, start);
+    int_add(&func_peeps, &nb_func_peeps, ind);
+    int_add(&func_peeps, &nb_func_peeps, op);
+    int_add(&func_peeps, &nb_func_peeps, r);
+    int_add(&func_peeps, &nb_func_peeps, c);
+}
+
+#ifdef CONFIG_TCC_REGVARS
+/* remove 'size' bytes at 'pos' when relaxing the current function.
+   The code there must be a valid filler as long as it is not done */
+ST_FUNC void del_code(int pos, int size)
+{
+    if (size <= 0)
+        return;
+    int_add(&func_dels, &nb_func_dels, pos);
+    int_add(&func_dels, &nb_func_dels, size);
+}
+#endif
+
+static void add_case_table(int offset, int size)
+{
+    int_add(&func_tables, &nb_func_tables, offset);
+    int_add(&func_tables, &nb_func_tables, size);
+}
+
+static void relax_init(void)
+{
+    nb_func_branches = 0;
+    nb_func_tables = 0;
+    nb_func_peeps = 0;
+    nb_func_dels = 0;
+    func_has_asm = 0;
+    func_reloc_offset = cur_text_section->reloc ?
+        cur_text_section->reloc->data_offset : 0;
+    func_sym_offset = symtab_section->data_offset;
+    func_stab_offset = stab_section ? stab_section->data_offset : 0;
+}
+
+/* size of the displacement field of the branch at 'pos' */
+static int branch_size(int pos)
+{
+    return cur_text_section->data[pos - 1] == 0xeb ? 1 : 4;
+}
+
+static int branch_target(int pos)
+{
+    unsigned char *code = cur_text_section->data;
+    if (code[pos - 1] == 0xeb)
+        return pos + 1 + (char)code[pos];
+    return pos + 4 + *(int *)(code + pos);
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+/* binary search of the first element of 't' which is not less than 'a' */
+static int int_find(int *t, int n, int a)
+{
+    int l, m;
+
+    l = 0;
+    while (l < n) {
+        m = (l + n) >> 1;
+        if (t[m] < a)
+            l = m + 1;
+        else
+            n = m;
+    }
+    return l;
+}
+
+/* remove redundant loads, stores and register moves of the current
+   function, as recorded by add_peep(). Instructions which are jump
+   targets are kept */
+static void peephole(void)
+{
+    unsigned char *code, *q;
+    int *targets, nb_targets, *p, *prev, i, j, n, rex, prev_end;
+    ElfW(Sym) *sym, *sym_end;
+
+    targets = NULL;
+    nb_targets = 0;
+    for(i = 0; i < nb_func_branches; i++)
+        int_add(&targets, &nb_targets, branch_target(func_branches[i]));
+    for(i = 0; i < nb_func_tables; i += 2) {
+        p = (int *)(data_section->data + func_tables[i]);
+        for(j = 0; j < func_tables[i + 1]; j++)
+            int_add(&targets, &nb_targets, func_ind + p[j]);
+    }
+    sym = (ElfW(Sym) *)(symtab_section->data + func_sym_offset);
+    sym_end = (ElfW(Sym) *)(symtab_section->data + symtab_section->data_offset);
+    for(; sym < sym_end; sym++) {
+        if (sym->st_shndx == cur_text_section->sh_num)
+            int_add(&targets, &nb_targets, sym->st_value);
+    }
+    if (nb_targets)
+        qsort(targets, nb_targets, sizeof(int), int_cmp);
+
+    code = cur_text_section->data;
+    prev = NULL;
+    prev_end = -1;
+    for(i = 0; i < nb_func_peeps; i += 5) {
+        /* start, end, op, r, c */
+        p = func_peeps + i;
+        if (p[0] != prev_end ||
+            ((j = int_find(targets, nb_targets, p[0])) < nb_targets &&
+             targets[j] == p[0])) {
+            prev = p;
+            prev_end = p[1];
+            continue;
+        }
+        prev_end = p[1];
+        n = 0; /* new size */
+        if ((p[2] & 3) == PEEP_MOV) {
+            if ((prev[2] & 3) != PEEP_MOV ||
+                (prev[2] & PEEP_LL) != (p[2] & PEEP_LL) ||
+                !((p[3] == prev[3] && p[4] == prev[4]) ||
+                  (p[3] == prev[4] && p[4] == prev[3]))) {
+                prev = p;
+                continue;
+            }
+        } else if ((prev[2] & 3) == PEEP_MOV ||
+                   (prev[2] & PEEP_LL) != (p[2] & PEEP_LL) ||
+                   prev[4] != p[4]) {
+            prev = p;
+            continue;
+        } else if (p[3] != prev[3]
+#ifdef TCC_TARGET_X86_64
+                   /* a 32 bit load clears the high half of the register,
+                      which the casts to 64 bit rely on: it becomes
+                      'mov %e<r>, %e<r>' */
+                   || ((p[2] & (3 | PEEP_LL)) == PEEP_LOAD &&
+                       (prev[2] & 3) == PEEP_STORE)
+#endif
+                   ) {
+            /* the value is already in a register */
+            if ((p[2] & 3) != PEEP_LOAD) {
+                prev = p;
+                continue;
+            }
+            rex = 0x40 | ((p[2] & PEEP_LL) << 1) |
+                ((prev[3] >> 3) << 2) | (p[3] >> 3);
+            n = rex != 0x40 ? 3 : 2;
+            if (n >= p[1] - p[0]) {
+                prev = p;
+                continue;
+            }
+            q = code + p[0];
+            if (rex != 0x40)
+                *q++ = rex;
+            *q++ = 0x89; /* mov prev_r, r */
+            *q = 0xc0 | ((prev[3] & 7) << 3) | (p[3] & 7);
+        }
+        int_add(&func_dels, &nb_func_dels, p[0] + n);
+        int_add(&func_dels, &nb_func_dels, p[1] - p[0] - n);
+    }
+    tcc_free(targets);
+}
+
+/* new address of 'a' after the relaxation */
+static int relax_addr(int a)
+{
+    return a - relax_delta[int_find(relax_pos, nb_relax, a)];
+}
+
+/* shrink the rel32 branches of the current function which can reach
+   their target with a rel8, remove the bytes dropped by peephole()
+   and move everything after them */
+static void relax_branches(void)
+{
+    unsigned char *code, *q;
+    Section *sec;
+    ElfW_Rel *rel, *rel_end;
+    ElfW(Sym) *sym, *sym_end;
+    Stab_Sym *stab, *stab_end;
+    int i, j, k, n, pos, size, save, target, disp, changed, start, *tab;
+
+    if (func_has_asm)
+        goto the_end;
+    if (nb_func_peeps)
+        peephole();
+    /* merge the branches and the removed bytes. relax_size[] is 0
+       for the branches which keep their size */
+    n = nb_func_branches + nb_func_dels / 2;
+    if (n == 0)
+        goto the_end;
+    sec = cur_text_section;
+    code = sec->data;
+    relax_pos = tcc_malloc(n * sizeof(int));
+    relax_size = tcc_malloc(n * sizeof(int));
+    relax_delta = tcc_malloc((n + 1) * sizeof(int));
+    for(i = j = k = 0; k < n; k++) {
+        if (j < nb_func_dels &&
+            (i == nb_func_branches || func_dels[j] < func_branches[i])) {
+            relax_pos[k] = func_dels[j];
+            relax_size[k] = -func_dels[j + 1];
+            j += 2;
+        } else {
+            relax_pos[k] = func_branches[i++];
+            relax_size[k] = 0;
+        }
+    }
+    nb_relax = n;
+    /* branches only get shorter, so distances too: iterate until no
+       other branch fits in a rel8 */
+    do {
+        changed = 0;
+        relax_delta[0] = 0;
+        for(k = 0; k < n; k++)
+            relax_delta[k + 1] = relax_delta[k] +
+                (relax_size[k] < 0 ? -relax_size[k] : relax_size[k]);
+        for(k = 0; k < n; k++) {
+            pos = relax_pos[k];
+            if (relax_size[k] || branch_size(pos) == 1)
+                continue;
+            target = branch_target(pos);
+            if (target < func_ind || target > ind)
+                continue;
+            if (code[pos - 1] == 0xe9) {
+                save = 3;
+                disp = relax_addr(target) - (relax_addr(pos) + 1);
+            } else {
+                save = 4;
+                disp = relax_addr(target) - relax_addr(pos);
+            }
+            if (target > pos)
+                disp -= save;
+            if (disp == (char)disp) {
+                relax_size[k] = save;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    /* move the code and rewrite the branches */
+    q = code + func_ind;
+    start = func_ind;
+    for(k = 0; k < n; k++) {
+        pos = relax_pos[k];
+        if (relax_size[k] < 0) {
+            memmove(q, code + start, pos - start);
+            q += pos - start;
+            start = pos - relax_size[k];
+            continue;
+        }
+        size = branch_size(pos);
+        target = branch_target(pos);
+        if (target >= func_ind && target <= ind)
+            target = relax_addr(target);
+        if (relax_size[k]) {
+            if (code[pos - 1] == 0xe9) {
+                memmove(q, code + start, pos - 1 - start);
+                q += pos - 1 - start;
+                *q++ = 0xeb;
+            } else {
+                memmove(q, code + start, pos - 2 - start);
+                q += pos - 2 - start;
+                *q++ = code[pos - 1] - 0x10; /* jcc rel8 */
+            }
+            q++;
+            q[-1] = target - (q - code);
+        } else {
+            memmove(q, code + start, pos - start);
+            q += pos - start;
+            if (size == 1) {
+                q++;
+                q[-1] = target - (q - code);
+            } else {
+                q += 4;
+                *(int *)(q - 4) = target - (q - code);
+            }
+        }
+        start = pos + size;
+    }
+    memmove(q, code + start, ind - start);
+
+    /* relocations, symbols, line numbers and jump tables */
+    if (sec->reloc) {
+        rel = (ElfW_Rel *)(sec->reloc->data + func_reloc_offset);
+        rel_end = (ElfW_Rel *)(sec->reloc->data + sec->reloc->data_offset);
+        for(; rel < rel_end; rel++)
+            rel->r_offset = relax_addr(rel->r_offset);
+    }
+    sym = (ElfW(Sym) *)(symtab_section->data + func_sym_offset);
+    sym_end = (ElfW(Sym) *)(symtab_section->data + symtab_section->data_offset);
+    for(; sym < sym_end; sym++) {
+        if (sym->st_shndx == sec->sh_num &&
+            sym->st_value > func_ind && sym->st_value <= ind)
+            sym->st_value = relax_addr(sym->st_value);
+    }
+    if (stab_section) {
+        stab = (Stab_Sym *)(stab_section->data + func_stab_offset);
+        stab_end = (Stab_Sym *)(stab_section->data + stab_section->data_offset);
+        for(; stab < stab_end; stab++) {
+            if (stab->n_type == N_SLINE)
+                stab->n_value = relax_addr(func_ind + stab->n_value) - func_ind;
+        }
+    }
+    for(i = 0; i < nb_func_tables; i += 2) {
+        tab = (int *)(data_section->data + func_tables[i]);
+        for(j = 0; j < func_tables[i + 1]; j++)
+            tab[j] = relax_addr(func_ind + tab[j]) - func_ind;
+    }
+    ind -= relax_delta[n];
+    tcc_free(relax_pos);
+    tcc_free(relax_size);
+    tcc_free(relax_delta);
+ the_end:
+    tcc_free(func_branches);
+    tcc_free(func_tables);
+    tcc_free(func_peeps);
+    tcc_free(func_dels);
+    func_branches = func_tables = func_peeps = func_dels = NULL;
+}
+#endif
+
+#ifdef CONFIG_TCC_REGVARS
+/* minimum weight of a local kept in a register */
+#define REGVAR_MIN_USES 3
+
+ST_DATA int func_regvars;
+/* weight of the identifiers of the current function body, indexed by
+   token - TOK_IDENT: one per use, times 4 in each enclosing loop. -1
+   if their address is taken */
+static ST_TLS int *regvar_uses, nb_regvar_uses;
+static ST_TLS int regvar_min; /* weight needed to get a register */
+
+static void regvar_use(int v, int w)
+{
+    int n;
+
+    v -= TOK_IDENT;
+    if (v >= nb_regvar_uses) {
+        n = tok_ident - TOK_IDENT;
+        regvar_uses = tcc_realloc(regvar_uses, n * sizeof(int));
+        memset(regvar_uses + nb_regvar_uses, 0,
+               (n - nb_regvar_uses) * sizeof(int));
+        nb_regvar_uses = n;
+    }
+    if (w < 0 || regvar_uses[v] < 0)
+        regvar_uses[v] = -1;
+    else
+        regvar_uses[v] += w;
+}
+
+/* record the body of the function being defined in 'str', weighting
+   the identifiers it uses. Functions with inline assembly or calling
+   alloca() keep all their locals on the stack. The directives of the
+   body are run while it is recorded: the '#pragma pack' values are
+   recorded too, so that they apply again when it is parsed */
+static void regvar_scan(TokenString *str)
+{
+    int t, last, level, paren, hdr, body, single, nb_loops, depth, addr;
+    int loop_level[32], best[NB_REGVARS], i, j, w, pack;
+    CValue cval;
+
+    nb_regvar_uses = 0;
+    tok_str_new(str);
+    pack = -1;
+    last = 0;
+    level = paren = 0;
+    hdr = -1; /* paren level of the current for/while header */
+    body = single = nb_loops = addr = 0;
+    for(;;) {
+        if (tok == TOK_EOF)
+            tcc_error("unexpected end of file");
+        if (*tcc_state->pack_stack_ptr != pack) {
+            pack = *tcc_state->pack_stack_ptr;
+            cval.i = pack;
+            tok_str_add2(str, TOK_PACK, &cval);
+        }
+        tok_str_add_tok(str);
+        t = tok;
+        next();
+        /* first token of a loop body */
+        if (body) {
+            body = 0;
+            if (t == '{') {
+                if (nb_loops < countof(loop_level))
+                    loop_level[nb_loops++] = level + 1;
+            } else {
+                single++;
+            }
+        }
+        switch(t) {
+        case TOK_FOR:
+        case TOK_WHILE:
+            if (hdr < 0)
+                hdr = paren;
+            break;
+        case TOK_DO:
+            body = 1;
+            break;
+        case TOK_ASM1:
+        case TOK_ASM2:
+        case TOK_ASM3:
+        case TOK_alloca:
+            func_regvars = 0;
+            break;
+        case '(':
+            paren++;
+            break;
+        case ')':
+            if (--paren == hdr) {
+                hdr = -1;
+                body = 1;
+            }
+            break;
+        case ';':
+            if (paren == 0)
+                single = 0;
+            break;
+        case '{':
+            level++;
+            break;
+        case '}':
+            if (nb_loops && loop_level[nb_loops - 1] == level)
+                nb_loops--;
+            level--;
+            break;
+        default:
+            if (t < TOK_UIDENT)
+                break;
+            if (addr) {
+                regvar_use(t, -1);
+            } else if (last != '.' && last != TOK_ARROW && tok != '(') {
+                depth = nb_loops + single + (hdr >= 0);
+                regvar_use(t, 1 << (2 * (depth < 4 ? depth : 4)));
+            }
+            break;
+        }
+        /* '&x' and '&(x)' */
+        addr = t == '&' || (addr && t == '(');
+        last = t;
+        if (level == 0)
+            break;
+    }
+    tok_str_add(str, -1);
+    tok_str_add(str, 0);
+
+    /* ignore the global names when ranking the identifiers */
+    memset(best, 0, sizeof(best));
+    for(i = 0; i < nb_regvar_uses; i++) {
+        w = regvar_uses[i];
+        if (w <= best[NB_REGVARS - 1] || sym_find(i + TOK_IDENT))
+            continue;
+        for(j = NB_REGVARS - 1; j > 0 && best[j - 1] < w; j--)
+            best[j] = best[j - 1];
+        best[j] = w;
+    }
+    regvar_min = best[NB_REGVARS - 1];
+    if (regvar_min < REGVAR_MIN_USES)
+        regvar_min = REGVAR_MIN_USES;
+}
+
+/* return the callee saved register where the new local or parameter
+   'v' of type 'type' is kept, or -1 if it must be on the stack */
+ST_FUNC int alloc_regvar(int v, CType *type)
+{
+    int bt;
+
+    bt = type->t & VT_BTYPE;
+    if (!func_regvars ||
+        (type->t & (VT_ARRAY | VT_VLA | VT_VOLATILE | VT_BITFIELD)) ||
+        (bt != VT_INT && bt != VT_LLONG && bt != VT_PTR) ||
+        v < TOK_UIDENT || v - TOK_IDENT >= nb_regvar_uses ||
+        regvar_uses[v - TOK_IDENT] < regvar_min)
+        return -1;
+    return get_regvar();
+}
+
+/* free the registers of the locals above 'b' on the local stack */
+static void regvar_pop(Sym *b)
+{
+    Sym *s;
+
+    for(s = local_stack; s != b; s = s->prev) {
+        if (s->r == (VT_REGVAR | VT_LVAL) &&
+            !(s->v & SYM_STRUCT) && !(s->type.t & VT_TYPEDEF))
+            free_regvar(s->c);
+    }
+}
+#endif
+
+/* minimum number of cases for a jump table */
+#define CASE_TABLE_MIN 8
+
+static int case_cmp(const void *pa, const void *pb)
+{
+    long long a = (*(CaseLabel **)pa)->v1;
+    long long b = (*(CaseLabel **)pb)->v1;
+    return a < b ? -1 : a > b;
+}
+
+/* push the value of the switch: in register 'r', or for a long long
+   on 32 bit targets in the local variable at 'r' */
+static void vset_switch(SwitchInfo *sw, int r)
+{
+    if (sw->ll) {
+        CType type;
+        type.t = VT_LLONG;
+        type.ref = NULL;
+#ifdef TCC_TARGET_X86_64
+        vset(&type, r, 0);
+#else
+        vset(&type, VT_LOCAL | VT_LVAL, r);
+#endif
+    } else {
+        vseti(r, 0);
+    }
+}
+
+/* parse a case value, converted to the type of the switch value */
+static long long case_const(SwitchInfo *sw)
+{
+    long long v;
+    CType type;
+
+    expr_const1();
+    if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST)
+        expect("constant expression");
+    type.t = sw->ll ? VT_LLONG : VT_INT;
+    type.ref = NULL;
+    gen_cast(&type);
+    if (sw->ll)
+        v = vtop->c.ll;
+    else
+        v = vtop->c.i;
+    vpop();
+    return v;
+}
+
+/* push a case value with the type of the switch value */
+static void vpush_case(SwitchInfo *sw, long long v)
+{
+    if (sw->ll)
+        vpushll(v);
+    else
+        vpushi(v);
+}
+
+/* binary search of the value in register 'r' among 'n' sorted
+   cases. Jumps to the default label are added to '*dsym' */
+static void gcase(SwitchInfo *sw, CaseLabel **p, int n, int r, int *dsym)
+{
+    CaseLabel *c;
+    int e, t;
+
+    while (n > 4) {
+        e = n / 2;
+        vset_switch(sw, r);
+        vpush_case(sw, p[e]->v1);
+        gen_op(TOK_LT);
+        t = gtst(0, 0);
+        gcase(sw, p + e, n - e, r, dsym);
+        gsym(t);
+        n = e;
+    }
+    for(e = 0; e < n; e++) {
+        c = p[e];
+        t = 0;
+        if (c->v1 != c->v2) {
+            vset_switch(sw, r);
+            vpush_case(sw, c->v1);
+            gen_op(TOK_LT);
+            t = gtst(0, 0);
+            vset_switch(sw, r);
+            vpush_case(sw, c->v2);
+            gen_op(TOK_LE);
+        } else {
+            vset_switch(sw, r);
+            vpush_case(sw, c->v1);
+            gen_op(TOK_EQ);
+        }
+        gsym_addr(gtst(0, 0), c->ind);
+        gsym(t);
+    }
+    *dsym = gjmp(*dsym);
+}
+
+/* generate the dispatch code of a switch on the value in register
+   'r': a jump table if the cases are dense enough, a binary search
+   otherwise */
+static void gen_switch(SwitchInfo *sw, int r)
+{
+    CaseLabel **p, *c;
+    CType type;
+    unsigned long long span = 0, count;
+    int i, n, d, tab_offset, *tab;
+
+    p = sw->cases;
+    n = sw->nb_cases;
+    qsort(p, n, sizeof(*p), case_cmp);
+    count = 0;
+    for(i = 0; i < n; i++) {
+        if (i > 0 && p[i]->v1 <= p[i - 1]->v2)
+            tcc_error("duplicate case value");
+        count += (unsigned long long)p[i]->v2 - p[i]->v1 + 1;
+    }
+    d = 0;
+    tab_offset = -1;
+    if (n >= CASE_TABLE_MIN && !nocode_wanted) {
+        span = (unsigned long long)p[n - 1]->v2 - p[0]->v1;
+        if (span < 0x10000 && span / 3 < count) {
+            /* jump table of offsets from the start of the function */
+            data_section->data_offset = (data_section->data_offset + 3) & -4;
+            tab_offset = data_section->data_offset;
+            section_ptr_add(data_section, (span + 1) * sizeof(int));
+            vset_switch(sw, r);
+            vpush_case(sw, p[0]->v1);
+            gen_op('-');
+            vdup();
+            vpush_case(sw, span);
+            gen_op(TOK_UGT);
+            d = gtst(0, 0);
+            gen_cast(&int_type);
+            vpush_ref(&char_pointer_type, cur_text_section, func_ind, 0);
+            vswap();
+            type = int_type;
+            mk_pointer(&type);
+            vpush_ref(&type, data_section, tab_offset, (span + 1) * sizeof(int));
+            vswap();
+            gen_op('+');
+            indir();
+            gen_op('+');
+            ggoto();
+        }
+    }
+    if (tab_offset < 0)
+        gcase(sw, p, n, r, &d);
+    if (sw->def_ind < 0) {
+        /* no default: continue after the switch */
+#ifdef __native_client__
+        opadding();
+#endif
+        sw->def_ind = ind;
+    }
+    gsym_addr(d, sw->def_ind);
+    if (tab_offset >= 0) {
+        tab = (int *)(data_section->data + tab_offset);
+        for(i = 0; i <= span; i++)
+            tab[i] = sw->def_ind - func_ind;
+        for(i = 0; i < n; i++) {
+            c = p[i];
+            for(d = c->v1 - p[0]->v1; d <= c->v2 - p[0]->v1; d++)
+                tab[d] = c->ind - func_ind;
+        }
+#ifdef CONFIG_TCC_RELAX
+        add_case_table(tab_offset, span + 1);
+#endif
+    }
+}
+
+static void block(int *bsym, int *csym, SwitchInfo *sw, int is_expr)
 {
     int a, b, c, d;
     Sym *s;
@@ -4321,13 +5575,13 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
         gexpr();
         skip(')');
         a = gtst(1, 0);
-        block(bsym, csym, case_sym, def_sym, case_reg, 0);
+        block(bsym, csym, sw, 0);
         c = tok;
         if (c == TOK_ELSE) {
             next();
             d = gjmp(0);
             gsym(a);
-            block(bsym, csym, case_sym, def_sym, case_reg, 0);
+            block(bsym, csym, sw, 0);
             gsym(d); /* patch else jmp */
         } else
             gsym(a);
@@ -4339,7 +5593,7 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
         skip(')');
         a = gtst(1, 0);
         b = 0;
-        block(&a, &b, case_sym, def_sym, case_reg, 0);
+        block(&a, &b, sw, 0);
         gjmp_addr(d);
         gsym(a);
         gsym_addr(b, d);
@@ -4371,7 +5625,7 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
             if (tok != '}') {
                 if (is_expr)
                     vpop();
-                block(bsym, csym, case_sym, def_sym, case_reg, is_expr);
+                block(bsym, csym, sw, is_expr);
             }
         }
         /* pop locally defined labels */
@@ -4391,12 +5645,20 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
             }
         }
         /* pop locally defined symbols */
+#ifdef CONFIG_TCC_REGVARS
+        if (!is_expr)
+            regvar_pop(s);
+#endif
         sym_pop(&local_stack, s);
         next();
     } else if (tok == TOK_RETURN) {
         next();
         if (tok != ';') {
+            /* not in a loop: the address of a local may be taken
+               further down its body */
+            return_expr = !csym;
             gexpr();
+            return_expr = 0;
             gen_assign_cast(&func_vt);
             if ((func_vt.t & VT_BTYPE) == VT_STRUCT) {
                 CType type;
@@ -4488,10 +5750,13 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
             gsym(e);
         }
         skip(')');
-        block(&a, &b, case_sym, def_sym, case_reg, 0);
+        block(&a, &b, sw, 0);
         gjmp_addr(c);
         gsym(a);
         gsym_addr(b, c);
+#ifdef CONFIG_TCC_REGVARS
+        regvar_pop(s);
+#endif
         sym_pop(&local_stack, s);
     } else 
     if (tok == TOK_DO) {
@@ -4499,7 +5764,7 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
         a = 0;
         b = 0;
         d = ind;
-        block(&a, &b, case_sym, def_sym, case_reg, 0);
+        block(&a, &b, sw, 0);
         skip(TOK_WHILE);
         skip('(');
         gsym(b);
@@ -4511,67 +5776,81 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
         skip(';');
     } else
     if (tok == TOK_SWITCH) {
+        SwitchInfo sw1;
         next();
         skip('(');
         gexpr();
         /* XXX: other types than integer */
-        case_reg = gv(RC_INT);
+        sw1.ll = (vtop->type.t & VT_BTYPE) == VT_LLONG;
+#ifndef TCC_TARGET_X86_64
+        if (sw1.ll) {
+            /* a register pair would not survive the comparisons of
+               the dispatch: keep the value in a local variable */
+            CType type = vtop->type;
+            loc = (loc - 8) & -8;
+            c = loc;
+            vset(&type, VT_LOCAL | VT_LVAL, c);
+            vswap();
+            vstore();
+        } else
+#endif
+        c = gv(RC_INT);
         vpop();
         skip(')');
+        sw1.cases = NULL;
+        sw1.nb_cases = 0;
+        sw1.def_ind = -1;
         a = 0;
-        b = gjmp(0); /* jump to first case */
-        c = 0;
-        block(&a, csym, &b, &c, case_reg, 0);
-        /* if no default, jmp after switch */
-        if (c == 0)
-            c = ind;
-        /* default label */
-        gsym_addr(b, c);
+        b = gjmp(0); /* jump to the case dispatch */
+        block(&a, csym, &sw1, 0);
+        a = gjmp(a);
+        /* the value is still in 'c' when coming from the jump */
+        gsym(b);
+        gen_switch(&sw1, c);
+        dynarray_reset(&sw1.cases, &sw1.nb_cases);
         /* break label */
         gsym(a);
     } else
     if (tok == TOK_CASE) {
-        int v1, v2;
-        if (!case_sym)
+        CaseLabel *cl;
+        long long v1, v2;
+        if (!sw)
             expect("switch");
         next();
-        v1 = expr_const();
+        v1 = case_const(sw);
         v2 = v1;
         if (gnu_ext && tok == TOK_DOTS) {
             next();
-            v2 = expr_const();
+            v2 = case_const(sw);
             if (v2 < v1)
                 tcc_warning("empty case range");
         }
-        /* since a case is like a label, we must skip it with a jmp */
-        b = gjmp(0);
-        gsym(*case_sym);
-        vseti(case_reg, 0);
-        vpushi(v1);
-        if (v1 == v2) {
-            gen_op(TOK_EQ);
-            *case_sym = gtst(1, 0);
-        } else {
-            gen_op(TOK_GE);
-            *case_sym = gtst(1, 0);
-            vseti(case_reg, 0);
-            vpushi(v2);
-            gen_op(TOK_LE);
-            *case_sym = gtst(1, *case_sym);
-        }
-        gsym(b);
         skip(':');
+#ifdef __native_client__
+        /* jump table targets must start a bundle */
+        opadding();
+#endif
+        if (v1 <= v2) {
+            cl = tcc_malloc(sizeof(CaseLabel));
+            cl->v1 = v1;
+            cl->v2 = v2;
+            cl->ind = ind;
+            dynarray_add((void ***)&sw->cases, &sw->nb_cases, cl);
+        }
         is_expr = 0;
         goto block_after_label;
     } else 
     if (tok == TOK_DEFAULT) {
         next();
         skip(':');
-        if (!def_sym)
+        if (!sw)
             expect("switch");
-        if (*def_sym)
+        if (sw->def_ind >= 0)
             tcc_error("too many 'default'");
-        *def_sym = ind;
+#ifdef __native_client__
+        opadding();
+#endif
+        sw->def_ind = ind;
         is_expr = 0;
         goto block_after_label;
     } else
@@ -4604,11 +5883,16 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
         }
         skip(';');
     } else if (tok == TOK_ASM1 || tok == TOK_ASM2 || tok == TOK_ASM3) {
+#ifdef CONFIG_TCC_RELAX
+        func_has_asm = 1;
+#endif
+        func_tail_ok = 0;
         asm_instr();
     } else {
         b = is_label();
         if (b) {
             /* label case */
+            func_tail_ok = 0; /* for the same reason as loops */
             s = label_find(b);
             if (s) {
                 if (s->r == LABEL_DEFINED)
@@ -4626,7 +5910,7 @@ static void block(int *bsym, int *csym, int *case_sym, int *def_sym,
             } else {
                 if (is_expr)
                     vpop();
-                block(bsym, csym, case_sym, def_sym, case_reg, is_expr);
+                block(bsym, csym, sw, is_expr);
             }
         } else {
             /* expression case */
@@ -4867,6 +6151,19 @@ static void init_putz(CType *t, Section *sec, unsigned long c, int size)
     if (sec) {
         /* nothing to do because globals are already set to zero */
     } else {
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+        CType type;
+        int done;
+
+        type.t = VT_BYTE;
+        vset(&type, VT_LOCAL | VT_LVAL, c);
+        vpushi(0);
+        done = inline_memset(size);
+        vpop();
+        vpop();
+        if (done)
+            return;
+#endif
         vpush_global_sym(&func_old_type, TOK_memset);
         vseti(VT_LOCAL, c);
         vpushi(0);
@@ -4893,6 +6190,7 @@ static void decl_initializer(CType *type, Section *sec, unsigned long c,
         int a;
         CValue retcval;
 
+        func_tail_ok = 0;
         vpush_global_sym(&func_old_type, TOK_alloca);
         vla_runtime_type_size(type, &a);
         gfunc_call(1);
@@ -5221,6 +6519,23 @@ static void decl_initializer_alloc(CType *type, AttributeDef *ad, int r,
     }
     if ((r & VT_VALMASK) == VT_LOCAL) {
         sec = NULL;
+#ifdef CONFIG_TCC_REGVARS
+        if (v && (!has_init || tok != '{') &&
+            (addr = alloc_regvar(v, type)) >= 0) {
+            CType dtype;
+            sym_push(v, type, VT_REGVAR | VT_LVAL, addr);
+            if (has_init) {
+                /* the initializer is a plain assignment */
+                dtype = *type;
+                dtype.t &= ~VT_CONSTANT;
+                vset(&dtype, VT_REGVAR | VT_LVAL, addr);
+                expr_eq();
+                vstore();
+                vpop();
+            }
+            goto no_alloc;
+        }
+#endif
 #ifdef CONFIG_TCC_BCHECK
         if (tcc_state->do_bounds_check && (type->t & VT_ARRAY)) {
             loc--;
@@ -5442,24 +6757,56 @@ static void func_decl_list(Sym *func_sym)
 static void gen_function(Sym *sym)
 {
     int saved_nocode_wanted = nocode_wanted;
+#ifdef CONFIG_TCC_REGVARS
+    ParseState saved_parse_state;
+    TokenString func_str;
+    int saved_pack;
+
+    func_str.str = NULL;
+    saved_pack = 0;
+    func_regvars = tcc_state->optimize;
+#ifdef CONFIG_TCC_BCHECK
+    if (tcc_state->do_bounds_check)
+        func_regvars = 0;
+#endif
+    if (func_regvars) {
+        /* scan the body first, then parse it again */
+        regvar_scan(&func_str);
+        saved_pack = *tcc_state->pack_stack_ptr;
+        save_parse_state(&saved_parse_state);
+        macro_ptr = func_str.str;
+        next();
+    }
+#endif
     nocode_wanted = 0;
     ind = cur_text_section->data_offset;
     /* NOTE: we patch the symbol size later */
     put_extern_sym(sym, cur_text_section, ind, 0);
     funcname = get_tok_str(sym->v, NULL);
     func_ind = ind;
+#ifdef CONFIG_TCC_RELAX
+    relax_init();
+#endif
     /* put debug symbol */
     if (tcc_state->do_debug)
         put_func_debug(sym);
     /* push a dummy symbol to enable local sym storage */
     sym_push2(&local_stack, SYM_FIELD, 0, 0);
+    func_tail_ok = tcc_state->optimize_sibling_calls;
+#ifdef CONFIG_TCC_BCHECK
+    if (tcc_state->do_bounds_check)
+        func_tail_ok = 0;
+#endif
     gfunc_prolog(&sym->type);
     rsym = 0;
-    block(NULL, NULL, NULL, NULL, 0, 0);
+    block(NULL, NULL, NULL, 0);
     gsym(rsym);
     gfunc_epilog();
-    cur_text_section->data_offset = ind;
     label_pop(&global_label_stack, NULL);
+#ifdef CONFIG_TCC_RELAX
+    relax_branches();
+#endif
+    cur_text_section->data_offset = ind;
     sym_pop(&local_stack, NULL); /* reset local stack */
     /* end of function */
     /* patch symbol size */
@@ -5477,6 +6824,14 @@ static void gen_function(Sym *sym)
     func_vt.t = VT_VOID; /* for safety */
     ind = 0; /* for safety */
     nocode_wanted = saved_nocode_wanted;
+#ifdef CONFIG_TCC_REGVARS
+    if (func_str.str) {
+        tok_str_free(func_str.str);
+        restore_parse_state(&saved_parse_state);
+        *tcc_state->pack_stack_ptr = saved_pack;
+    }
+    func_regvars = 0;
+#endif
 }
 
 ST_FUNC void gen_inline_functions(void)
@@ -53,14 +53,39 @@ ST_DATA TokenSym **table_ident;
 
 /* ------------------------------------------------------------------------- */
 
-static int *macro_ptr_allocated;
-static const int *unget_saved_macro_ptr;
-static int unget_saved_buffer[TOK_MAX_SIZE + 1];
-static int unget_buffer_enabled;
-static TokenSym *hash_ident[TOK_HASH_SIZE];
-static char token_buf[STRING_MAX_SIZE + 1];
+static ST_TLS int *macro_ptr_allocated;
+static ST_TLS const int *unget_saved_macro_ptr;
+static ST_TLS int unget_saved_buffer[TOK_MAX_SIZE + 1];
+static ST_TLS int unget_buffer_enabled;
+static ST_TLS TokenSym **hash_ident;
+static ST_TLS int hash_ident_size;
+static ST_TLS char token_buf[STRING_MAX_SIZE + 1];
 /* true if isid(c) || isnum(c) */
-static unsigned char isidnum_table[256-CH_EOF];
+static ST_TLS unsigned char isidnum_table[256-CH_EOF];
+
+/* macro tested by the last '#if !defined(macro)' */
+static ST_TLS int expr_guard_macro;
+
+/* object-like macro expansions: see macro_subst_tok() */
+typedef struct MacroMemo {
+    int stamp;     /* define_stamp when last known valid */
+    int spaces;    /* PARSE_FLAG_SPACES at expansion */
+    int nb_deps;   /* (identifier, define serial) pairs looked up */
+    int len;       /* token string length */
+    int data[1];   /* deps, then token string */
+} MacroMemo;
+
+static ST_TLS int define_stamp;  /* changes with any define/undef */
+static ST_TLS int define_serial; /* identifies a define Sym */
+static ST_TLS int *memo_deps;
+static ST_TLS int nb_memo_deps, memo_deps_size;
+static ST_TLS int memo_recording;
+static ST_TLS int memo_uncacheable;
+
+/* loaded preprocessor snapshot */
+static ST_TLS uint8_t *snapshot_data;
+static ST_TLS unsigned long snapshot_size;
+static ST_TLS int *snapshot_str;
 
 static const char tcc_keywords[] = 
 #define DEF(id, str) str "\0"
@@ -142,6 +167,17 @@ ST_FUNC void cstr_cat(CString *cstr, const char *str)
     }
 }
 
+/* add 'len' bytes */
+static void cstr_catn(CString *cstr, const char *str, int len)
+{
+    int size;
+    size = cstr->size + len;
+    if (size > cstr->size_allocated)
+        cstr_realloc(cstr, size);
+    memcpy((char *)cstr->data + cstr->size, str, len);
+    cstr->size = size;
+}
+
 /* add a wide char */
 ST_FUNC void cstr_wccat(CString *cstr, int ch)
 {
@@ -187,8 +223,55 @@ ST_FUNC void add_char(CString *cstr, int c)
 }
 
 /* ------------------------------------------------------------------------- */
+/* FNV-1a, with a final mix so that the low bits used as bucket index
+   depend on all the characters */
+#define TOK_HASH_INIT 2166136261u
+#define TOK_HASH_FUNC(h, c) (((h) ^ (c)) * 16777619u)
+
+static inline unsigned int tok_hash_mix(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static unsigned int tok_hash(const char *str, int len)
+{
+    unsigned int h;
+    int i;
+
+    h = TOK_HASH_INIT;
+    for(i=0;i<len;i++)
+        h = TOK_HASH_FUNC(h, ((unsigned char *)str)[i]);
+    return tok_hash_mix(h);
+}
+
+/* double the number of buckets */
+static void tok_hash_grow(void)
+{
+    TokenSym **ptable, *ts, *ts1;
+    int i, size;
+    unsigned int h;
+
+    size = hash_ident_size * 2;
+    ptable = tcc_mallocz(size * sizeof(TokenSym *));
+    for(i = 0; i < hash_ident_size; i++) {
+        for(ts = hash_ident[i]; ts; ts = ts1) {
+            ts1 = ts->hash_next;
+            h = tok_hash(ts->str, ts->len) & (size - 1);
+            ts->hash_next = ptable[h];
+            ptable[h] = ts;
+        }
+    }
+    tcc_free(hash_ident);
+    hash_ident = ptable;
+    hash_ident_size = size;
+}
+
 /* allocate a new token */
-static TokenSym *tok_alloc_new(TokenSym **pts, const char *str, int len)
+static TokenSym *tok_alloc_new(TokenSym **pts, const char *str, int len,
+                               unsigned int h)
 {
     TokenSym *ts, **ptable;
     int i;
@@ -204,6 +287,11 @@ static TokenSym *tok_alloc_new(TokenSym **pts, const char *str, int len)
             tcc_error("memory full");
         table_ident = ptable;
     }
+    /* keep the chains short */
+    if (i >= hash_ident_size) {
+        tok_hash_grow();
+        pts = &hash_ident[h & (hash_ident_size - 1)];
+    }
 
     ts = tcc_malloc(sizeof(TokenSym) + len);
     table_ident[i] = ts;
@@ -213,46 +301,162 @@ static TokenSym *tok_alloc_new(TokenSym **pts, const char *str, int len)
     ts->sym_struct = NULL;
     ts->sym_identifier = NULL;
     ts->len = len;
-    ts->hash_next = NULL;
+    ts->hash_next = *pts;
     memcpy(ts->str, str, len);
     ts->str[len] = '\0';
     *pts = ts;
     return ts;
 }
 
-#define TOK_HASH_INIT 1
-#define TOK_HASH_FUNC(h, c) ((h) * 263 + (c))
+/* perfect hash of the keywords (CHD: hash, displace), computed once.
+   A keyword is found with a single probe, before the chains. */
+#define KW_HASH_BITS 11
+#define KW_HASH_SIZE (1 << KW_HASH_BITS)
+#define KW_BUCKETS (KW_HASH_SIZE / 4)
+
+static ST_TLS int kw_hash_state; /* 0: not built, 1: built, -1: failed */
+static ST_TLS unsigned short kw_disp[KW_BUCKETS];
+static ST_TLS unsigned short kw_tok[KW_HASH_SIZE]; /* token - TOK_IDENT + 1 */
+
+static inline unsigned int kw_slot(unsigned int h)
+{
+    h ^= kw_disp[h & (KW_BUCKETS - 1)] * 0x9e3779b9u;
+    return (h * 0x85ebca6bu) >> (32 - KW_HASH_BITS);
+}
+
+static inline TokenSym *kw_find(const uint8_t *str, int len, unsigned int h)
+{
+    TokenSym *ts;
+    int t;
+
+    t = kw_tok[kw_slot(h)];
+    if (t) {
+        ts = table_ident[t - 1];
+        if (ts->len == len && !memcmp(ts->str, str, len))
+            return ts;
+    }
+    return NULL;
+}
+
+static void kw_hash_build(int nb_kw)
+{
+    int *bucket_of, *order, *slots;
+    int i, j, k, b, n, d, t, nb, bsize[KW_BUCKETS];
+    unsigned int *h;
+
+    kw_hash_state = -1;
+    if (nb_kw * 2 > KW_HASH_SIZE || nb_kw >= 0xffff)
+        return;
+    h = tcc_malloc(nb_kw * sizeof(unsigned int));
+    bucket_of = tcc_malloc(nb_kw * sizeof(int));
+    order = tcc_malloc(nb_kw * sizeof(int));
+    slots = tcc_malloc(nb_kw * sizeof(int));
+    memset(bsize, 0, sizeof bsize);
+    for(i = 0; i < nb_kw; i++) {
+        h[i] = tok_hash(table_ident[i]->str, table_ident[i]->len);
+        bucket_of[i] = h[i] & (KW_BUCKETS - 1);
+        bsize[bucket_of[i]]++;
+    }
+    /* place the largest buckets first */
+    n = 0;
+    for(k = nb_kw; k > 0; k--)
+        for(b = 0; b < KW_BUCKETS; b++)
+            if (bsize[b] == k)
+                for(i = 0; i < nb_kw; i++)
+                    if (bucket_of[i] == b)
+                        order[n++] = i;
+    memset(kw_disp, 0, sizeof kw_disp);
+    memset(kw_tok, 0, sizeof kw_tok);
+    for(i = 0; i < n; i += nb) {
+        b = bucket_of[order[i]];
+        nb = bsize[b];
+        for(d = 0; d < 0x10000; d++) {
+            kw_disp[b] = d;
+            for(j = 0; j < nb; j++) {
+                t = kw_slot(h[order[i + j]]);
+                if (kw_tok[t])
+                    break;
+                for(k = 0; k < j; k++)
+                    if (slots[k] == t)
+                        break;
+                if (k < j)
+                    break;
+                slots[j] = t;
+            }
+            if (j == nb)
+                break;
+        }
+        if (d == 0x10000) {
+            memset(kw_tok, 0, sizeof kw_tok);
+            goto the_end;
+        }
+        for(j = 0; j < nb; j++)
+            kw_tok[slots[j]] = order[i + j] + 1;
+    }
+    kw_hash_state = 1;
+ the_end:
+    tcc_free(h);
+    tcc_free(bucket_of);
+    tcc_free(order);
+    tcc_free(slots);
+}
 
 /* find a token and add it if not found */
 ST_FUNC TokenSym *tok_alloc(const char *str, int len)
 {
     TokenSym *ts, **pts;
-    int i;
     unsigned int h;
     
-    h = TOK_HASH_INIT;
-    for(i=0;i<len;i++)
-        h = TOK_HASH_FUNC(h, ((unsigned char *)str)[i]);
-    h &= (TOK_HASH_SIZE - 1);
-
-    pts = &hash_ident[h];
-    for(;;) {
-        ts = *pts;
-        if (!ts)
-            break;
+    h = tok_hash(str, len);
+    if (kw_hash_state > 0) {
+        ts = kw_find((const uint8_t *)str, len, h);
+        if (ts)
+            return ts;
+    }
+    pts = &hash_ident[h & (hash_ident_size - 1)];
+    for(ts = *pts; ts; ts = ts->hash_next) {
         if (ts->len == len && !memcmp(ts->str, str, len))
             return ts;
-        pts = &(ts->hash_next);
     }
-    return tok_alloc_new(pts, str, len);
+    return tok_alloc_new(pts, str, len, h);
+}
+
+/* bucket occupancy, for -bench */
+ST_FUNC void tok_hash_stats(int *size, int *used, int *max_chain,
+                            double *avg_probes)
+{
+    TokenSym *ts;
+    int i, n, probes;
+
+    *size = hash_ident_size;
+    *used = *max_chain = 0;
+    probes = 0;
+    for(i = 0; i < hash_ident_size; i++) {
+        n = 0;
+        for(ts = hash_ident[i]; ts; ts = ts->hash_next)
+            probes += ++n;
+        if (n)
+            (*used)++;
+        if (n > *max_chain)
+            *max_chain = n;
+    }
+    n = tok_ident - TOK_IDENT;
+    *avg_probes = n ? (double)probes / n : 0;
+}
+
+ST_FUNC void tok_hash_free(void)
+{
+    tcc_free(hash_ident);
+    hash_ident = NULL;
+    hash_ident_size = 0;
 }
 
 /* XXX: buffer overflow */
 /* XXX: float tokens */
 ST_FUNC char *get_tok_str(int v, CValue *cv)
 {
-    static char buf[STRING_MAX_SIZE + 1];
-    static CString cstr_buf;
+    static ST_TLS char buf[STRING_MAX_SIZE + 1];
+    static ST_TLS CString cstr_buf;
     CString *cstr;
     char *p;
     int i, len;
@@ -358,7 +562,7 @@ static int tcc_peekc_slow(BufferedFile *bf)
     int len;
     /* only tries to read if really end of buffer */
     if (bf->buf_ptr >= bf->buf_end) {
-        if (bf->fd != -1) {
+        if (bf->fd != -1 && !bf->fdata) {
 #if defined(PARSE_DEBUG)
             len = 8;
 #else
@@ -483,6 +687,181 @@ ST_FUNC void minp(void)
         handle_stray();
 }
 
+/* ------------------------------------------------------------------------- */
+/* fast scanning of the input buffer. All scans stop at the CH_EOB
+   sentinel ('\\') which ends every buffer, so the vector versions can
+   read whole aligned blocks: such a block never crosses a page
+   boundary, hence never faults past the sentinel. */
+
+#if defined __GNUC__ && !defined __TINYC__ && defined __AVX2__
+#define VEC_SIZE 32
+typedef __m256i vec_t;
+#define vec_load(p) _mm256_load_si256((const __m256i *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_mask(a) ((unsigned)_mm256_movemask_epi8(a))
+#elif defined __GNUC__ && !defined __TINYC__ && defined __SSE2__
+#define VEC_SIZE 16
+typedef __m128i vec_t;
+#define vec_load(p) _mm_load_si128((const __m128i *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_mask(a) ((unsigned)_mm_movemask_epi8(a))
+#endif
+
+#ifdef VEC_SIZE
+#define VEC_ALL ((unsigned)((1ULL << VEC_SIZE) - 1))
+
+/* return the first char at or after 'p' flagged by 'stop(v)' */
+#define VEC_SCAN(p, stop)                                       \
+{                                                               \
+    uint8_t *b = (uint8_t *)((uplong)(p) & ~(uplong)(VEC_SIZE - 1)); \
+    vec_t v = vec_load(b);                                      \
+    unsigned m = stop(v) & (VEC_ALL << ((p) - b));              \
+    while (m == 0) {                                            \
+        b += VEC_SIZE;                                          \
+        v = vec_load(b);                                        \
+        m = stop(v);                                            \
+    }                                                           \
+    return b + __builtin_ctz(m);                                \
+}
+
+/* [a-zA-Z0-9_]: the signed compares also reject chars >= 0x80 */
+static inline unsigned vec_not_idnum(vec_t v)
+{
+    vec_t l = vec_or(v, vec_set1(0x20));
+    vec_t a = vec_and(vec_gt(l, vec_set1('a' - 1)), vec_gt(vec_set1('z' + 1), l));
+    vec_t d = vec_and(vec_gt(v, vec_set1('0' - 1)), vec_gt(vec_set1('9' + 1), v));
+    return ~vec_mask(vec_or(vec_or(a, d), vec_eq(v, vec_set1('_')))) & VEC_ALL;
+}
+
+static inline unsigned vec_not_blank(vec_t v)
+{
+    return ~vec_mask(vec_or(vec_eq(v, vec_set1(' ')),
+                            vec_eq(v, vec_set1('\t')))) & VEC_ALL;
+}
+
+static inline unsigned vec_comment_stop(vec_t v)
+{
+    return vec_mask(vec_or(vec_or(vec_eq(v, vec_set1('\n')),
+                                  vec_eq(v, vec_set1('*'))),
+                           vec_eq(v, vec_set1('\\'))));
+}
+
+static inline unsigned vec_line_stop(vec_t v)
+{
+    return vec_mask(vec_or(vec_eq(v, vec_set1('\n')),
+                           vec_eq(v, vec_set1('\\'))));
+}
+
+static inline unsigned vec_code_stop(vec_t v)
+{
+    return vec_mask(vec_or(vec_or(vec_or(vec_eq(v, vec_set1('\n')),
+                                         vec_eq(v, vec_set1('\\'))),
+                                  vec_or(vec_eq(v, vec_set1('\"')),
+                                         vec_eq(v, vec_set1('\'')))),
+                           vec_eq(v, vec_set1('/'))));
+}
+#endif
+
+/* skip identifier chars */
+static inline uint8_t *scan_idnum(uint8_t *p)
+{
+#ifdef VEC_SIZE
+    VEC_SCAN(p, vec_not_idnum);
+#else
+    while (isidnum_table[*p - CH_EOF])
+        p++;
+    return p;
+#endif
+}
+
+/* skip ' ' and '\t' */
+static inline uint8_t *scan_blanks(uint8_t *p)
+{
+#ifdef VEC_SIZE
+    VEC_SCAN(p, vec_not_blank);
+#else
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+#endif
+}
+
+/* find '\n', '*' or '\\' */
+static inline uint8_t *scan_comment(uint8_t *p)
+{
+#ifdef VEC_SIZE
+    VEC_SCAN(p, vec_comment_stop);
+#else
+    int c;
+    for(;;) {
+        c = *p;
+        if (c == '\n' || c == '*' || c == '\\')
+            return p;
+        p++;
+        c = *p;
+        if (c == '\n' || c == '*' || c == '\\')
+            return p;
+        p++;
+    }
+#endif
+}
+
+/* find '\n' or '\\' */
+static inline uint8_t *scan_line(uint8_t *p)
+{
+#ifdef VEC_SIZE
+    VEC_SCAN(p, vec_line_stop);
+#else
+    while (*p != '\n' && *p != '\\')
+        p++;
+    return p;
+#endif
+}
+
+/* find '\n', '\\', a quote or '/' */
+static inline uint8_t *scan_code(uint8_t *p)
+{
+#ifdef VEC_SIZE
+    VEC_SCAN(p, vec_code_stop);
+#else
+    int c;
+    for(;;) {
+        c = *p;
+        if (c == '\n' || c == '\\' || c == '\"' || c == '\'' || c == '/')
+            return p;
+        p++;
+    }
+#endif
+}
+
+/* find 'sep', '\\', '\n' or '\r' */
+static inline uint8_t *scan_string(uint8_t *p, int sep)
+{
+#ifdef VEC_SIZE
+    vec_t s = vec_set1(sep);
+#define vec_string_stop(v) \
+    vec_mask(vec_or(vec_or(vec_eq(v, s), vec_eq(v, vec_set1('\\'))), \
+                    vec_or(vec_eq(v, vec_set1('\n')), vec_eq(v, vec_set1('\r')))))
+    VEC_SCAN(p, vec_string_stop);
+#undef vec_string_stop
+#else
+    int c;
+    for(;;) {
+        c = *p;
+        if (c == sep || c == '\\' || c == '\n' || c == '\r')
+            return p;
+        p++;
+    }
+#endif
+}
 
 /* single line C++ comments */
 static uint8_t *parse_line_comment(uint8_t *p)
@@ -515,7 +894,7 @@ static uint8_t *parse_line_comment(uint8_t *p)
                 goto redo;
             }
         } else {
-            p++;
+            p = scan_line(p + 1);
         }
     }
     return p;
@@ -529,16 +908,8 @@ ST_FUNC uint8_t *parse_comment(uint8_t *p)
     p++;
     for(;;) {
         /* fast skip loop */
-        for(;;) {
-            c = *p;
-            if (c == '\n' || c == '*' || c == '\\')
-                break;
-            p++;
-            c = *p;
-            if (c == '\n' || c == '*' || c == '\\')
-                break;
-            p++;
-        }
+        p = scan_comment(p);
+        c = *p;
         /* now we can handle all the cases */
         if (c == '\n') {
             file->line_num++;
@@ -618,6 +989,7 @@ static inline int check_space(int t, int *spc)
 static uint8_t *parse_pp_string(uint8_t *p,
                                 int sep, CString *str)
 {
+    uint8_t *p1;
     int c;
     p++;
     for(;;) {
@@ -668,9 +1040,11 @@ static uint8_t *parse_pp_string(uint8_t *p,
             }
         } else {
         add_char:
+            /* copy up to the next special char at once */
+            p1 = scan_string(p + 1, sep);
             if (str)
-                cstr_ccat(str, c);
-            p++;
+                cstr_catn(str, (char *)p, p1 - p);
+            p = p1;
         }
     }
     p++;
@@ -802,6 +1176,7 @@ static inline int tok_ext_size(int t)
     case TOK_LCHAR:
     case TOK_CFLOAT:
     case TOK_LINENUM:
+    case TOK_PACK:
         return 1;
     case TOK_STR:
     case TOK_LSTR:
@@ -829,9 +1204,85 @@ ST_INLN void tok_str_new(TokenString *s)
     s->last_line_num = -1;
 }
 
+/* During tcc_compile(), token strings are taken from an arena that is
+   reset at the end of the file. Each string is preceded by two ints:
+   its origin and its allocated length. The last string allocated can
+   grow in place and be freed, the others stay until the reset. */
+#define TOK_ARENA_CHUNK_SIZE (256 * 1024)
+#define TOK_STR_HEAP  0
+#define TOK_STR_ARENA 1
+
+typedef struct TokArenaChunk {
+    struct TokArenaChunk *next;
+    char *end;
+} TokArenaChunk;
+
+static ST_TLS TokArenaChunk *tok_arena_first, *tok_arena_cur;
+static ST_TLS char *tok_arena_ptr;
+static ST_TLS int *tok_arena_last; /* header of the last allocated string */
+static ST_TLS int tok_arena_enabled;
+
+/* return 'size' bytes at the end of the arena, 8 byte aligned */
+static int *tok_arena_alloc(int size)
+{
+    TokArenaChunk *c, **pc;
+    int chunk_size;
+
+    if (!tok_arena_cur || tok_arena_cur->end - tok_arena_ptr < size) {
+        /* next chunk, or a new one if it is too small */
+        pc = tok_arena_cur ? &tok_arena_cur->next : &tok_arena_first;
+        c = *pc;
+        if (!c || c->end - (char *)(c + 1) < size) {
+            chunk_size = size > TOK_ARENA_CHUNK_SIZE ? size : TOK_ARENA_CHUNK_SIZE;
+            c = tcc_malloc(sizeof(TokArenaChunk) + chunk_size);
+            c->end = (char *)(c + 1) + chunk_size;
+            c->next = *pc;
+            *pc = c;
+        }
+        tok_arena_cur = c;
+        tok_arena_ptr = (char *)(c + 1);
+    }
+    tok_arena_last = (int *)tok_arena_ptr;
+    tok_arena_ptr += (size + 7) & ~7;
+    return tok_arena_last;
+}
+
+ST_FUNC void tok_arena_enable(void)
+{
+    tok_arena_enabled = 1;
+}
+
+/* forget all token strings of the arena, but keep its memory */
+ST_FUNC void tok_arena_reset(void)
+{
+    tok_arena_enabled = 0;
+    tok_arena_cur = NULL;
+    tok_arena_last = NULL;
+}
+
+ST_FUNC void tok_arena_free(void)
+{
+    TokArenaChunk *c, *c1;
+
+    for(c = tok_arena_first; c; c = c1) {
+        c1 = c->next;
+        tcc_free(c);
+    }
+    tok_arena_first = NULL;
+    tok_arena_reset();
+}
+
 ST_FUNC void tok_str_free(int *str)
 {
-    tcc_free(str);
+    if (!str)
+        return;
+    str -= 2;
+    if (str[0] == TOK_STR_HEAP) {
+        tcc_free(str);
+    } else if (str == tok_arena_last) {
+        tok_arena_ptr = (char *)str;
+        tok_arena_last = NULL;
+    }
 }
 
 static int *tok_str_realloc(TokenString *s)
@@ -843,12 +1294,33 @@ static int *tok_str_realloc(TokenString *s)
     } else {
         len = s->allocated_len * 2;
     }
-    str = tcc_realloc(s->str, len * sizeof(int));
+    str = s->str ? s->str - 2 : NULL;
+    if (str && str[0] == TOK_STR_HEAP) {
+        str = tcc_realloc(str, (len + 2) * sizeof(int));
+    } else if (tok_arena_enabled) {
+        if (str && str == tok_arena_last &&
+            tok_arena_cur->end - (char *)str >= (len + 2) * sizeof(int)) {
+            /* last string: grow in place */
+            tok_arena_ptr = (char *)str + (((len + 2) * sizeof(int) + 7) & ~7);
+        } else {
+            str = tok_arena_alloc((len + 2) * sizeof(int));
+            /* tok_str_add2() may have written past s->len */
+            if (s->str)
+                memcpy(str + 2, s->str, s->allocated_len * sizeof(int));
+        }
+        str[0] = TOK_STR_ARENA;
+    } else {
+        str = tcc_realloc(NULL, (len + 2) * sizeof(int));
+        if (s->str)
+            memcpy(str + 2, s->str, s->allocated_len * sizeof(int));
+        str[0] = TOK_STR_HEAP;
+    }
     if (!str)
         tcc_error("memory full");
+    str[1] = len;
     s->allocated_len = len;
-    s->str = str;
-    return str;
+    s->str = str + 2;
+    return s->str;
 }
 
 ST_FUNC void tok_str_add(TokenString *s, int t)
@@ -863,7 +1335,7 @@ ST_FUNC void tok_str_add(TokenString *s, int t)
     s->len = len;
 }
 
-static void tok_str_add2(TokenString *s, int t, CValue *cv)
+ST_FUNC void tok_str_add2(TokenString *s, int t, CValue *cv)
 {
     int len, *str;
 
@@ -881,6 +1353,7 @@ static void tok_str_add2(TokenString *s, int t, CValue *cv)
     case TOK_LCHAR:
     case TOK_CFLOAT:
     case TOK_LINENUM:
+    case TOK_PACK:
         str[len++] = cv->tab[0];
         break;
     case TOK_PPNUM:
@@ -962,6 +1435,7 @@ static inline void TOK_GET(int *t, const int **pp, CValue *cv)
     case TOK_LCHAR:
     case TOK_CFLOAT:
     case TOK_LINENUM:
+    case TOK_PACK:
         tab[0] = *p++;
         break;
     case TOK_STR:
@@ -1024,13 +1498,16 @@ ST_INLN void define_push(int v, int macro_type, int *str, Sym *first_arg)
     s = sym_push2(&define_stack, v, macro_type, 0);
     s->d = str;
     s->next = first_arg;
+    s->r = ++define_serial;
     table_ident[v - TOK_IDENT]->sym_define = s;
+    define_stamp++;
 }
 
 /* undefined a define symbol. Its name is just set to zero */
 ST_FUNC void define_undef(Sym *s)
 {
     int v;
+    define_stamp++;
     v = s->v;
     if (v >= TOK_IDENT && v < tok_ident)
         table_ident[v - TOK_IDENT]->sym_define = NULL;
@@ -1051,11 +1528,15 @@ ST_FUNC void free_defines(Sym *b)
     Sym *top, *top1;
     int v;
 
+    define_stamp++;
     top = define_stack;
     while (top != b) {
         top1 = top->prev;
-        /* do not free args or predefined defines */
-        if (top->d)
+        tcc_free(top->memo);
+        top->memo = NULL;
+        /* do not free args, predefined defines or snapshot macros */
+        if (top->d && ((uint8_t *)top->d < snapshot_data ||
+                       (uint8_t *)top->d >= snapshot_data + snapshot_size))
             tok_str_free(top->d);
         v = top->v;
         if (v >= TOK_IDENT && v < tok_ident)
@@ -1121,18 +1602,25 @@ ST_FUNC void label_pop(Sym **ptop, Sym *slast)
 /* eval an expression for #if/#elif */
 static int expr_preprocess(void)
 {
-    int c, t;
+    int c, t, n, guard;
     TokenString str;
     
     tok_str_new(&str);
+    n = guard = 0;
     while (tok != TOK_LINEFEED && tok != TOK_EOF) {
         next(); /* do macro subst */
+        if (tok != TOK_LINEFEED)
+            n++;
+        if (n == 1 && tok != '!')
+            n = 3; /* not '!defined(macro)' */
         if (tok == TOK_DEFINED) {
             next_nomacro();
             t = tok;
             if (t == '(') 
                 next_nomacro();
             c = define_find(tok) != 0;
+            if (n == 2)
+                guard = tok;
             if (t == '(')
                 next_nomacro();
             tok = TOK_CINT;
@@ -1146,6 +1634,7 @@ static int expr_preprocess(void)
     }
     tok_str_add(&str, -1); /* simulate end of file */
     tok_str_add(&str, 0);
+    expr_guard_macro = n == 2 ? guard : 0;
     /* now evaluate C constant expression */
     macro_ptr = str.str;
     next();
@@ -1277,20 +1766,19 @@ static CachedInclude *search_cached_include(TCCState *s1,
     return NULL;
 }
 
-static inline void add_cached_include(TCCState *s1, int type, 
-                                      const char *filename, int ifndef_macro)
+static CachedInclude *add_cached_include(TCCState *s1, int type,
+                                         const char *filename, int ifndef_macro)
 {
     CachedInclude *e;
     int h;
 
-    if (search_cached_include(s1, type, filename))
-        return;
+    e = search_cached_include(s1, type, filename);
+    if (e)
+        return e;
 #ifdef INC_DEBUG
     printf("adding cached '%s' %s\n", filename, get_tok_str(ifndef_macro, NULL));
 #endif
-    e = tcc_malloc(sizeof(CachedInclude) + strlen(filename));
-    if (!e)
-        return;
+    e = tcc_mallocz(sizeof(CachedInclude) + strlen(filename));
     e->type = type;
     strcpy(e->filename, filename);
     e->ifndef_macro = ifndef_macro;
@@ -1299,14 +1787,270 @@ static inline void add_cached_include(TCCState *s1, int type,
     h = hash_cached_include(type, filename);
     e->hash_next = s1->cached_includes_hash[h];
     s1->cached_includes_hash[h] = s1->nb_cached_includes;
+    return e;
+}
+
+/* the same file may be included with different names: also find
+   cached includes by device and inode, when the file system has them */
+static inline int hash_cached_include_id(FileData *fd)
+{
+    return ((unsigned)fd->ino ^ (unsigned)fd->dev) & (CACHED_INCLUDES_HASH_SIZE - 1);
+}
+
+static CachedInclude *search_cached_include_id(TCCState *s1, FileData *fd)
+{
+    CachedInclude *e;
+    int i;
+
+    if (!fd->ino)
+        return NULL;
+    i = s1->cached_includes_id_hash[hash_cached_include_id(fd)];
+    while (i) {
+        e = s1->cached_includes[i - 1];
+        if (e->ino == fd->ino && e->dev == fd->dev)
+            return e;
+        i = e->id_hash_next;
+    }
+    return NULL;
+}
+
+static void set_cached_include_id(TCCState *s1, CachedInclude *e, FileData *fd)
+{
+    int h, i;
+
+    if (!fd || !fd->ino || e->ino)
+        return;
+    e->dev = fd->dev;
+    e->ino = fd->ino;
+    for(i = 0; s1->cached_includes[i] != e; i++);
+    h = hash_cached_include_id(fd);
+    e->id_hash_next = s1->cached_includes_id_hash[h];
+    s1->cached_includes_id_hash[h] = i + 1;
+}
+
+/* true if the file can be skipped: '#pragma once' or its guard macro
+   is defined */
+static inline int cached_include_skip(CachedInclude *e)
+{
+    return e->once || define_find(e->ifndef_macro);
+}
+
+/* ------------------------------------------------------------------------- */
+/* include lookup cache, shared by all states: the outcome of searching a
+   name through the include paths is remembered until one of the
+   directories searched changes or the cache is flushed */
+
+#define INCLUDE_LOOKUP_HASH_SIZE 512
+
+typedef struct IncludeDir {
+    time_t mtime;
+    int version;
+    int checked; /* include_gen of the last stat() */
+    char path[1];
+} IncludeDir;
+
+typedef struct IncludeLookup {
+    struct IncludeLookup *hash_next;
+    int found;   /* index of the matching candidate, or nb of candidates */
+    int nb_dirs;
+    int *dirs;   /* (directory, version) pairs searched before the match */
+    char key[1];
+} IncludeLookup;
+
+static ST_TLS IncludeDir **include_dirs;
+static ST_TLS int nb_include_dirs;
+static ST_TLS char **include_ctxs;
+static ST_TLS int nb_include_ctxs;
+static ST_TLS IncludeLookup *include_lookup_hash[INCLUDE_LOOKUP_HASH_SIZE];
+static ST_TLS int include_gen;     /* bumped for each preprocessed file */
+static ST_TLS int include_ctx;     /* index of the current include path list */
+
+static inline int hash_include_lookup(const char *key)
+{
+    const unsigned char *s;
+    unsigned int h;
+
+    h = TOK_HASH_INIT;
+    for(s = (const unsigned char *)key; *s; s++)
+        h = TOK_HASH_FUNC(h, *s);
+    return h & (INCLUDE_LOOKUP_HASH_SIZE - 1);
+}
+
+/* return the version of directory 'path', checking it at most once per
+   preprocessed file */
+static int include_dir_version(int i)
+{
+    IncludeDir *d = include_dirs[i];
+    struct stat st;
+
+    if (d->checked != include_gen) {
+        d->checked = include_gen;
+        if (stat(d->path[0] ? d->path : ".", &st) < 0)
+            st.st_mtime = 0;
+        if (st.st_mtime != d->mtime) {
+            d->mtime = st.st_mtime;
+            d->version++;
+        }
+    }
+    return d->version;
+}
+
+static int include_dir_find(const char *path, int len)
+{
+    IncludeDir *d;
+    int i;
+
+    for(i = 0; i < nb_include_dirs; i++) {
+        d = include_dirs[i];
+        if (!strncmp(d->path, path, len) && d->path[len] == '\0')
+            return i;
+    }
+    d = tcc_malloc(sizeof(IncludeDir) + len);
+    memcpy(d->path, path, len);
+    d->path[len] = '\0';
+    d->version = 0;
+    d->checked = include_gen - 1;
+    d->mtime = 0;
+    dynarray_add((void ***)&include_dirs, &nb_include_dirs, d);
+    include_dir_version(i);
+    return i;
+}
+
+static IncludeLookup *include_lookup_find(const char *key)
+{
+    IncludeLookup *l, **pl;
+    int i;
+
+    pl = &include_lookup_hash[hash_include_lookup(key)];
+    while ((l = *pl) != NULL) {
+        if (!strcmp(l->key, key)) {
+            for(i = 0; i < l->nb_dirs; i += 2) {
+                if (include_dir_version(l->dirs[i]) != l->dirs[i + 1]) {
+                    /* a directory changed: search again */
+                    *pl = l->hash_next;
+                    tcc_free(l->dirs);
+                    tcc_free(l);
+                    return NULL;
+                }
+            }
+            return l;
+        }
+        pl = &l->hash_next;
+    }
+    return NULL;
+}
+
+static void include_lookup_remove(IncludeLookup *r)
+{
+    IncludeLookup *l, **pl;
+
+    pl = &include_lookup_hash[hash_include_lookup(r->key)];
+    while ((l = *pl) != NULL) {
+        if (l == r) {
+            *pl = l->hash_next;
+            tcc_free(l->dirs);
+            tcc_free(l);
+            return;
+        }
+        pl = &l->hash_next;
+    }
+}
+
+/* remember that the search for 'key' ended at candidate 'found', the
+   candidates being the current directory 'curdir' (for "header.h")
+   then the include paths */
+static void include_lookup_add(TCCState *s1, const char *key, int c,
+                               const char *curdir, int found)
+{
+    IncludeLookup *l;
+    const char *path;
+    int i, h, d;
+
+    l = tcc_malloc(sizeof(IncludeLookup) + strlen(key));
+    strcpy(l->key, key);
+    l->found = found;
+    l->nb_dirs = 0;
+    l->dirs = NULL;
+    for(i = c == '\"' ? -1 : 0; i <= found; i++) {
+        if (i == -1) {
+            d = include_dir_find(curdir, tcc_basename(curdir) - curdir);
+        } else if (i < s1->nb_include_paths + s1->nb_sysinclude_paths) {
+            if (i < s1->nb_include_paths)
+                path = s1->include_paths[i];
+            else
+                path = s1->sysinclude_paths[i - s1->nb_include_paths];
+            d = include_dir_find(path, strlen(path));
+        } else {
+            break;
+        }
+        l->dirs = tcc_realloc(l->dirs, (l->nb_dirs + 2) * sizeof(int));
+        l->dirs[l->nb_dirs++] = d;
+        l->dirs[l->nb_dirs++] = include_dir_version(d);
+    }
+    h = hash_include_lookup(key);
+    l->hash_next = include_lookup_hash[h];
+    include_lookup_hash[h] = l;
+}
+
+/* start a new file: directories may have changed since the last one,
+   and the include paths of the state select the cache entries */
+static void include_lookup_init(TCCState *s1)
+{
+    CString cstr;
+    int i;
+
+    include_gen++;
+    cstr_new(&cstr);
+    for(i = 0; i < s1->nb_include_paths; i++) {
+        cstr_cat(&cstr, s1->include_paths[i]);
+        cstr_ccat(&cstr, '\n');
+    }
+    cstr_ccat(&cstr, '\n');
+    for(i = 0; i < s1->nb_sysinclude_paths; i++) {
+        cstr_cat(&cstr, s1->sysinclude_paths[i]);
+        cstr_ccat(&cstr, '\n');
+    }
+    cstr_ccat(&cstr, '\0');
+    for(i = 0; i < nb_include_ctxs; i++)
+        if (!strcmp(include_ctxs[i], cstr.data))
+            break;
+    if (i == nb_include_ctxs)
+        dynarray_add((void ***)&include_ctxs, &nb_include_ctxs,
+                     tcc_strdup(cstr.data));
+    include_ctx = i;
+    cstr_free(&cstr);
+}
+
+ST_FUNC void include_cache_flush(void)
+{
+    IncludeLookup *l, *l1;
+    int i;
+
+    for(i = 0; i < INCLUDE_LOOKUP_HASH_SIZE; i++) {
+        for(l = include_lookup_hash[i]; l; l = l1) {
+            l1 = l->hash_next;
+            tcc_free(l->dirs);
+            tcc_free(l);
+        }
+        include_lookup_hash[i] = NULL;
+    }
+    dynarray_reset(&include_dirs, &nb_include_dirs);
+    dynarray_reset(&include_ctxs, &nb_include_ctxs);
 }
 
 static void pragma_parse(TCCState *s1)
 {
+    CachedInclude *e;
     int val;
 
     next();
-    if (tok == TOK_pack) {
+    if (tok == TOK_once) {
+        /* never include this file again */
+        e = add_cached_include(s1, file->inc_type,
+                               file->inc_type ? file->inc_filename : file->filename, 0);
+        e->once = 1;
+        set_cached_include_id(s1, e, file->fdata);
+    } else if (tok == TOK_pack) {
         /*
           This may be:
           #pragma pack(1) // set
@@ -1352,8 +2096,11 @@ static void pragma_parse(TCCState *s1)
 ST_FUNC void preprocess(int is_bof)
 {
     TCCState *s1 = tcc_state;
-    int i, c, n, saved_parse_flags;
+    int i, c, n, saved_parse_flags, start, len;
     char buf[1024], *q;
+    char key[1024 + sizeof file->filename + 16];
+    const char *curdir;
+    IncludeLookup *lookup;
     Sym *s;
 
     saved_parse_flags = parse_flags;
@@ -1438,9 +2185,23 @@ ST_FUNC void preprocess(int is_bof)
             tcc_error("#include recursion too deep");
 
         n = s1->nb_include_paths + s1->nb_sysinclude_paths;
-        for (i = -2; i < n; ++i) {
+        /* start at the candidate found last time, if still valid */
+        lookup = NULL;
+        key[0] = '\0';
+        start = -2;
+        curdir = file->filename;
+        if (tok == TOK_INCLUDE && !IS_ABSPATH(buf)) {
+            len = c == '\"' ? tcc_basename(curdir) - curdir : 0;
+            snprintf(key, sizeof(key), "%d%c%.*s\n%s",
+                     include_ctx, c, len, curdir, buf);
+            lookup = include_lookup_find(key);
+            if (lookup)
+                start = lookup->found;
+        }
+    search:
+        for (i = start; i < n; ++i) {
             char buf1[sizeof file->filename];
-            CachedInclude *e;
+            CachedInclude *e, *e1;
             const char *path;
             int size, fd;
 
@@ -1471,7 +2232,7 @@ ST_FUNC void preprocess(int is_bof)
             pstrcat(buf1, sizeof(buf1), buf);
 
             e = search_cached_include(s1, c, buf1);
-            if (e && define_find(e->ifndef_macro)) {
+            if (e && cached_include_skip(e)) {
                 /* no need to parse the include because the 'ifndef macro'
                    is defined */
 #ifdef INC_DEBUG
@@ -1480,9 +2241,30 @@ ST_FUNC void preprocess(int is_bof)
                 fd = 0;
             } else {
                 fd = tcc_open(s1, buf1);
-                if (fd < 0)
+                if (fd < 0) {
+                    if (lookup) {
+                        /* stale: search everything again */
+                        include_lookup_remove(lookup);
+                        lookup = NULL;
+                        start = -2;
+                        goto search;
+                    }
                     continue;
+                }
+                /* maybe already seen through another name */
+                if (!e && file->fdata) {
+                    e = search_cached_include_id(s1, file->fdata);
+                    if (e && cached_include_skip(e)) {
+                        e1 = add_cached_include(s1, c, buf1, e->ifndef_macro);
+                        e1->once = e->once;
+                        set_cached_include_id(s1, e1, file->fdata);
+                        tcc_close();
+                        fd = 0;
+                    }
+                }
             }
+            if (key[0] && !lookup)
+                include_lookup_add(s1, key, c, curdir, i);
 
             if (tok == TOK_INCLUDE_NEXT) {
                 tok = TOK_INCLUDE;
@@ -1512,6 +2294,8 @@ ST_FUNC void preprocess(int is_bof)
             ch = file->buf_ptr[0];
             goto the_end;
         }
+        if (key[0] && !lookup)
+            include_lookup_add(s1, key, c, curdir, n);
         tcc_error("include file '%s' not found", buf);
 include_done:
         break;
@@ -1520,6 +2304,10 @@ include_done:
         goto do_ifdef;
     case TOK_IF:
         c = expr_preprocess();
+        if (is_bof && expr_guard_macro) {
+            /* '#if !defined(macro)' is the same as '#ifndef macro' */
+            file->ifndef_macro = expr_guard_macro;
+        }
         goto do_if;
     case TOK_IFDEF:
         c = 0;
@@ -2085,6 +2873,10 @@ static inline void next_nomacro1(void)
     case '\t':
         tok = c;
         p++;
+        /* one token is enough for a run of blanks, unless they are
+           output by -E */
+        if (!(parse_flags & PARSE_FLAG_SPACES))
+            p = scan_blanks(p);
         goto keep_tok_flags;
     case '\f':
     case '\v':
@@ -2111,6 +2903,7 @@ static inline void next_nomacro1(void)
     parse_eof:
         {
             TCCState *s1 = tcc_state;
+            CachedInclude *e;
             if ((parse_flags & PARSE_FLAG_LINEFEED)
                 && !(tok_flags & TOK_FLAG_EOF)) {
                 tok_flags |= TOK_FLAG_EOF;
@@ -2133,8 +2926,9 @@ static inline void next_nomacro1(void)
 #ifdef INC_DEBUG
                     printf("#endif %s\n", get_tok_str(file->ifndef_macro_saved, NULL));
 #endif
-                    add_cached_include(s1, file->inc_type, file->inc_filename,
-                                       file->ifndef_macro_saved);
+                    e = add_cached_include(s1, file->inc_type, file->inc_filename,
+                                           file->ifndef_macro_saved);
+                    set_cached_include_id(s1, e, file->fdata);
                 }
 
                 /* add end of include file debug info */
@@ -2201,34 +2995,30 @@ maybe_newline:
     case '_':
     parse_ident_fast:
         p1 = p;
-        h = TOK_HASH_INIT;
-        h = TOK_HASH_FUNC(h, c);
-        p++;
-        for(;;) {
-            c = *p;
-            if (!isidnum_table[c-CH_EOF])
-                break;
-            h = TOK_HASH_FUNC(h, c);
-            p++;
-        }
+        p = scan_idnum(p + 1);
+        c = *p;
         if (c != '\\') {
             TokenSym **pts;
+            uint8_t *q;
             int len;
 
-            /* fast case : no stray found, so we have the full token
-               and we have already hashed it */
+            /* fast case : no stray found, so we have the full token */
             len = p - p1;
-            h &= (TOK_HASH_SIZE - 1);
-            pts = &hash_ident[h];
-            for(;;) {
-                ts = *pts;
-                if (!ts)
-                    break;
+            h = TOK_HASH_INIT;
+            for(q = p1; q < p; q++)
+                h = TOK_HASH_FUNC(h, *q);
+            h = tok_hash_mix(h);
+            if (kw_hash_state > 0) {
+                ts = kw_find(p1, len, h);
+                if (ts)
+                    goto token_found;
+            }
+            pts = &hash_ident[h & (hash_ident_size - 1)];
+            for(ts = *pts; ts; ts = ts->hash_next) {
                 if (ts->len == len && !memcmp(ts->str, p1, len))
                     goto token_found;
-                pts = &(ts->hash_next);
             }
-            ts = tok_alloc_new(pts, p1, len);
+            ts = tok_alloc_new(pts, (char *)p1, len, h);
         token_found: ;
         } else {
             /* slower case */
@@ -2512,6 +3302,10 @@ static void next_nomacro_spc(void)
                 file->line_num = tokc.i;
                 goto redo;
             }
+            if (tok == TOK_PACK) {
+                *tcc_state->pack_stack_ptr = tokc.i;
+                goto redo;
+            }
         }
     } else {
         next_nomacro1();
@@ -2623,6 +3417,67 @@ static char const ab_month_name[12][4] =
     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
 };
 
+/* while expanding object-like macros, record the identifiers looked
+   up and the defines they referred to */
+static void memo_add_dep(int v, int serial)
+{
+    if (nb_memo_deps + 2 > memo_deps_size) {
+        memo_deps_size = memo_deps_size ? memo_deps_size * 2 : 64;
+        memo_deps = tcc_realloc(memo_deps, memo_deps_size * sizeof(int));
+    }
+    memo_deps[nb_memo_deps++] = v;
+    memo_deps[nb_memo_deps++] = serial;
+}
+
+/* return true if the memoized expansion of 's' can be used with
+   'nested_list' */
+static int memo_valid(Sym *s, Sym *nested_list)
+{
+    MacroMemo *m = s->memo;
+    Sym *d;
+    int i;
+
+    if (m->spaces != (parse_flags & PARSE_FLAG_SPACES))
+        return 0;
+    if (m->stamp != define_stamp) {
+        for(i = 0; i < m->nb_deps * 2; i += 2) {
+            d = define_find(m->data[i]);
+            if ((d ? d->r : 0) != m->data[i + 1]) {
+                tcc_free(m);
+                s->memo = NULL;
+                return 0;
+            }
+        }
+        m->stamp = define_stamp;
+    }
+    if (nested_list) {
+        for(i = 0; i < m->nb_deps * 2; i += 2)
+            if (m->data[i] != s->v && sym_find2(nested_list, m->data[i]))
+                return 0;
+    }
+    return 1;
+}
+
+static void memo_create(Sym *s, Sym *nested_list, int deps_start,
+                        const int *str, int len)
+{
+    MacroMemo *m;
+    int i, n;
+
+    n = nb_memo_deps - deps_start;
+    for(i = deps_start; i < nb_memo_deps; i += 2)
+        if (memo_deps[i] != s->v && sym_find2(nested_list, memo_deps[i]))
+            return;
+    m = tcc_malloc(sizeof(MacroMemo) + (n + len) * sizeof(int));
+    m->stamp = define_stamp;
+    m->spaces = parse_flags & PARSE_FLAG_SPACES;
+    m->nb_deps = n / 2;
+    m->len = len;
+    memcpy(m->data, memo_deps + deps_start, n * sizeof(int));
+    memcpy(m->data + n, str, len * sizeof(int));
+    s->memo = m;
+}
+
 /* do macro substitution of current token with macro 's' and add
    result to (tok_str,tok_len). 'nested_list' is the list of all
    macros we got inside to avoid recursing. Return non zero if no
@@ -2638,9 +3493,17 @@ static int macro_subst_tok(TokenString *tok_str,
     CValue cval;
     CString cstr;
     char buf[32];
+    int start, deps_start, uncacheable;
+    MacroMemo *m;
     
     /* if symbol is a macro, prepare substitution */
     /* special macros */
+    if (tok == TOK___LINE__ || tok == TOK___FILE__ ||
+        tok == TOK___DATE__ || tok == TOK___TIME__)
+        memo_uncacheable = 1;
+    /* the object would not be the same the next time */
+    if (tok == TOK___DATE__ || tok == TOK___TIME__)
+        tcc_state->uncacheable = 1;
     if (tok == TOK___LINE__) {
         snprintf(buf, sizeof(buf), "%d", file->line_num);
         cstrval = buf;
@@ -2652,9 +3515,16 @@ static int macro_subst_tok(TokenString *tok_str,
     } else if (tok == TOK___DATE__ || tok == TOK___TIME__) {
         time_t ti;
         struct tm *tm;
+#ifndef _WIN32
+        struct tm tm_buf;
+#endif
 
         time(&ti);
+#ifdef _WIN32
         tm = localtime(&ti);
+#else
+        tm = localtime_r(&ti, &tm_buf);
+#endif
         if (tok == TOK___DATE__) {
             snprintf(buf, sizeof(buf), "%s %2d %d", 
                      ab_month_name[tm->tm_mon], tm->tm_mday, tm->tm_year + 1900);
@@ -2683,6 +3553,8 @@ static int macro_subst_tok(TokenString *tok_str,
                 p = macro_ptr;
                 while (is_space(t = *p) || TOK_LINEFEED == t) 
                     ++p;
+                if (t == 0)
+                    memo_uncacheable = 1;
                 if (t == 0 && can_read_stream) {
                     /* end of macro stream: we must look at the token
                        after in the file */
@@ -2771,6 +3643,25 @@ static int macro_subst_tok(TokenString *tok_str,
                 sa = sa1;
             }
             mstr_allocated = 1;
+        } else if (s->memo && memo_valid(s, *nested_list)) {
+            /* same defines as last time: copy the expansion */
+            m = s->memo;
+            while (tok_str->len + m->len > tok_str->allocated_len)
+                tok_str_realloc(tok_str);
+            memcpy(tok_str->str + tok_str->len, m->data + m->nb_deps * 2,
+                   m->len * sizeof(int));
+            tok_str->len += m->len;
+            if (memo_recording)
+                for(t = 0; t < m->nb_deps * 2; t += 2)
+                    memo_add_dep(m->data[t], m->data[t + 1]);
+            return 0;
+        }
+        start = tok_str->len;
+        deps_start = nb_memo_deps;
+        uncacheable = memo_uncacheable;
+        if (s->type.t == MACRO_OBJ) {
+            memo_uncacheable = 0;
+            memo_recording++;
         }
         sym_push2(nested_list, s->v, 0, 0);
         macro_subst(tok_str, nested_list, mstr, can_read_stream);
@@ -2778,6 +3669,17 @@ static int macro_subst_tok(TokenString *tok_str,
         sa1 = *nested_list;
         *nested_list = sa1->prev;
         sym_free(sa1);
+        if (s->type.t == MACRO_OBJ) {
+            /* remember the expansion unless it depends on more than
+               the defines */
+            memo_recording--;
+            if (!memo_uncacheable)
+                memo_create(s, *nested_list, deps_start,
+                            tok_str->str + start, tok_str->len - start);
+            memo_uncacheable |= uncacheable;
+            if (!memo_recording)
+                nb_memo_deps = 0;
+        }
         if (mstr_allocated)
             tok_str_free(mstr);
     }
@@ -2897,6 +3799,8 @@ static void macro_subst(TokenString *tok_str, Sym **nested_list,
             goto no_subst;
         }
         s = define_find(t);
+        if (memo_recording && t >= TOK_IDENT)
+            memo_add_dep(t, s ? s->r : 0);
         if (s != NULL) {
             /* if nested substitution, do nothing */
             if (sym_find2(*nested_list, t)) {
@@ -3024,11 +3928,14 @@ ST_FUNC void preprocess_init(TCCState *s1)
     vtop = vstack - 1;
     s1->pack_stack[0] = 0;
     s1->pack_stack_ptr = s1->pack_stack;
+    include_lookup_init(s1);
+    memo_recording = nb_memo_deps = memo_uncacheable = 0;
 }
 
 ST_FUNC void preprocess_new()
 {
     int i, c;
+    unsigned int h;
     const char *p, *r;
 
     /* init isid table */
@@ -3037,7 +3944,9 @@ ST_FUNC void preprocess_new()
 
     /* add all tokens */
     table_ident = NULL;
-    memset(hash_ident, 0, TOK_HASH_SIZE * sizeof(TokenSym *));
+    tcc_free(hash_ident);
+    hash_ident_size = TOK_HASH_SIZE;
+    hash_ident = tcc_mallocz(hash_ident_size * sizeof(TokenSym *));
     
     tok_ident = TOK_IDENT;
     p = tcc_keywords;
@@ -3048,9 +3957,100 @@ ST_FUNC void preprocess_new()
             if (c == '\0')
                 break;
         }
-        tok_alloc(p, r - p - 1);
+        /* all distinct: no need to look them up */
+        h = tok_hash(p, r - p - 1);
+        tok_alloc_new(&hash_ident[h & (hash_ident_size - 1)], p, r - p - 1, h);
         p = r;
     }
+    if (!kw_hash_state)
+        kw_hash_build(tok_ident - TOK_IDENT);
+}
+
+/* -E output is collected in a large buffer and written in big blocks */
+#define PP_OUT_SIZE (128 * 1024)
+
+static ST_TLS char *pp_out;
+static ST_TLS int pp_out_len;
+
+static void pp_flush(TCCState *s1)
+{
+    if (pp_out_len) {
+        if (s1->pp_write_func)
+            s1->pp_write_func(s1->pp_opaque, pp_out, pp_out_len);
+        else
+            fwrite(pp_out, 1, pp_out_len, s1->outfile);
+        pp_out_len = 0;
+    }
+}
+
+static void pp_write(TCCState *s1, const char *p, int len)
+{
+    if (pp_out_len + len > PP_OUT_SIZE) {
+        pp_flush(s1);
+        if (len > PP_OUT_SIZE) {
+            /* too big for the buffer */
+            memcpy(pp_out, p, PP_OUT_SIZE);
+            pp_out_len = PP_OUT_SIZE;
+            pp_flush(s1);
+            pp_write(s1, p + PP_OUT_SIZE, len - PP_OUT_SIZE);
+            return;
+        }
+    }
+    memcpy(pp_out + pp_out_len, p, len);
+    pp_out_len += len;
+}
+
+static inline void pp_putc(TCCState *s1, int c)
+{
+    if (pp_out_len == PP_OUT_SIZE)
+        pp_flush(s1);
+    pp_out[pp_out_len++] = c;
+}
+
+/* write the spelling of token 't', like get_tok_str() */
+static void pp_put_tok(TCCState *s1, int t, CValue *cv)
+{
+    TokenSym *ts;
+    CString *cstr;
+    unsigned char *p, *p_end;
+    char buf[4];
+    int c;
+
+    if (t >= TOK_IDENT && t < tok_ident) {
+        ts = table_ident[t - TOK_IDENT];
+        pp_write(s1, ts->str, ts->len);
+    } else if (t >= 0 && t < 128 && t != TOK_SHL && t != TOK_SAR) {
+        pp_putc(s1, t);
+    } else if (t == TOK_PPNUM) {
+        /* only identifier characters, '.', '+' and '-' */
+        cstr = cv->cstr;
+        pp_write(s1, cstr->data, cstr->size - 1);
+    } else if (t == TOK_STR) {
+        cstr = cv->cstr;
+        p = cstr->data;
+        p_end = p + cstr->size - 1;
+        pp_putc(s1, '\"');
+        for(; p < p_end; p++) {
+            c = *p;
+            if (c >= 32 && c <= 126) {
+                if (c == '\'' || c == '\"' || c == '\\')
+                    pp_putc(s1, '\\');
+                pp_putc(s1, c);
+            } else if (c == '\n') {
+                pp_write(s1, "\\n", 2);
+            } else {
+                buf[0] = '\\';
+                buf[1] = '0' + ((c >> 6) & 7);
+                buf[2] = '0' + ((c >> 3) & 7);
+                buf[3] = '0' + (c & 7);
+                pp_write(s1, buf, 4);
+            }
+        }
+        pp_putc(s1, '\"');
+    } else {
+        p = (unsigned char *)get_tok_str(t, cv);
+        pp_write(s1, (char *)p, strlen((char *)p));
+    }
 }
 
 /* Preprocess the current file */
@@ -3059,8 +4059,9 @@ ST_FUNC int tcc_preprocess(TCCState *s1)
     Sym *define_start;
 
     BufferedFile *file_ref, **iptr, **iptr_new;
-    int token_seen, line_ref, d;
+    int token_seen, line_ref, d, len;
     const char *s;
+    char buf[sizeof file->filename + 32];
 
     preprocess_init(s1);
     define_start = define_stack;
@@ -3072,41 +4073,500 @@ ST_FUNC int tcc_preprocess(TCCState *s1)
     line_ref = 0;
     file_ref = NULL;
     iptr = s1->include_stack_ptr;
+    pp_out = tcc_malloc(PP_OUT_SIZE);
+    pp_out_len = 0;
 
-    for (;;) {
-        next();
-        if (tok == TOK_EOF) {
-            break;
-        } else if (file != file_ref) {
-            goto print_line;
-        } else if (tok == TOK_LINEFEED) {
-            if (!token_seen)
-                continue;
-            ++line_ref;
-            token_seen = 0;
-        } else if (!token_seen) {
-            d = file->line_num - line_ref;
-            if (file != file_ref || d < 0 || d >= 8) {
+    if (setjmp(s1->error_jmp_buf) == 0) {
+        s1->nb_errors = 0;
+        s1->error_set_jmp_enabled = 1;
+
+        for (;;) {
+            next();
+            if (tok == TOK_EOF) {
+                break;
+            } else if (file != file_ref) {
+                goto print_line;
+            } else if (tok == TOK_LINEFEED) {
+                if (!token_seen)
+                    continue;
+                ++line_ref;
+                token_seen = 0;
+            } else if (!token_seen) {
+                d = file->line_num - line_ref;
+                if (file != file_ref || d < 0 || d >= 8) {
 print_line:
-                iptr_new = s1->include_stack_ptr;
-                s = iptr_new > iptr ? " 1"
-                  : iptr_new < iptr ? " 2"
-                  : iptr_new > s1->include_stack ? " 3"
-                  : ""
-                  ;
-                iptr = iptr_new;
-                fprintf(s1->outfile, "# %d \"%s\"%s\n", file->line_num, file->filename, s);
+                    iptr_new = s1->include_stack_ptr;
+                    s = iptr_new > iptr ? " 1"
+                      : iptr_new < iptr ? " 2"
+                      : iptr_new > s1->include_stack ? " 3"
+                      : ""
+                      ;
+                    iptr = iptr_new;
+                    len = snprintf(buf, sizeof buf, "# %d \"%s\"%s\n",
+                                   file->line_num, file->filename, s);
+                    pp_write(s1, buf, len);
+                } else {
+                    while (d)
+                        pp_putc(s1, '\n'), --d;
+                }
+                line_ref = (file_ref = file)->line_num;
+                token_seen = tok != TOK_LINEFEED;
+                if (!token_seen)
+                    continue;
+            }
+            pp_put_tok(s1, tok, &tokc);
+        }
+    }
+    s1->error_set_jmp_enabled = 0;
+
+    pp_flush(s1);
+    tcc_free(pp_out);
+    pp_out = NULL;
+    free_defines(define_start);
+    return s1->nb_errors != 0 ? -1 : 0;
+}
+
+/* dependency scan: skip everything but the directives, stopping at a
+   '#' starting a line or at the end of the buffer */
+static void scan_skip_code(void)
+{
+    int c;
+    uint8_t *p;
+
+    p = file->buf_ptr;
+    for(;;) {
+        c = *p;
+        switch(c) {
+        case ' ':
+        case '\t':
+        case '\f':
+        case '\v':
+        case '\r':
+            p++;
+            break;
+        case '\n':
+            file->line_num++;
+            tok_flags |= TOK_FLAG_BOL;
+            p++;
+            break;
+        case '#':
+            if (tok_flags & TOK_FLAG_BOL)
+                goto the_end;
+            goto code;
+        case '\\':
+            if (p >= file->buf_end)
+                goto the_end; /* the lexer handles the end of file */
+            file->buf_ptr = p;
+            ch = *p;
+            handle_stray_noerror();
+            p = file->buf_ptr;
+            break;
+        case '\"':
+        case '\'':
+            p = parse_pp_string(p, c, NULL);
+            tok_flags = 0;
+            break;
+        case '/':
+            file->buf_ptr = p;
+            ch = *p;
+            minp();
+            p = file->buf_ptr;
+            if (ch == '*') {
+                p = parse_comment(p);
+            } else if (ch == '/') {
+                p = parse_line_comment(p);
             } else {
-                while (d)
-                    fputs("\n", s1->outfile), --d;
+                tok_flags = 0;
             }
-            line_ref = (file_ref = file)->line_num;
-            token_seen = tok != TOK_LINEFEED;
-            if (!token_seen)
-                continue;
+            break;
+        default:
+        code:
+            /* not a directive: go to the next interesting char */
+            tok_flags = 0;
+            p = scan_code(p + 1);
+            break;
         }
-        fputs(get_tok_str(tok, &tokc), s1->outfile);
     }
+ the_end:
+    file->buf_ptr = p;
+}
+
+/* Only run the directives of the current file, to collect the files
+   it includes in target_deps */
+ST_FUNC int tcc_preprocess_deps(TCCState *s1)
+{
+    Sym *define_start;
+
+    preprocess_init(s1);
+    define_start = define_stack;
+    tok_flags = TOK_FLAG_BOL | TOK_FLAG_BOF;
+    parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_LINEFEED;
+
+    if (setjmp(s1->error_jmp_buf) == 0) {
+        s1->nb_errors = 0;
+        s1->error_set_jmp_enabled = 1;
+        do {
+            scan_skip_code();
+            /* a directive, or the end of a file */
+            next_nomacro();
+        } while (tok != TOK_EOF);
+    }
+    s1->error_set_jmp_enabled = 0;
+
     free_defines(define_start);
+    return s1->nb_errors != 0 ? -1 : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* preprocessor snapshots: the identifiers, macros, include guards and
+   expanded tokens left by a prelude of headers are saved to a file
+   which later states map instead of preprocessing the headers again */
+
+#define SNAPSHOT_MAGIC "TCCPPS2"
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    int tok_ident;      /* first identifier token of the writer */
+    int cstring_size;   /* token strings embed CStrings */
+    int ldouble_size;
+    int nb_idents;
+    int nb_defines;
+    int nb_includes;
+    int str_len;        /* expanded prelude tokens, in ints */
+} SnapshotHeader;
+
+/* walk token string 'str' to its terminating zero, renumbering
+   identifiers with 'map' if not NULL. Return the position after the
+   terminator, or NULL if the string does not end before 'end' */
+static int *tok_str_renumber(int *str, int *end, const int *map, int nb_map)
+{
+    int t, n;
+
+    for(;;) {
+        if (end && str >= end)
+            return NULL;
+        t = *str++;
+        if (t == 0)
+            return str;
+        if (t >= TOK_IDENT) {
+            if (map) {
+                if (t - TOK_IDENT >= nb_map)
+                    return NULL;
+                str[-1] = map[t - TOK_IDENT];
+            }
+            continue;
+        }
+        switch(t) {
+        case TOK_STR:
+        case TOK_LSTR:
+        case TOK_PPNUM:
+            if (end && (end - str) * sizeof(int) < sizeof(CString))
+                return NULL;
+            n = ((CString *)str)->size;
+            if (n < 0)
+                return NULL;
+            n = (sizeof(CString) + n + 3) >> 2;
+            break;
+        default:
+            n = tok_ext_size(t);
+            break;
+        }
+        if (end && end - str < n)
+            return NULL;
+        str += n;
+    }
+}
+
+static void snapshot_put(FILE *f, const void *data, int size)
+{
+    static const char pad[4];
+    fwrite(data, 1, size, f);
+    fwrite(pad, 1, -size & 3, f);
+}
+
+static void snapshot_put_int(FILE *f, int v)
+{
+    fwrite(&v, 1, sizeof(int), f);
+}
+
+/* preprocess the current file as a prelude and save the resulting
+   state to 'filename' */
+ST_FUNC int tcc_pp_snapshot_save(TCCState *s1, const char *filename)
+{
+    SnapshotHeader hdr;
+    TokenString str;
+    Sym *define_start, *s, *a, **defs;
+    CachedInclude *e;
+    TokenSym *ts;
+    CValue cval;
+    FILE *f;
+    int i, n, nb_defs;
+
+    if (snapshot_data) {
+        tcc_error_noabort("cannot save a snapshot on top of another one");
+        return -1;
+    }
+    preprocess_init(s1);
+    define_start = define_stack;
+    ch = file->buf_ptr[0];
+    tok_flags = TOK_FLAG_BOL | TOK_FLAG_BOF;
+    parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM;
+    tok_str_new(&str);
+    for(;;) {
+        next();
+        if (tok == TOK_EOF)
+            break;
+        tok_str_add_tok(&str);
+    }
+    /* the compiled file starts at its first line after the replay */
+    cval.i = 1;
+    tok_str_add2(&str, TOK_LINENUM, &cval);
+    tok_str_add(&str, 0);
+
+    /* macros defined by the prelude and still active, oldest first */
+    defs = NULL;
+    nb_defs = 0;
+    for(s = define_stack; s != define_start; s = s->prev) {
+        if (s->v >= TOK_IDENT && s->v < tok_ident &&
+            table_ident[s->v - TOK_IDENT]->sym_define == s && s->d)
+            dynarray_add((void ***)&defs, &nb_defs, s);
+    }
+    /* XXX: '#undef' of a macro defined before the prelude is lost */
+
+    f = fopen(filename, "wb");
+    if (!f) {
+        tcc_error_noabort("could not write '%s'", filename);
+        tcc_free(defs);
+        tok_str_free(str.str);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof hdr.magic);
+    hdr.tok_ident = TOK_IDENT;
+    hdr.cstring_size = sizeof(CString);
+    hdr.ldouble_size = LDOUBLE_SIZE;
+    hdr.nb_idents = tok_ident - TOK_IDENT;
+    hdr.nb_defines = nb_defs;
+    hdr.nb_includes = s1->nb_cached_includes;
+    hdr.str_len = str.len;
+    fwrite(&hdr, 1, sizeof hdr, f);
+
+    for(i = 0; i < hdr.nb_idents; i++) {
+        ts = table_ident[i];
+        snapshot_put_int(f, ts->len);
+        snapshot_put(f, ts->str, ts->len);
+    }
+    for(i = nb_defs - 1; i >= 0; i--) {
+        s = defs[i];
+        snapshot_put_int(f, s->v);
+        snapshot_put_int(f, s->type.t);
+        n = 0;
+        for(a = s->next; a; a = a->next)
+            n++;
+        snapshot_put_int(f, n);
+        for(a = s->next; a; a = a->next) {
+            snapshot_put_int(f, a->v & ~SYM_FIELD);
+            snapshot_put_int(f, a->type.t);
+        }
+        n = tok_str_renumber(s->d, NULL, NULL, 0) - s->d;
+        snapshot_put_int(f, n);
+        snapshot_put(f, s->d, n * sizeof(int));
+    }
+    for(i = 0; i < s1->nb_cached_includes; i++) {
+        e = s1->cached_includes[i];
+        snapshot_put_int(f, e->type);
+        snapshot_put_int(f, e->ifndef_macro);
+        snapshot_put_int(f, e->once);
+        n = strlen(e->filename) + 1;
+        snapshot_put_int(f, n);
+        snapshot_put(f, e->filename, n);
+    }
+    snapshot_put(f, str.str, str.len * sizeof(int));
+
+    n = ferror(f);
+    fclose(f);
+    tcc_free(defs);
+    tok_str_free(str.str);
+    if (n) {
+        tcc_error_noabort("could not write '%s'", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* load a snapshot saved by tcc_pp_snapshot_save(). Its macros stay
+   defined like -D symbols and its tokens are replayed before each
+   compiled file */
+ST_FUNC int tcc_pp_snapshot_load(TCCState *s1, const char *filename)
+{
+    SnapshotHeader *hdr;
+    struct stat st;
+    uint8_t *data;
+    int *p, *end, *defs, *map, *q;
+    Sym *s, *first, **ps;
+    CachedInclude *e;
+    int fd, i, j, n, t, v, nb_args;
+
+    if (snapshot_data) {
+        tcc_error_noabort("a snapshot is already loaded");
+        return -1;
+    }
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        tcc_error_noabort("could not open '%s'", filename);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        goto bad;
+    }
+#if defined _WIN32 || defined __native_client__
+    data = tcc_malloc(st.st_size);
+    n = read(fd, data, st.st_size);
+    close(fd);
+    if (n != st.st_size) {
+        tcc_free(data);
+        goto bad;
+    }
+#else
+    /* private mapping: TOK_GET() writes string pointers into the
+       token strings */
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        goto bad;
+#endif
+    snapshot_data = data;
+    snapshot_size = st.st_size;
+
+    hdr = (SnapshotHeader *)data;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof hdr->magic) ||
+        hdr->tok_ident != TOK_IDENT ||
+        hdr->cstring_size != sizeof(CString) ||
+        hdr->ldouble_size != LDOUBLE_SIZE ||
+        hdr->nb_idents < 0 || hdr->nb_defines < 0 || hdr->nb_includes < 0)
+        goto bad_free;
+    p = (int *)(hdr + 1);
+    end = (int *)(data + (st.st_size & ~3));
+
+    /* identifiers: the writer's token numbers are mapped to ours */
+    map = tcc_malloc(hdr->nb_idents * sizeof(int));
+    for(i = 0; i < hdr->nb_idents; i++) {
+        if (p >= end || *p < 0 || (end - p - 1) * sizeof(int) < *p)
+            goto bad_map;
+        n = *p++;
+        map[i] = tok_alloc((char *)p, n)->tok;
+        p += (n + 3) >> 2;
+    }
+
+    /* macros: renumber and check everything before defining */
+    defs = p;
+    for(i = 0; i < hdr->nb_defines; i++) {
+        if (end - p < 3)
+            goto bad_map;
+        v = p[0] - TOK_IDENT;
+        nb_args = p[2];
+        if ((unsigned)v >= hdr->nb_idents || nb_args < 0 ||
+            end - p - 4 < nb_args * 2)
+            goto bad_map;
+        p[0] = map[v];
+        p += 3;
+        for(j = 0; j < nb_args; j++, p += 2) {
+            v = p[0] - TOK_IDENT;
+            if ((unsigned)v >= hdr->nb_idents)
+                goto bad_map;
+            p[0] = map[v];
+        }
+        n = *p++;
+        if (n <= 0 || end - p < n)
+            goto bad_map;
+        q = tok_str_renumber(p, p + n, map, hdr->nb_idents);
+        if (q != p + n)
+            goto bad_map;
+        p = q;
+    }
+
+    /* include guards */
+    for(i = 0; i < hdr->nb_includes; i++) {
+        if (end - p < 4)
+            goto bad_map;
+        v = p[1] - TOK_IDENT;
+        if (p[1] && (unsigned)v >= hdr->nb_idents)
+            goto bad_map;
+        if (p[1])
+            p[1] = map[v];
+        n = p[3];
+        if (n <= 0 || (end - p - 4) * sizeof(int) < n ||
+            ((char *)(p + 4))[n - 1] != '\0')
+            goto bad_map;
+        p += 4 + ((n + 3) >> 2);
+    }
+
+    /* expanded prelude tokens */
+    if (hdr->str_len <= 0 || end - p < hdr->str_len ||
+        tok_str_renumber(p, p + hdr->str_len, map, hdr->nb_idents)
+        != p + hdr->str_len)
+        goto bad_map;
+    snapshot_str = p;
+    tcc_free(map);
+
+    /* now define the macros, as parse_define() would */
+    p = defs;
+    for(i = 0; i < hdr->nb_defines; i++) {
+        v = p[0];
+        t = p[1];
+        nb_args = p[2];
+        first = NULL;
+        ps = &first;
+        p += 3;
+        for(j = 0; j < nb_args; j++, p += 2) {
+            s = sym_push2(&define_stack, p[0] | SYM_FIELD, p[1], 0);
+            *ps = s;
+            ps = &s->next;
+        }
+        n = *p++;
+        define_push(v, t, p, first);
+        p += n;
+    }
+    for(i = 0; i < hdr->nb_includes; i++) {
+        e = add_cached_include(s1, p[0], (char *)(p + 4), p[1]);
+        e->once = p[2];
+        p += 4 + ((p[3] + 3) >> 2);
+    }
     return 0;
+ bad_map:
+    tcc_free(map);
+ bad_free:
+    tcc_pp_snapshot_free();
+ bad:
+    tcc_error_noabort("invalid snapshot '%s'", filename);
+    return -1;
+}
+
+/* feed the expanded prelude tokens of the loaded snapshot, if any,
+   before the tokens of the current file */
+ST_FUNC void tcc_pp_snapshot_replay(void)
+{
+    macro_ptr = snapshot_str;
+}
+
+ST_FUNC void tcc_pp_snapshot_free(void)
+{
+    if (!snapshot_data)
+        return;
+#if defined _WIN32 || defined __native_client__
+    tcc_free(snapshot_data);
+#else
+    munmap(snapshot_data, snapshot_size);
+#endif
+    snapshot_data = NULL;
+    snapshot_size = 0;
+    snapshot_str = NULL;
+}
+
+/* the loaded snapshot, which the compile cache hashes */
+ST_FUNC const void *tcc_pp_snapshot_data(unsigned long *psize)
+{
+    *psize = snapshot_size;
+    return snapshot_data;
 }
@@ -42,6 +42,166 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr);
 static void win64_add_function_table(TCCState *s1);
 #endif
 
+#ifdef __native_client__
+/* ------------------------------------------------------------- */
+/* The code of the programs compiled in memory goes to the dynamic
+   code segment which follows the text of tcc. Each TCCState gets an
+   extent of it, so that any number of them can be live at the same
+   time. Their data sections are packed in one mapping of their own. */
+
+extern char _etext[];
+#define DYNAMIC_CODE_PAGE_SIZE     (0x10000)
+#define DYNAMIC_CODE_ALIGN(addr)   \
+    ((((uplong) (addr)) + DYNAMIC_CODE_PAGE_SIZE - 1) & \
+     ~(DYNAMIC_CODE_PAGE_SIZE - 1))
+#define DYNAMIC_CODE_SEGMENT_START (DYNAMIC_CODE_ALIGN(_etext))
+#ifndef DYNAMIC_CODE_SEGMENT_END
+/* the code must lie in the first 256 MB of the sandbox */
+#define DYNAMIC_CODE_SEGMENT_END   (0x10000000)
+#endif
+/* allocation granularity of mmap() */
+#define RUNTIME_DATA_ALIGN         (0x10000)
+
+/* free extents of a region: start, end pairs sorted by address. All
+   of them are aligned to 'align' */
+typedef struct MemRegion {
+    uplong *ext;
+    int nb_ext;
+    unsigned long align;
+} MemRegion;
+
+static MemRegion code_region = { NULL, 0, 32 };
+static int regions_init;
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* insert the free extent [start, end) before the i-th one */
+static void region_insert(MemRegion *r, int i, uplong start, uplong end)
+{
+    int n = r->nb_ext;
+    if ((n & (n - 1)) == 0)
+        r->ext = tcc_realloc(r->ext, (n ? n * 2 : 1) * 2 * sizeof(uplong));
+    memmove(r->ext + 2 * i + 2, r->ext + 2 * i,
+            (n - i) * 2 * sizeof(uplong));
+    r->ext[2 * i] = start;
+    r->ext[2 * i + 1] = end;
+    r->nb_ext = n + 1;
+}
+
+static void region_remove(MemRegion *r, int i)
+{
+    r->nb_ext--;
+    memmove(r->ext + 2 * i, r->ext + 2 * i + 2,
+            (r->nb_ext - i) * 2 * sizeof(uplong));
+}
+
+static void region_init(MemRegion *r, uplong start, uplong end)
+{
+    start = (start + r->align - 1) & ~(r->align - 1);
+    end &= ~(r->align - 1);
+    if (start < end)
+        region_insert(r, 0, start, end);
+}
+
+/* return the first free extent of 'size' bytes of 'r', or NULL */
+static void *region_alloc(MemRegion *r, unsigned long size)
+{
+    uplong start = 0;
+    int i;
+
+    size = (size + r->align - 1) & ~(r->align - 1);
+    if (size == 0)
+        return NULL;
+    pthread_mutex_lock(&regions_lock);
+    if (!regions_init) {
+        region_init(&code_region, DYNAMIC_CODE_SEGMENT_START,
+                    DYNAMIC_CODE_SEGMENT_END);
+        regions_init = 1;
+    }
+    for(i = 0; i < r->nb_ext; i++) {
+        if (r->ext[2 * i + 1] - r->ext[2 * i] >= size) {
+            start = r->ext[2 * i];
+            r->ext[2 * i] += size;
+            if (r->ext[2 * i] == r->ext[2 * i + 1])
+                region_remove(r, i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&regions_lock);
+    return (void *)start;
+}
+
+/* give back an extent returned by region_alloc(), merging it with its
+   free neighbours */
+static void region_free(MemRegion *r, void *ptr, unsigned long size)
+{
+    uplong start = (uplong)ptr, end;
+    int i;
+
+    size = (size + r->align - 1) & ~(r->align - 1);
+    if (!ptr || size == 0)
+        return;
+    end = start + size;
+    pthread_mutex_lock(&regions_lock);
+    for(i = 0; i < r->nb_ext && r->ext[2 * i] < start; i++)
+        ;
+    if (i < r->nb_ext && r->ext[2 * i] == end)
+        r->ext[2 * i] = start;
+    else
+        region_insert(r, i, start, end);
+    if (i > 0 && r->ext[2 * i - 1] == start) {
+        r->ext[2 * i - 1] = r->ext[2 * i + 1];
+        region_remove(r, i);
+    }
+    pthread_mutex_unlock(&regions_lock);
+}
+
+#ifdef TCC_TARGET_X86_64
+/* number of GOT entries relocate_section() adds */
+static int count_got_entries(TCCState *s1)
+{
+    Section *s;
+    ElfW_Rel *rel, *rel_end;
+    int i, n;
+
+    n = 0;
+    for(i = 1; i < s1->nb_sections; i++) {
+        s = s1->sections[i];
+        if (s->sh_type != SHT_RELX)
+            continue;
+        rel_end = (ElfW_Rel *)(s->data + s->data_offset);
+        for(rel = (ElfW_Rel *)s->data; rel < rel_end; rel++) {
+            if (ELFW(R_TYPE)(rel->r_info) == R_X86_64_GOTPCREL)
+                n++;
+        }
+    }
+    return n;
+}
+#endif
+
+/* unload the program compiled in memory by 's1' and give back its
+   extents */
+ST_FUNC void tcc_free_runtime(TCCState *s1)
+{
+    Section *s;
+    int i;
+
+    if (!s1->runtime_mem)
+        return;
+    for(i = 1; i < s1->nb_sections; i++) {
+        s = s1->sections[i];
+        if ((s->sh_flags & SHF_ALLOC) && (s->sh_flags & SHF_EXECINSTR))
+            nacl_dyncode_delete((void *)s->sh_addr,
+                                (s->data_offset + 31) & ~31);
+    }
+    if (s1->runtime_data)
+        munmap(s1->runtime_data, (s1->runtime_data_size +
+                                  RUNTIME_DATA_ALIGN - 1) &
+               ~(RUNTIME_DATA_ALIGN - 1));
+    region_free(&code_region, s1->runtime_mem, s1->runtime_size);
+    s1->runtime_mem = s1->runtime_data = NULL;
+}
+#endif
+
 /* ------------------------------------------------------------- */
 /* Do all relocations (needed before using tcc_get_symbol())
    Returns -1 on error. */
@@ -49,11 +209,17 @@ static void win64_add_function_table(TCCState *s1);
 LIBTCCAPI int tcc_relocate(TCCState *s1)
 {
     int ret;
+#ifdef HAVE_SELINUX
+    char tmpfname[] = "/tmp/.tccrunXXXXXX";
+    int fd;
+#endif
+
+    if (tcc_check_state(s1))
+        return -1;
 #ifdef HAVE_SELINUX
     /* Use mmap instead of malloc for Selinux
     Ref http://www.gnu.org/s/libc/manual/html_node/File-Size.html */
-    char tmpfname[] = "/tmp/.tccrunXXXXXX";
-    int fd = mkstemp (tmpfname);
+    fd = mkstemp (tmpfname);
     if ((ret= tcc_relocate_ex(s1,NULL)) < 0)return -1;
     s1->mem_size=ret;
     unlink (tmpfname); ftruncate (fd, s1->mem_size);
@@ -74,13 +240,27 @@ LIBTCCAPI int tcc_relocate(TCCState *s1)
     ret = tcc_relocate_ex(s1, NULL);
     if (-1 != ret) {
 #ifdef __native_client__
-        extern char _etext[];
-#define DYNAMIC_CODE_PAGE_SIZE     (0x10000)
-#define DYNAMIC_CODE_ALIGN(addr)   \
-    ((((uintptr_t) (addr)) + DYNAMIC_CODE_PAGE_SIZE - 1) & \
-     ~(DYNAMIC_CODE_PAGE_SIZE - 1))
-#define DYNAMIC_CODE_SEGMENT_START (DYNAMIC_CODE_ALIGN(_etext))
-        s1->runtime_mem = (void*)DYNAMIC_CODE_SEGMENT_START;
+        s1->runtime_size = ret;
+        s1->runtime_mem = region_alloc(&code_region, ret);
+        if (!s1->runtime_mem) {
+            tcc_error_noabort("no room left for %lu bytes of code",
+                              s1->runtime_size);
+            return -1;
+        }
+        if (s1->runtime_data_size) {
+            /* all the data sections in one mapping */
+            s1->runtime_data = mmap(NULL, (s1->runtime_data_size +
+                                           RUNTIME_DATA_ALIGN - 1) &
+                                    ~(RUNTIME_DATA_ALIGN - 1),
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (s1->runtime_data == MAP_FAILED) {
+                s1->runtime_data = NULL;
+                tcc_error_noabort("cannot map %lu bytes of data (%s)",
+                                  s1->runtime_data_size, strerror(errno));
+                return -1;
+            }
+        }
         ret = tcc_relocate_ex(s1, s1->runtime_mem);
 #else
         s1->runtime_mem = tcc_malloc(ret);
@@ -134,8 +314,7 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr)
     Section *s;
     unsigned long offset, length;
 #ifdef __native_client__
-    static char data[0x10000000];
-    uplong data_mem = ((uplong)data + 0xffff) & ~0xffff;
+    uplong data_mem = (uplong)s1->runtime_data;
     unsigned long data_offset = 0;
 #endif
     uplong mem;
@@ -169,8 +348,9 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr)
             s->sh_addr = mem ? (mem + offset + 31) & ~31 : 0;
             offset = (offset + length + 31) & ~31;
         } else {
-            s->sh_addr = mem ? (data_mem + data_offset + 0xffff) & ~0xffff : 0;
-            data_offset = (data_offset + length + 0xffff) & ~0xffff;
+            data_offset = (data_offset + 15) & ~15;
+            s->sh_addr = mem ? data_mem + data_offset : 0;
+            data_offset += length;
         }
 #else
         s->sh_addr = mem ? (mem + offset + 15) & ~15 : 0;
@@ -184,7 +364,17 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr)
     if (s1->nb_errors)
         return -1;
 
-#if (defined TCC_TARGET_X86_64 || defined TCC_TARGET_ARM) && !defined TCC_TARGET_PE
+#ifdef __native_client__
+#ifdef TCC_TARGET_X86_64
+    /* the GOT entries follow the data. No jump table is needed as the
+       whole sandbox is in reach of a rel32 */
+    data_offset = (data_offset + 15) & ~15;
+    s1->runtime_plt_and_got_offset = 0;
+    s1->runtime_plt_and_got = (char *)(data_mem + data_offset);
+    data_offset += count_got_entries(s1) * sizeof(uplong);
+#endif
+    s1->runtime_data_size = data_offset;
+#elif (defined TCC_TARGET_X86_64 || defined TCC_TARGET_ARM) && !defined TCC_TARGET_PE
     s1->runtime_plt_and_got_offset = 0;
     s1->runtime_plt_and_got = (char *)(mem + offset);
     /* double the size of the buffer for got and plt entries
@@ -224,19 +414,9 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr)
                           strerror(errno), ptr, length);
                 return -1;
             }
-        } else if (length) {
-            if (mmap(ptr, (length + 0xffff) & ~0xffff,
-                     PROT_READ | PROT_WRITE,
-                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
-                     -1, 0) != ptr) {
-                tcc_error("Failed to mmap from %p length=%lu (%s)",
-                          ptr, length, strerror(errno));
-                return -1;
-            }
-            if (NULL == s->data || s->sh_type == SHT_NOBITS)
-                memset(ptr, 0, length);
-            else
-                memcpy(ptr, s->data, length);
+        } else if (NULL != s->data && s->sh_type != SHT_NOBITS) {
+            /* the mapping is zero filled */
+            memcpy(ptr, s->data, length);
         }
 #else
         if (NULL == s->data || s->sh_type == SHT_NOBITS)
@@ -98,6 +98,8 @@
      DEF(TOK_ALIGNED2, "__aligned__")
      DEF(TOK_PACKED1, "packed")
      DEF(TOK_PACKED2, "__packed__")
+     DEF(TOK_VECTOR_SIZE1, "vector_size")
+     DEF(TOK_VECTOR_SIZE2, "__vector_size__")
      DEF(TOK_WEAK1, "weak")
      DEF(TOK_WEAK2, "__weak__")
      DEF(TOK_ALIAS1, "alias")
@@ -124,6 +126,8 @@
      DEF(TOK_builtin_types_compatible_p, "__builtin_types_compatible_p")
      DEF(TOK_builtin_constant_p, "__builtin_constant_p")
      DEF(TOK_builtin_frame_address, "__builtin_frame_address")
+     DEF(TOK_builtin_memcpy, "__builtin_memcpy")
+     DEF(TOK_builtin_memset, "__builtin_memset")
 #ifdef TCC_TARGET_X86_64
      DEF(TOK_builtin_va_arg_types, "__builtin_va_arg_types")
 #endif
@@ -132,6 +136,7 @@
 
 /* pragma */
      DEF(TOK_pack, "pack")
+     DEF(TOK_once, "once")
 #if !defined(TCC_TARGET_I386) && !defined(TCC_TARGET_X86_64)
      /* already defined for assembler */
      DEF(TOK_ASM_push, "push")
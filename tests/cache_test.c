@@ -0,0 +1,135 @@
+/*
+ * Test of the compile cache of libtcc
+ *
+ * The header read by the test programs is rewritten with the same size
+ * and mtime: a compilation loaded from the cache still sees the old
+ * value, a real one sees the new value.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <utime.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(name, mode) _mkdir(name)
+#else
+#include <unistd.h>
+#endif
+
+#include "libtcc.h"
+
+#define DIR "cache_test.dir"
+
+static const char *lib_path;
+static int nb_warnings;
+static int nb_failed;
+
+static void error_func(void *opaque, const char *msg)
+{
+    if (strstr(msg, "warning:"))
+        nb_warnings++;
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+static void write_file(const char *name, const char *text, time_t mtime)
+{
+    struct utimbuf t;
+    FILE *f;
+
+    f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+        exit(1);
+    }
+    fputs(text, f);
+    fclose(f);
+    t.actime = t.modtime = mtime;
+    utime(name, &t);
+}
+
+/* compile 'filename' and return what its f() returns */
+static int run(const char *filename)
+{
+    TCCState *s;
+    int (*func)(void);
+    int ret;
+
+    nb_warnings = 0;
+    s = tcc_new();
+    if (lib_path)
+        tcc_set_lib_path(s, lib_path);
+    tcc_set_error_func(s, NULL, error_func);
+    tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+    ret = -1;
+    if (tcc_add_file(s, filename) != -1 && tcc_relocate(s) >= 0) {
+        func = tcc_get_symbol(s, "f");
+        if (func)
+            ret = func();
+    }
+    tcc_delete(s);
+    return ret;
+}
+
+static void check(const char *what, int value, int expected)
+{
+    printf("%s: %d\n", what, value);
+    if (value != expected) {
+        printf("  FAILED, expected %d\n", expected);
+        nb_failed++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct utimbuf t;
+    time_t old;
+    int ret;
+
+    if (argc == 2 && !memcmp(argv[1], "lib_path=", 9))
+        lib_path = argv[1] + 9;
+
+    /* the files and their directory must not look recently modified,
+       or the cache could not tell a later change */
+    old = time(NULL) - 100;
+    mkdir(DIR, 0777);
+    write_file(DIR "/h.h", "#define VAL 1\n", old);
+    write_file(DIR "/a.c", "#include \"h.h\"\n"
+               "int f(void) { char *p = 1; return VAL; }\n", old);
+    write_file(DIR "/b.c", "#include \"h.h\"\n"
+               "const char *t = __TIME__;\n"
+               "int f(void) { return VAL; }\n", old);
+    t.actime = t.modtime = old;
+    utime(DIR, &t);
+
+    tcc_set_compile_cache(16, NULL);
+
+    ret = run(DIR "/a.c");
+    check("compiled", ret, 1);
+    check("  warnings", nb_warnings, 1);
+
+    write_file(DIR "/h.h", "#define VAL 2\n", old);
+    ret = run(DIR "/a.c");
+    check("from the cache", ret, 1);
+    check("  warnings replayed", nb_warnings, 1);
+
+    write_file(DIR "/h.h", "#define VAL 2\n", old + 1);
+    ret = run(DIR "/a.c");
+    check("header modified", ret, 2);
+
+    ret = run(DIR "/b.c");
+    check("with __TIME__", ret, 2);
+    write_file(DIR "/h.h", "#define VAL 3\n", old + 1);
+    ret = run(DIR "/b.c");
+    check("with __TIME__ again, not cached", ret, 3);
+
+    tcc_set_compile_cache(0, NULL);
+    remove(DIR "/h.h");
+    remove(DIR "/a.c");
+    remove(DIR "/b.c");
+    rmdir(DIR);
+
+    return nb_failed != 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Test of the include lookups remembered by libtcc across compilations
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <utime.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(name, mode) _mkdir(name)
+#else
+#include <unistd.h>
+#endif
+
+#include "libtcc.h"
+
+#define DIR "include_test.dir"
+
+static const char *lib_path;
+static int nb_failed;
+
+static void error_func(void *opaque, const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+}
+
+static void set_time(const char *name, time_t mtime)
+{
+    struct utimbuf t;
+
+    t.actime = t.modtime = mtime;
+    utime(name, &t);
+}
+
+static void write_file(const char *name, const char *text)
+{
+    FILE *f;
+
+    f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+        exit(1);
+    }
+    fputs(text, f);
+    fclose(f);
+}
+
+/* compile 'filename' with the include paths 'inc1' then 'inc2' and
+   return what its f() returns */
+static int run(const char *filename)
+{
+    TCCState *s;
+    int (*func)(void);
+    int ret;
+
+    s = tcc_new();
+    if (lib_path)
+        tcc_set_lib_path(s, lib_path);
+    tcc_set_error_func(s, NULL, error_func);
+    tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+    tcc_add_include_path(s, DIR "/inc1");
+    tcc_add_include_path(s, DIR "/inc2");
+    ret = -1;
+    if (tcc_add_file(s, filename) != -1 && tcc_relocate(s) >= 0) {
+        func = tcc_get_symbol(s, "f");
+        if (func)
+            ret = func();
+    }
+    tcc_delete(s);
+    return ret;
+}
+
+static void check(const char *what, int value, int expected)
+{
+    printf("%s: %d\n", what, value);
+    if (value != expected) {
+        printf("  FAILED, expected %d\n", expected);
+        nb_failed++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char name[64], text[128];
+    time_t old;
+    int i;
+
+    if (argc == 2 && !memcmp(argv[1], "lib_path=", 9))
+        lib_path = argv[1] + 9;
+
+    /* directories modified long ago, so that adding a file shows */
+    old = time(NULL) - 100;
+    mkdir(DIR, 0777);
+    mkdir(DIR "/inc1", 0777);
+    mkdir(DIR "/inc2", 0777);
+    write_file(DIR "/inc2/h.h", "#define VAL 2\n");
+    write_file(DIR "/a.c", "#include <h.h>\nint f(void) { return VAL; }\n");
+    set_time(DIR "/inc1", old);
+    set_time(DIR "/inc2", old);
+    set_time(DIR, old);
+
+    check("found in inc2", run(DIR "/a.c"), 2);
+    check("again", run(DIR "/a.c"), 2);
+    write_file(DIR "/inc1/h.h", "#define VAL 1\n");
+    check("added to inc1", run(DIR "/a.c"), 1);
+    remove(DIR "/inc1/h.h");
+    check("removed from inc1", run(DIR "/a.c"), 2);
+
+    /* headers just written, which are not kept between compilations:
+       '#pragma once' and guards must still only skip their own file */
+    for(i = 0; i < 4; i++) {
+        snprintf(name, sizeof name, DIR "/once%d.h", i);
+        snprintf(text, sizeof text,
+                 "#pragma once\nstatic int once%d = %d;\n", i, 1 << i);
+        write_file(name, text);
+        snprintf(name, sizeof name, DIR "/guard%d.h", i);
+        snprintf(text, sizeof text,
+                 "#if !defined(GUARD%d)\n#define GUARD%d\n"
+                 "static int guard%d = %d;\n#endif\n", i, i, i, 16 << i);
+        write_file(name, text);
+    }
+    write_file(DIR "/b.c",
+               "#include \"once0.h\"\n#include \"once1.h\"\n"
+               "#include \"once2.h\"\n#include \"once3.h\"\n"
+               "#include \"guard0.h\"\n#include \"guard1.h\"\n"
+               "#include \"guard2.h\"\n#include \"guard3.h\"\n"
+               "#include \"once0.h\"\n#include \"once3.h\"\n"
+               "#include \"guard0.h\"\n#include \"guard3.h\"\n"
+               "int f(void) { return once0 + once1 + once2 + once3 +\n"
+               "    guard0 + guard1 + guard2 + guard3; }\n");
+    check("headers just written", run(DIR "/b.c"), 255);
+
+    remove(DIR "/inc2/h.h");
+    remove(DIR "/a.c");
+    remove(DIR "/b.c");
+    for(i = 0; i < 4; i++) {
+        snprintf(name, sizeof name, DIR "/once%d.h", i);
+        remove(name);
+        snprintf(name, sizeof name, DIR "/guard%d.h", i);
+        remove(name);
+    }
+    rmdir(DIR "/inc1");
+    rmdir(DIR "/inc2");
+    rmdir(DIR);
+
+    return nb_failed != 0;
+}
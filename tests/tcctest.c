@@ -42,6 +42,15 @@
 
 #include "tcclib.h"
 
+/* skipped the second time: '#pragma once', an '#if !defined' guard,
+   and the same files through other names */
+#include "tcctest_once.h"
+#include "tcctest_once.h"
+#include "./tcctest_once.h"
+#include "tcctest_guard.h"
+#include "tcctest_guard.h"
+#include "./tcctest_guard.h"
+
 void string_test();
 void expr_test();
 void macro_test();
@@ -52,6 +61,7 @@ void funcptr_test();
 void loop_test();
 void switch_test();
 void goto_test();
+void branch_test();
 void enum_test();
 void typedef_test();
 void struct_test();
@@ -70,8 +80,10 @@ void cast_test(void);
 void bitfield_test(void);
 void c99_bool_test(void);
 void float_test(void);
+void float_expr_test(void);
 void longlong_test(void);
 void manyarg_test(void);
+void tailcall_test(void);
 void stdarg_test(void);
 void whitespace_test(void);
 void relocation_test(void);
@@ -79,12 +91,14 @@ void old_style_function(void);
 void alloca_test(void);
 void c99_vla_test(int size1, int size2);
 void sizeof_test(void);
+void pack_test(void);
 void typeof_test(void);
 void local_label_test(void);
 void statement_expr_test(void);
 void asm_test(void);
 void builtin_test(void);
 void weak_test(void);
+void vector_test(void);
 
 int fib(int n);
 void num(int n);
@@ -150,6 +164,7 @@ void macro_test(void)
     printf("macro:\n");
     pf("N=%d\n", N);
     printf("aaa=%d\n", AAA);
+    printf("once=%d guard=%d\n", once_value, guard_value);
 
     printf("min=%d\n", min(1, min(2, -1)));
 
@@ -463,6 +478,65 @@ void goto_test()
     }
 }
 
+/* branches around the limits of their short form: 's ^= 3' is 9
+   bytes and 's += s' 11 bytes on x86_64 without -O, which puts each
+   pair of branches below at +127/+128 or -128/-129 bytes */
+#define BR9_1 s ^= 3;
+#define BR9_2 BR9_1 BR9_1
+#define BR9_4 BR9_2 BR9_2
+#define BR9_8 BR9_4 BR9_4
+#define BR11_1 s += s;
+#define BR11_2 BR11_1 BR11_1
+#define BR11_4 BR11_2 BR11_2
+#define BR11_8 BR11_4 BR11_4
+
+unsigned branch_fwd(unsigned a)
+{
+    unsigned s = a;
+    if (a & 1) { BR9_8 BR9_4 BR9_2 }
+    if (a & 2) { BR9_8 BR11_4 BR11_1 }
+    if (a & 4) { BR9_8 BR9_4 BR9_1 BR11_1 }
+    if (a & 8) { BR9_4 BR9_2 BR9_1 BR11_4 BR11_2 }
+    return s;
+}
+
+unsigned branch_else(unsigned a)
+{
+    unsigned s = a;
+    if (a & 1) s++; else { BR9_8 BR9_4 BR9_2 }
+    if (a & 2) s++; else { BR9_8 BR11_4 BR11_1 }
+    if (a & 4) s++; else { BR9_8 BR9_4 BR9_1 BR11_1 }
+    if (a & 8) s++; else { BR9_4 BR9_2 BR9_1 BR11_4 BR11_2 }
+    return s;
+}
+
+unsigned branch_back(unsigned a)
+{
+    unsigned s = a;
+    int n;
+    for(n = a & 3; n > 0; n--) { BR9_8 BR9_2 BR11_2 }
+    for(n = a & 3; n > 0; n--) { BR9_4 BR11_4 BR11_2 BR11_1 }
+    n = a & 3;
+    do { BR9_8 BR9_1 BR11_2 BR11_1 } while (--n > 0);
+    n = a & 3;
+    do { BR9_2 BR9_1 BR11_8 } while (--n > 0);
+    n = a & 3;
+    while (n-- > 0) { BR9_4 BR9_2 BR11_4 BR11_1 }
+    n = a & 3;
+    while (n-- > 0) { BR9_8 BR9_2 BR9_1 BR11_1 }
+    return s;
+}
+
+void branch_test()
+{
+    unsigned i;
+
+    printf("branch:\n");
+    for(i = 0; i < 16; i++)
+        printf("%u %u %u %u\n", i, branch_fwd(i), branch_else(i),
+               branch_back(i));
+}
+
 enum {
     E0,
     E1 = 2,
@@ -550,6 +624,7 @@ int main(int argc, char **argv)
     loop_test();
     switch_test();
     goto_test();
+    branch_test();
     enum_test();
     typedef_test();
     struct_test();
@@ -570,6 +645,7 @@ int main(int argc, char **argv)
     float_test();
     longlong_test();
     manyarg_test();
+    tailcall_test();
     stdarg_test();
     whitespace_test();
     relocation_test();
@@ -577,12 +653,14 @@ int main(int argc, char **argv)
     alloca_test();
     c99_vla_test(5, 2);
     sizeof_test();
+    pack_test();
     typeof_test();
     statement_expr_test();
     local_label_test();
     asm_test();
     builtin_test();
     weak_test();
+    vector_test();
     return 0; 
 }
 
@@ -1120,9 +1198,28 @@ struct structa1 struct_assign_test2(struct structa1 s1, int t)
     return s1;
 }
 
+/* copied from non static globals, at an offset */
+struct structa3 {
+    int f1;
+    char f2[13];
+    short f3;
+};
+
+struct structa3 ssta3[3] = {
+    { 1, "one", 11 }, { 2, "two", 22 }, { 3, "three", 33 }
+};
+
+struct structa4 {
+    char f1[7];
+};
+
+char ssta4[] = "0123456789abcdef";
+
 void struct_assign_test(void)
 {
     struct structa1 lsta1, lsta2;
+    struct structa3 lsta3, *psta3;
+    struct structa4 lsta4, *psta4;
     
 #if 0
     printf("struct_assign_test:\n");
@@ -1142,6 +1239,15 @@ void struct_assign_test(void)
     lsta2 = struct_assign_test2(lsta2, 4);
     printf("after call: %d %d\n", lsta2.f1, lsta2.f2);
 
+    lsta3 = ssta3[2];
+    printf("%d %s %d\n", lsta3.f1, lsta3.f2, lsta3.f3);
+    psta3 = &lsta3;
+    *psta3 = ssta3[1];
+    printf("%d %s %d\n", lsta3.f1, lsta3.f2, lsta3.f3);
+    psta4 = &lsta4;
+    *psta4 = *(struct structa4 *)(ssta4 + 9);
+    printf("%.7s\n", lsta4.f1);
+
     static struct {
         void (*elem)();
     } t[] = {
@@ -1161,6 +1267,14 @@ void cast1(char a, short b, unsigned char c, unsigned short d)
 char bcast;
 short scast;
 
+/* stored then reloaded in the same register: the reload must still
+   clear the high half at -O */
+long long cast_u32(long long x)
+{
+    unsigned u = x;
+    return u;
+}
+
 void cast_test()
 {
     int a;
@@ -1221,6 +1335,8 @@ void cast_test()
     /* from integers to pointers */
     printf("%p %p %p %p\n",
            (void *)a, (void *)b, (void *)c, (void *)d);
+
+    printf("%llx\n", cast_u32(-1));
 }
 
 /* initializers tests */
@@ -1438,6 +1554,46 @@ void switch_test()
         }
     }
     printf("\n");
+
+    /* long long cases which only differ in their high word */
+    long long ll[] = { -(1LL << 62), -(1LL << 62) + (1LL << 58),
+                       1LL << 40, (1LL << 40) + 3, 0xffffffffLL, 0, -1 };
+    for(i=0;i<7;i++) {
+        switch(ll[i]) {
+        case -(1LL << 62):
+            printf("a");
+            break;
+        case -(1LL << 62) + (1LL << 58):
+            printf("b");
+            break;
+        case 0xffffffffU:
+            printf("c");
+            break;
+        case -1:
+            printf("d");
+            break;
+        default:
+            printf("%d", i);
+            break;
+        }
+        switch(ll[i]) {
+        case (1LL << 40) ... (1LL << 40) + 1:
+        case (1LL << 40) + 3:
+        case (1LL << 40) + 5:
+        case (1LL << 40) + 6:
+        case (1LL << 40) + 7:
+        case (1LL << 40) + 8:
+        case (1LL << 40) + 9:
+        case (1LL << 40) + 10:
+        case (1LL << 40) + 11:
+            printf("t");
+            break;
+        default:
+            printf("-");
+            break;
+        }
+    }
+    printf("\n");
 }
 
 /* ISOC99 _Bool type */
@@ -1625,6 +1781,61 @@ void float_test(void)
     b = 4000000000;
     db = b;
     printf("db = %f\n", db);
+    float_expr_test();
+}
+
+/* expressions needing several float registers, call results, NaN
+   compares and conversions: on i386 with -msse2 they are computed in
+   %xmm0. The values are chosen so that the results are exact */
+double fexpr_half(double a) { return a * 0.5; }
+float fexpr_quarter(float a) { return a + 0.25f; }
+
+void float_expr_test(void)
+{
+    static double d[4] = { 1.5, -2.25, 3e10, 0.125 };
+    static float f[4] = { 0.5f, -7.75f, 1024.0f, -0.0625f };
+    double *pd[4], zero, nan, x;
+    float y;
+    int i, j;
+
+    printf("float_expr_test:\n");
+    for(i = 0; i < 4; i++) {
+        pd[i] = &d[3 - i];
+        for(j = 0; j < 4; j++) {
+            printf("%.10g %.10g %.10g\n",
+                   d[i] * f[j] + d[j] * (f[i] - d[i]),
+                   (d[i] + f[j]) * (d[j] - f[i]) - (f[j] * f[i] + d[i]),
+                   fexpr_half(d[i]) + fexpr_quarter(f[j]) * fexpr_half(f[i]));
+            printf("%d %d %d %d %d %d\n",
+                   d[i] == f[j], d[i] != f[j], d[i] < f[j],
+                   d[i] > f[j], d[i] <= f[j], d[i] >= f[j]);
+        }
+    }
+    printf("%.10g %.10g\n", *pd[0] + fexpr_half(*pd[1]) * *pd[2] - *pd[3],
+           (float)*pd[3] * fexpr_quarter(*pd[0]));
+
+    zero = 0;
+    nan = zero / zero;
+    y = nan;
+    printf("nan: %d %d %d %d %d %d %d %d\n", nan == nan, nan != nan,
+           nan < 1, nan > 1, nan <= 1, nan >= 1, y == y, y != y);
+    if (nan == nan)
+        printf("nan == nan\n");
+    if (nan != nan)
+        printf("nan != nan\n");
+    if (!(nan < zero) && !(nan >= zero))
+        printf("nan unordered\n");
+
+    for(i = 0; i < 4; i++) {
+        x = d[i] / 4;
+        y = f[i] * 3;
+        printf("%d %d %lld %lld %u %.10g %.10g\n", (int)(x / 1024), (int)y,
+               (long long)x, (long long)(y * 1e9), (unsigned)(x * x) & 0xffff,
+               (double)(float)x, (double)(long long)y);
+    }
+    j = -7;
+    printf("%.10g %.10g %.10g\n", (double)j / 2, (float)j / 4,
+           (double)(unsigned)j);
 }
 
 int fib(int n)
@@ -1777,6 +1988,51 @@ long long int value(struct S *v)
     return ((long long int)v->item);
 }
 
+/* mul, div, mod and shifts of values only known at run time: i386 does
+   the shifts and the divisions by values below 2^32 inline */
+void llruntime_test(void)
+{
+    static long long v[] = {
+        0, 1, -1, 7, -7, 0x7fffffff, -0x80000000LL, 0x100000000LL,
+        0x123456789abcdefLL, -0x123456789abcdefLL,
+        0x7fffffffffffffffLL, -0x7fffffffffffffffLL - 1 };
+    static long long d[] = {
+        1, -1, 2, 3, -3, 7, 0x7fffffff, 0x80000000LL, -0x80000000LL,
+        0xffffffffLL, -0xffffffffLL, 0x100000000LL, 0x123456789LL };
+    unsigned long long ua, ub, h1, h2, h3, h4, h5;
+    long long a, b;
+    int i, j, n;
+
+    printf("llruntime_test:\n");
+    for(i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+        a = v[i];
+        ua = a;
+        h1 = h2 = h3 = h4 = h5 = 0;
+        for(j = 0; j < sizeof(d) / sizeof(d[0]); j++) {
+            b = d[j];
+            ub = b;
+            h5 = h5 * 31 + ua * ub;
+            if (b == -1 && a == v[11])
+                continue;
+            h1 = h1 * 31 + a / b;
+            h2 = h2 * 31 + a % b;
+            h3 = h3 * 31 + ua / ub;
+            h4 = h4 * 31 + ua % ub;
+        }
+        printf("div %d: %llx %llx %llx %llx %llx\n", i, h1, h2, h3, h4, h5);
+        h1 = h2 = h3 = h4 = 0;
+        for(n = 0; n < 64; n++) {
+            h1 = h1 * 31 + (ua << n);
+            h2 = h2 * 31 + (a >> n);
+            h3 = h3 * 31 + (ua >> n);
+        }
+#define LLSHIFTC(n) h4 = ((h4 * 31 + (ua << n)) * 31 + (a >> n)) * 31 + (ua >> n);
+        LLSHIFTC(1) LLSHIFTC(7) LLSHIFTC(31) LLSHIFTC(32) LLSHIFTC(33)
+        LLSHIFTC(63)
+        printf("shift %d: %llx %llx %llx %llx\n", i, h1, h2, h3, h4);
+    }
+}
+
 void longlong_test(void)
 {
     long long a, b, c;
@@ -1837,6 +2093,20 @@ void longlong_test(void)
     printf("%d %d %d %d\n", a > b, a < b, a >= b, a <= b);
 
     printf("%Ld\n", 0x123456789LLU);
+
+    /* signed division by powers of two */
+    for(ia = -101; ia <= 101; ia += 101) {
+        printf("%d %d %d %d %d %d\n", ia / 8, ia % 8, ia / -8, ia % -8,
+               ia / (-2147483647 - 1), ia % (-2147483647 - 1));
+        a = ia * 1000000000000LL;
+        printf("%lld %lld %lld %lld %lld\n", a / 16, a % 16, a / -2, a % -2,
+               a % (-9223372036854775807LL - 1));
+    }
+    ia = -101;
+    printf("%llx %d\n", (unsigned long long)(unsigned)(ia % 8),
+           sizeof(ia % 8));
+
+    llruntime_test();
 }
 
 void manyarg_test(void)
@@ -1946,6 +2216,120 @@ void stdarg_for_struct(struct myspace bob, ...)
     va_end(ap);
 }
 
+/* calls in tail position */
+long long tail_sum(int n, long long acc)
+{
+    if (n == 0)
+        return acc;
+    return tail_sum(n - 1, acc + n);
+}
+
+int tail_rotate(int a, int b, int c, int d, int e, int f, int g, int h)
+{
+    if (a <= 0)
+        return b + c * 2 + d * 3 + e * 4 + f * 5 + g * 6 + h * 7;
+    return tail_rotate(a - 1, h, b, c, d, e, f, g);
+}
+
+long long tail_fewer(int a, int b, int c, int d, int e, int f, int g, int h)
+{
+    return tail_sum(a + h, b - g);
+}
+
+int tail_more(int a, int b)
+{
+    return tail_rotate(a, b, a + b, 4, 5, 6, 7, 8);
+}
+
+double tail_mixed(int n, double x, float y, long long z, char c)
+{
+    if (n == 0)
+        return x + y + z + c;
+    return tail_mixed(n - 1, x * 2, y + 1, z - 3, c + 1);
+}
+
+char tail_char(int x)
+{
+    return tail_rotate(0, x, 0, 0, 0, 0, 0, 0);
+}
+
+int tail_deref(int *p)
+{
+    return *p * 2;
+}
+
+int tail_addr(int n)
+{
+    int x = n + 1;
+    return tail_deref(&x);
+}
+
+long long (*tail_fp)(int, long long) = tail_sum;
+
+long long tail_ptr(int n)
+{
+    return tail_fp(n, 1);
+}
+
+struct tail_small {
+    int a, b;
+};
+
+struct tail_big {
+    int a[10];
+};
+
+struct tail_small tail_small_f(int n)
+{
+    struct tail_small s;
+    s.a = n;
+    s.b = -n;
+    return s;
+}
+
+struct tail_small tail_small_g(int n)
+{
+    return tail_small_f(n + 1);
+}
+
+struct tail_big tail_big_f(int n, struct tail_big b)
+{
+    if (n == 0)
+        return b;
+    b.a[n] += n * 10;
+    return tail_big_f(n - 1, b);
+}
+
+int tail_big_g(int n, struct tail_big b)
+{
+    if (n == 0)
+        return b.a[0] + b.a[9];
+    b.a[0] += n;
+    return tail_big_g(n - 1, b);
+}
+
+void tailcall_test(void)
+{
+    struct tail_small s;
+    struct tail_big b;
+    int i;
+
+    printf("tailcall_test:\n");
+    printf("%lld %lld\n", tail_sum(10, 0), tail_sum(100000, 0));
+    printf("%d %lld %d\n", tail_rotate(13, 1, 2, 3, 4, 5, 6, 7),
+           tail_fewer(5, 6, 7, 8, 9, 10, 2, 3), tail_more(3, 4));
+    printf("%f %d %d %lld\n", tail_mixed(20, 0.5, 0.25f, 1000, 'a'),
+           tail_char(0x1234), tail_addr(20), tail_ptr(10));
+    s = tail_small_g(41);
+    printf("%d %d\n", s.a, s.b);
+    for(i = 0; i < 10; i++)
+        b.a[i] = i;
+    b = tail_big_f(9, b);
+    for(i = 0; i < 10; i++)
+        printf("%d ", b.a[i]);
+    printf("%d\n", tail_big_g(5, b));
+}
+
 void stdarg_test(void)
 {
     long double ld = 1234567891234LL;
@@ -2104,6 +2488,15 @@ void c99_vla_test(int size1, int size2)
     printf("%s\n", (tab2 - tab1 == (tab2_ptr - tab1_ptr) / (sizeof(int) * 2)) ? "PASSED" : "FAILED");
     printf("Test C99 VLA 3 (ptr add): ");
     printf("%s\n", &tab1[5][1] == (tab1_ptr + (5 * 2 + 1) * sizeof(int)) ? "PASSED" : "FAILED");
+    printf("Test C99 VLA 3b (loops): ");
+    {
+        int vla[size1], i, sum = 0;
+        for(i = 0; i < size1; i++)
+            vla[i] = i;
+        for(i = 0; i < size1; i++)
+            sum += vla[i];
+        printf("%s\n", sum == size1 * (size1 - 1) / 2 ? "PASSED" : "FAILED");
+    }
     printf("Test C99 VLA 4 (ptr access): ");
     tab1[size1][1] = 42;
     printf("%s\n", (*((int *) (tab1_ptr + (size1 * 2 + 1) * sizeof(int))) == 42) ? "PASSED" : "FAILED");
@@ -2164,8 +2557,33 @@ void sizeof_test(void)
     printf("__alignof__(char) = %d\n", __alignof__(char));
     printf("__alignof__(unsigned char) = %d\n", __alignof__(unsigned char));
     printf("__alignof__(func) = %d\n", __alignof__ sizeof_test());
+
+#pragma pack(push, 1)
+    struct packed_local { char c; int i; };
+#pragma pack(pop)
+    struct unpacked_local { char c; int i; };
+    printf("sizeof(packed_local) = %d\n", sizeof(struct packed_local));
+    printf("sizeof(unpacked_local) = %d\n", sizeof(struct unpacked_local));
 }
 
+#pragma pack(push, 2)
+extern int packed1_size;
+
+void pack_test(void)
+{
+    struct packed2_local { char c; int i; };
+#pragma pack(1)
+    struct packed1_local { char c; int i; };
+    printf("sizeof(packed2_local) = %d\n", sizeof(struct packed2_local));
+    printf("sizeof(packed1_local) = %d\n", sizeof(struct packed1_local));
+    printf("sizeof(packed1) = %d\n", packed1_size);
+}
+
+/* still packed by the '#pragma pack(1)' of the function */
+struct packed1 { char c; int i; };
+int packed1_size = sizeof(struct packed1);
+#pragma pack(pop)
+
 void typeof_test(void)
 {
     double a;
@@ -2419,6 +2837,15 @@ void builtin_test(void)
     printf("res = %d\n", __builtin_constant_p(1 + 2));
     printf("res = %d\n", __builtin_constant_p(&constant_p_var));
     printf("res = %d\n", __builtin_constant_p(constant_p_var));
+    {
+        char buf[40];
+        int n = 7;
+        printf("res = %d\n", __builtin_memset(buf, 'x', sizeof buf - 1) == buf);
+        buf[39] = 0;
+        __builtin_memcpy(buf + 2, "hello, world", 12);
+        __builtin_memset(buf + 14, '-', n);
+        printf("%s\n", buf);
+    }
 }
 
 
@@ -2478,6 +2905,39 @@ int __attribute__((weak)) weak_f3() { return 333; }
 int __attribute__((weak)) weak_v2 = 222;
 int __attribute__((weak)) weak_v3 = 333;
 
+typedef int v4si __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((__vector_size__(16)));
+
+v4si vadd(v4si a, v4si b)
+{
+    return a + b;
+}
+
+void vector_test(void)
+{
+    v4si a = { 10, -20, 30, 40 }, b = { 3, 7, -5, 2 }, c, *p = &c;
+    v4sf x = { 1.0f, 2.5f, -3.25f, 8.0f }, y;
+    v8hi h = { 1, 2, 3, 4, 5, 6, 7, 300 };
+    int i;
+
+    printf("vector_test:\n");
+    printf("sizeof=%d %d\n", sizeof(v4si), sizeof(h + h));
+    c = a * b - 1;
+    printf("%d %d %d %d\n", c[0], c[1], c[2], c[3]);
+    c = (a / b) ^ (a % b) | ~a & b;
+    printf("%d %d %d %d\n", c[0], c[1], c[2], c[3]);
+    *p += vadd(a, b) << 1;
+    printf("%d %d %d %d\n", c[0], c[1], c[2], c[3]);
+    y = x * x / 2 + (v4sf){ 0.5f, 0.25f };
+    y[3] = -y[3];
+    printf("%f %f %f %f\n", y[0], y[1], y[2], y[3]);
+    h = h * h - h;
+    for(i = 0; i < 8; i++)
+        printf("%d ", h[i]);
+    printf("\n");
+}
+
 void const_func(const int a)
 {
 }
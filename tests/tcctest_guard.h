@@ -0,0 +1,10 @@
+/* included twice by tcctest.c */
+#if !defined(TCCTEST_GUARD_H)
+#define TCCTEST_GUARD_H
+
+struct guard_s {
+    int a, b;
+};
+static int guard_value = 2;
+
+#endif
@@ -0,0 +1,7 @@
+/* included twice by tcctest.c */
+#pragma once
+
+struct once_s {
+    int a;
+};
+static int once_value = 1;
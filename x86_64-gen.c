@@ -25,6 +25,12 @@
 /* number of available registers */
 #define NB_REGS         5
 #define NB_ASM_REGS     8
+/* number of callee saved registers for the register locals */
+#ifdef __native_client__
+#define NB_REGVARS      4 /* r15 is the sandbox base */
+#else
+#define NB_REGVARS      5
+#endif
 
 /* a register can belong to several classes. The classes must be
    sorted from more general to more precise (see gv2() code which does
@@ -119,11 +125,48 @@ ST_DATA const int reg_classes[NB_REGS] = {
 #endif
 };
 
-static unsigned long func_sub_sp_offset;
-static int func_ret_sub;
+static ST_TLS unsigned long func_sub_sp_offset;
+static ST_TLS int func_ret_sub;
+
+#ifdef CONFIG_TCC_REGVARS
+/* rbx, r12 - r15 */
+static const uint8_t regvar_regs[NB_REGVARS] = {
+    3, 12, 13, 14,
+#ifndef __native_client__
+    15,
+#endif
+};
+/* mask of the registers given to live locals, and of the ones which
+   must be saved */
+static ST_TLS int regvar_busy, regvar_used;
+
+/* return a free callee saved register for a local, or -1 */
+ST_FUNC int get_regvar(void)
+{
+    int i;
+    for(i = 0; i < NB_REGVARS; i++) {
+        if (!(regvar_busy & (1 << i))) {
+            regvar_busy |= 1 << i;
+            regvar_used |= 1 << i;
+            return regvar_regs[i];
+        }
+    }
+    return -1;
+}
+
+/* the local in register 'r' went out of scope */
+ST_FUNC void free_regvar(int r)
+{
+    int i;
+    for(i = 0; i < NB_REGVARS; i++) {
+        if (regvar_regs[i] == r)
+            regvar_busy &= ~(1 << i);
+    }
+}
+#endif
 
 #ifdef __native_client__
-void opadding()
+void opadding(void)
 {
     while (ind & 31)
         g(0x90);
@@ -393,9 +436,20 @@ static void gen_modrm64(int opcode, int op_reg, int r, Sym *sym, int c)
 
 
 /* load 'r' from value 'sv' */
+#ifdef CONFIG_TCC_RELAX
+/* true if 'v' is a local variable that the peephole pass may track */
+static int peep_local(SValue *v)
+{
+    int bt = v->type.t & VT_BTYPE;
+    return (v->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == (VT_LOCAL | VT_LVAL)
+        && !(v->type.t & VT_VOLATILE)
+        && (bt == VT_INT || bt == VT_PTR || bt == VT_LLONG);
+}
+#endif
+
 void load(int r, SValue *sv)
 {
-    int v, t, ft, fc, fr;
+    int v, t, ft, fc, fr, start;
     SValue v1;
 
 #ifdef TCC_TARGET_PE
@@ -404,6 +458,7 @@ void load(int r, SValue *sv)
 #endif
 
     gp(10);
+    start = ind;
 
     fr = sv->r;
     ft = sv->type.t;
@@ -430,13 +485,28 @@ void load(int r, SValue *sv)
     v = fr & VT_VALMASK;
     if (fr & VT_LVAL) {
         int b, ll;
+#ifdef CONFIG_TCC_REGVARS
+        if (v == VT_REGVAR) {
+            ll = is64_type(ft);
+            orex(ll, r, fc, 0x89);
+            o(0xc0 + REG_VALUE(r) + REG_VALUE(fc) * 8); /* mov reg, r */
+#ifdef CONFIG_TCC_RELAX
+            add_peep(start, PEEP_MOV | (ll ? PEEP_LL : 0), r, fc);
+#endif
+            return;
+        }
+#endif
         if (v == VT_LLOCAL) {
+            /* we cannot use float registers for the pointer */
+            int tr = r;
+            if (is_float(ft))
+                tr = get_reg(RC_INT);
             v1.type.t = VT_PTR;
             v1.r = VT_LOCAL | VT_LVAL;
             v1.c.ul = fc;
-            load(r, &v1);
+            load(tr, &v1);
             gp(10);
-            fr = r;
+            fr = tr;
         }
         ll = 0;
         if ((ft & VT_BTYPE) == VT_FLOAT) {
@@ -463,6 +533,10 @@ void load(int r, SValue *sv)
             orex(ll, fr, r, b);
             gen_modrm(r, fr, sv->sym, fc);
         }
+#ifdef CONFIG_TCC_RELAX
+        if (peep_local(sv))
+            add_peep(start, PEEP_LOAD | (ll ? PEEP_LL : 0), r, fc);
+#endif
     } else {
         if (v == VT_CONST) {
             if (fr & VT_SYM) {
@@ -478,7 +552,7 @@ void load(int r, SValue *sv)
                 } else {
                     orex(1,0,r,0x8b);
                     o(0x05 + REG_VALUE(r) * 8); /* mov xx(%rip), r */
-                    gen_gotpcrel(fr, sv->sym, fc);
+                    gen_gotpcrel(r, sv->sym, fc);
                 }
 #endif
             } else if (is64_type(ft)) {
@@ -523,6 +597,9 @@ void load(int r, SValue *sv)
             } else {
                 orex(1,r,v, 0x89);
                 o(0xc0 + REG_VALUE(r) + REG_VALUE(v) * 8); /* mov v, r */
+#ifdef CONFIG_TCC_RELAX
+                add_peep(start, PEEP_MOV | PEEP_LL, r, v);
+#endif
             }
         }
     }
@@ -531,7 +608,7 @@ void load(int r, SValue *sv)
 /* store register 'r' in lvalue 'v' */
 void store(int r, SValue *v)
 {
-    int fr, bt, ft, fc;
+    int fr, bt, ft, fc, start;
     int op64 = 0;
     /* store the REX prefix in this variable when PIC is enabled */
     int pic = 0;
@@ -542,12 +619,25 @@ void store(int r, SValue *v)
 #endif
 
     gp(10);
+    start = ind;
 
     ft = v->type.t;
     fc = v->c.ul;
     fr = v->r & VT_VALMASK;
     bt = ft & VT_BTYPE;
 
+#ifdef CONFIG_TCC_REGVARS
+    if (fr == VT_REGVAR) {
+        op64 = is64_type(bt);
+        orex(op64, fc, r, 0x89);
+        o(0xc0 + REG_VALUE(fc) + REG_VALUE(r) * 8); /* mov r, reg */
+#ifdef CONFIG_TCC_RELAX
+        add_peep(start, PEEP_MOV | (op64 ? PEEP_LL : 0), fc, r);
+#endif
+        return;
+    }
+#endif
+
 #if !defined(TCC_TARGET_PE) && !defined(__native_client__)
     /* we need to access the variable via got */
     if (fr == VT_CONST && (v->r & VT_SYM)) {
@@ -607,6 +697,10 @@ void store(int r, SValue *v)
             o(0xc0 + fr + r * 8); /* mov r, fr */
         }
     }
+#ifdef CONFIG_TCC_RELAX
+    if (peep_local(v))
+        add_peep(start, PEEP_STORE | (op64 ? PEEP_LL : 0), r, fc);
+#endif
 }
 
 /* 'is_jmp' is '1' if it is a jump */
@@ -636,8 +730,21 @@ static void gcall_or_jmp(int is_jmp)
     } else {
         /* otherwise, indirect call */
         r = TREG_R11;
-        load(r, vtop);
+        if (vtop->r != r)
+            load(r, vtop);
+#ifdef __native_client__
+        /* nacljmp/naclcall */
+        if (!is_jmp) {
+            while ((ind + 10) & 31)
+                g(0x90);
+        } else {
+            gp(10);
+        }
+        o(0xe0e38341); /* and $-32, %r11d */
+        o(0xfb014d); /* add %r15, %r11 */
+#else
         gp(3);
+#endif
         o(0x41); /* REX */
         o(0xff); /* call/jmp *r */
         o(0xd0 + REG_VALUE(r) + (is_jmp << 4));
@@ -651,7 +758,7 @@ static const uint8_t arg_regs[] = {
     TREG_RCX, TREG_RDX, TREG_R8, TREG_R9
 };
 
-static int func_scratch;
+static ST_TLS int func_scratch;
 
 /* Generate function call. The function address is pushed first, then
    all the parameters in call order. This functions pops all the
@@ -886,6 +993,57 @@ static void gadd_sp(int val)
 }
 
 #define REGN 6
+
+#ifdef CONFIG_TCC_REGVARS
+/* end of the room left after the prolog to save the callee saved
+   registers, 0 if none */
+static ST_TLS int regvar_save_end;
+/* start and end of the room left before each tail call to restore
+   them */
+static ST_TLS int *regvar_tails, nb_regvar_tails;
+#endif
+
+/* leave the frame and jump to vtop, the arguments being all in
+   registers */
+static void gtail_jmp(void)
+{
+#ifdef CONFIG_TCC_REGVARS
+    int i, n;
+#endif
+
+    if ((vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST) {
+        load(TREG_R11, vtop);
+        vtop->r = TREG_R11;
+    }
+#ifdef CONFIG_TCC_REGVARS
+    if (func_regvars) {
+        /* filled in by gfunc_epilog() */
+        n = nb_regvar_tails;
+        if ((n & (n - 1)) == 0)
+            regvar_tails = tcc_realloc(regvar_tails,
+                                       (n ? n * 2 : 2) * sizeof(int));
+        regvar_tails[n] = ind;
+        for(i = 0; i < NB_REGVARS; i++) {
+            gp(7);
+            ind += 7;
+        }
+        regvar_tails[n + 1] = ind;
+        nb_regvar_tails = n + 2;
+    }
+#endif
+#ifdef __native_client__
+    o(0xec8948);
+    o(0x5a41); /* pop %r10: %r11 holds the target */
+    /* naclrestbp */
+    gp(6);
+    o(0xd58944);
+    o(0xfd014c);
+#else
+    o(0xc9); /* leave */
+#endif
+    gcall_or_jmp(1);
+}
+
 static const uint8_t arg_regs[REGN] = {
     TREG_RDI, TREG_RSI, TREG_RDX, TREG_RCX, TREG_R8, TREG_R9
 };
@@ -895,12 +1053,14 @@ static const uint8_t arg_regs[REGN] = {
    parameters and the function address. */
 void gfunc_call(int nb_args)
 {
-    int size, align, r, args_size, i;
+    int size, align, r, args_size, i, tail;
     SValue *orig_vtop;
     int nb_reg_args = 0;
     int nb_sse_args = 0;
     int sse_reg, gen_reg;
 
+    tail = tail_call;
+    tail_call = 0;
     /* calculate the number of integer/float arguments */
     args_size = 0;
     for(i = 0; i < nb_args; i++) {
@@ -1038,6 +1198,11 @@ void gfunc_call(int nb_args)
     }
 
     oad(0xb8, nb_sse_args < 8 ? nb_sse_args : 8); /* mov nb_sse_args, %eax */
+    if (tail && args_size == 0) {
+        gtail_jmp();
+        vtop--;
+        return;
+    }
     gcall_or_jmp(0);
     if (args_size)
         gadd_sp(args_size);
@@ -1059,7 +1224,7 @@ static void push_arg_reg(int i) {
 /* generate function prolog of type 't' */
 void gfunc_prolog(CType *func_type)
 {
-    int i, addr, align, size;
+    int i, addr, align, size, r;
     int param_index, param_addr, reg_param_index, sse_param_index;
     Sym *sym;
     CType *type;
@@ -1076,6 +1241,20 @@ void gfunc_prolog(CType *func_type)
     ind += FUNC_PROLOG_SIZE;
     func_sub_sp_offset = ind;
     func_ret_sub = 0;
+#ifdef CONFIG_TCC_REGVARS
+    regvar_busy = regvar_used = 0;
+    regvar_save_end = 0;
+    nb_regvar_tails = 0;
+    if (func_regvars) {
+        /* one 'mov %reg, disp32(%rbp)' per register, filled in by
+           gfunc_epilog() */
+        for(i = 0; i < NB_REGVARS; i++) {
+            gp(7);
+            ind += 7;
+        }
+        regvar_save_end = ind;
+    }
+#endif
 
     if (func_type->ref->c == FUNC_ELLIPSIS) {
         int seen_reg_num, seen_sse_num, seen_stack_size;
@@ -1154,6 +1333,24 @@ void gfunc_prolog(CType *func_type)
         type = &sym->type;
         size = type_size(type, &align);
         size = (size + 7) & ~7;
+        r = VT_LOCAL | VT_LVAL;
+#ifdef CONFIG_TCC_REGVARS
+        if (func_type->ref->c != FUNC_ELLIPSIS &&
+            (param_addr = alloc_regvar(sym->v & ~SYM_FIELD, type)) >= 0) {
+            if (reg_param_index < REGN) {
+                gp(3);
+                orex(1, param_addr, arg_regs[reg_param_index], 0x89);
+                o(0xc0 + REG_VALUE(param_addr) +
+                  REG_VALUE(arg_regs[reg_param_index]) * 8); /* mov */
+            } else {
+                gp(7);
+                gen_modrm64(0x8b, param_addr, VT_LOCAL, NULL, addr);
+                addr += 8;
+            }
+            reg_param_index++;
+            r = VT_REGVAR | VT_LVAL;
+        } else
+#endif
         if (is_sse_float(type->t)) {
             if (sse_param_index < 8) {
                 /* save arguments passed by register */
@@ -1182,8 +1379,7 @@ void gfunc_prolog(CType *func_type)
             }
             reg_param_index++;
         }
-        sym_push(sym->v & ~SYM_FIELD, type,
-                 VT_LOCAL | VT_LVAL, param_addr);
+        sym_push(sym->v & ~SYM_FIELD, type, r, param_addr);
         param_index++;
     }
 }
@@ -1192,6 +1388,19 @@ void gfunc_prolog(CType *func_type)
 void gfunc_epilog(void)
 {
     int v, saved_ind;
+#ifdef CONFIG_TCC_REGVARS
+    int i, j, r, regvar_slots[NB_REGVARS];
+
+    /* restore the callee saved registers */
+    for(i = 0; i < NB_REGVARS; i++) {
+        if (regvar_used & (1 << i)) {
+            loc -= 8;
+            regvar_slots[i] = loc;
+            gp(7);
+            gen_modrm64(0x8b, regvar_regs[i], VT_LOCAL, NULL, loc);
+        }
+    }
+#endif
 
 #ifdef __native_client__
     if (func_ret_sub)
@@ -1233,6 +1442,50 @@ void gfunc_epilog(void)
 #else
     o(0xec8148);  /* sub rsp, stacksize */
     gen_le32(v);
+#endif
+#ifdef CONFIG_TCC_REGVARS
+    if (regvar_save_end) {
+        for(i = 0; i < NB_REGVARS; i++) {
+            if (regvar_used & (1 << i)) {
+                r = regvar_regs[i];
+#ifdef __native_client__
+                /* same layout as in gfunc_prolog() */
+                gp(7);
+                o(0x48 | (REX_BASE(r) << 2));
+                o(0x89); /* mov %reg, disp32(%rbp) */
+                oad(0x85 | (REG_VALUE(r) << 3), regvar_slots[i]);
+#else
+                gen_modrm64(0x89, r, VT_LOCAL, NULL, regvar_slots[i]);
+#endif
+            }
+        }
+#ifdef CONFIG_TCC_RELAX
+        del_code(ind, regvar_save_end - ind);
+#endif
+        while (ind < regvar_save_end)
+            g(0x90);
+    }
+    for(j = 0; j < nb_regvar_tails; j += 2) {
+        ind = regvar_tails[j];
+        for(i = 0; i < NB_REGVARS; i++) {
+            if (regvar_used & (1 << i)) {
+                r = regvar_regs[i];
+                gp(7);
+                o(0x48 | (REX_BASE(r) << 2));
+                o(0x8b); /* mov disp32(%rbp), %reg */
+                oad(0x85 | (REG_VALUE(r) << 3), regvar_slots[i]);
+            }
+        }
+        if (regvar_tails[j + 1] - ind > 8) {
+            gp(2);
+            g(0xeb); /* jmp over the padding */
+            g(regvar_tails[j + 1] - ind - 1);
+        }
+        while (ind < regvar_tails[j + 1])
+            g(0x90);
+    }
+    tcc_free(regvar_tails);
+    regvar_tails = NULL;
 #endif
     ind = saved_ind;
 }
@@ -1242,7 +1495,11 @@ void gfunc_epilog(void)
 /* generate a jump to a label */
 int gjmp(int t)
 {
-    return psym(0xe9, t);
+    t = psym(0xe9, t);
+#ifdef CONFIG_TCC_RELAX
+    add_branch(ind - 4);
+#endif
+    return t;
 }
 
 /* generate a jump to a fixed address */
@@ -1254,8 +1511,14 @@ void gjmp_addr(int a)
     if (r == (char)r) {
         g(0xeb);
         g(r);
+#ifdef CONFIG_TCC_RELAX
+        add_branch(ind - 1);
+#endif
     } else {
         oad(0xe9, a - ind - 5);
+#ifdef CONFIG_TCC_RELAX
+        add_branch(ind - 4);
+#endif
     }
 }
 
@@ -1270,6 +1533,9 @@ int gtst(int inv, int t)
         /* fast case : can jump directly since flags are set */
         g(0x0f);
         t = psym((vtop->c.i - 16) ^ inv, t);
+#ifdef CONFIG_TCC_RELAX
+        add_branch(ind - 4);
+#endif
     } else if (v == VT_JMP || v == VT_JMPI) {
         /* && or || optimization */
         if ((v & 1) == inv) {
@@ -1299,6 +1565,9 @@ int gtst(int inv, int t)
             o(0xc0 + REG_VALUE(v) * 9);
             g(0x0f);
             t = psym(0x85 ^ inv, t);
+#ifdef CONFIG_TCC_RELAX
+            add_branch(ind - 4);
+#endif
         }
     }
     vtop--;
@@ -1306,10 +1575,145 @@ int gtst(int inv, int t)
 }
 
 /* generate an integer binary operation */
+/* reg to reg instruction 'b' with the first eight registers */
+static void orr(int ll, int b, int r, int fr)
+{
+    gp(10);
+    orex(ll, r, fr, b);
+    o(0xc0 + REG_VALUE(r) + REG_VALUE(fr) * 8);
+}
+
+/* shift 'r' by 'c' ('opc' as in gen_opi) */
+static void oshift(int ll, int opc, int r, int c)
+{
+    gp(10);
+    orex(ll, r, 0, 0xc1);
+    o(opc | REG_VALUE(r));
+    g(c);
+}
+
+/* load the constant 'c' in 'r' */
+static void omovi(int ll, int r, unsigned long long c)
+{
+    gp(10);
+    if (!ll || c == (unsigned)c) {
+        orex(0, r, 0, 0xb8 + REG_VALUE(r)); /* mov $c, %e?? */
+        gen_le32(c);
+    } else if ((int)c == (long long)c) {
+        orex(1, r, 0, 0xc7); /* mov $c, r (sign extended) */
+        o(0xc0 + REG_VALUE(r));
+        gen_le32(c);
+    } else {
+        orex(1, r, 0, 0xb8 + REG_VALUE(r)); /* movabs $c, r */
+        gen_le64(c);
+    }
+}
+
+/* r = r * c with lea and shl for c = {3,5,9} * 2^n, imul $c else */
+static void gen_mulc(int ll, int r, int c)
+{
+    int n, m;
+
+    for(n = 0; n < 31 && !((c >> n) & 1); n++);
+    m = c >> n;
+    gp(10);
+    if ((m == 3 || m == 5 || m == 9) && r < 8 && REG_VALUE(r) != 5) {
+        orex(ll, 0, 0, 0x8d); /* lea (r,r,m-1), r */
+        o(0x04 | (REG_VALUE(r) << 3));
+        o((m == 3 ? 0x40 : m == 5 ? 0x80 : 0xc0) | REG_VALUE(r) * 9);
+        if (n)
+            oshift(ll, 0xe0, r, n);
+    } else {
+        orex(ll, r, r, c == (char)c ? 0x6b : 0x69); /* imul $c, r, r */
+        o(0xc0 + REG_VALUE(r) * 9);
+        if (c == (char)c)
+            g(c);
+        else
+            gen_le32(c);
+    }
+}
+
+/* divide %rcx by the constant 'd' (not 0, 1 or a power of two) with
+   a multiplication by its magic number, or by its inverse for exact
+   pointer differences. %rax and %rdx are free. Return the result
+   register. */
+static int gen_divc(int op, long long d, int ll, int uu)
+{
+    unsigned long long m, ud;
+    long long sm;
+    int r, s, a, bits;
+
+    bits = ll ? 64 : 32;
+    if (op == TOK_PDIV) {
+        for(s = 0; !(d & 1); s++)
+            d >>= 1;
+        ud = m = d;
+        for(a = 0; a < 5; a++)
+            m *= 2 - ud * m;
+        if (s)
+            oshift(ll, 0xf8, TREG_RCX, s); /* sar $s, %rcx */
+        omovi(ll, TREG_RAX, ll ? m : (unsigned)m);
+        orr(ll, 0xaf0f, TREG_RAX, TREG_RCX); /* imul %rax, %rcx */
+        return TREG_RCX;
+    }
+    a = div_magic(d, bits, !uu, &m, &s);
+    sm = ll ? (long long)m : (int)m;
+    if (uu || ll)
+        omovi(ll, TREG_RAX, m);
+    else
+        omovi(0, TREG_RAX, (unsigned)m);
+    gp(10);
+    orex(ll, TREG_RCX, 0, 0xf7);
+    o(uu ? 0xe1 : 0xe9); /* mul/imul %rcx */
+    if (uu) {
+        if (a) {
+            /* ((n - hi) >> 1 + hi) >> (s - 1) */
+            orr(ll, 0x89, TREG_RAX, TREG_RCX);
+            orr(ll, 0x29, TREG_RAX, TREG_RDX);
+            oshift(ll, 0xe8, TREG_RAX, 1);
+            orr(ll, 0x01, TREG_RAX, TREG_RDX);
+            if (s > 1)
+                oshift(ll, 0xe8, TREG_RAX, s - 1);
+            r = TREG_RAX;
+        } else {
+            if (s)
+                oshift(ll, 0xe8, TREG_RDX, s);
+            r = TREG_RDX;
+        }
+    } else {
+        if (d > 0 && sm < 0)
+            orr(ll, 0x01, TREG_RDX, TREG_RCX); /* add %rcx, %rdx */
+        else if (d < 0 && sm > 0)
+            orr(ll, 0x29, TREG_RDX, TREG_RCX); /* sub %rcx, %rdx */
+        if (s)
+            oshift(ll, 0xf8, TREG_RDX, s);
+        /* add one if negative */
+        orr(ll, 0x89, TREG_RAX, TREG_RDX);
+        oshift(ll, 0xe8, TREG_RAX, bits - 1);
+        orr(ll, 0x01, TREG_RDX, TREG_RAX);
+        r = TREG_RDX;
+    }
+    if (op == '%' || op == TOK_UMOD) {
+        /* n - q * d */
+        if (!ll || (int)d == d) {
+            gen_mulc(ll, r, d);
+        } else {
+            a = r == TREG_RAX ? TREG_RDX : TREG_RAX;
+            omovi(ll, a, d);
+            orr(ll, 0xaf0f, a, r); /* imul a, r */
+        }
+        orr(ll, 0x29, TREG_RCX, r); /* sub r, %rcx */
+        r = TREG_RCX;
+    }
+    return r;
+}
+
 void gen_opi(int op)
 {
     int r, fr, opc, c;
     int ll, uu, cc;
+    long long d;
+    unsigned long long ud;
 
     gp(10);
 
@@ -1372,6 +1776,14 @@ void gen_opi(int op)
         opc = 1;
         goto gen_op8;
     case '*':
+        if (cc && (!ll || (int)vtop->c.ll == vtop->c.ll)) {
+            vswap();
+            r = gv(RC_INT);
+            vswap();
+            gen_mulc(ll, r, vtop->c.i);
+            vtop--;
+            break;
+        }
         gv2(RC_INT, RC_INT);
         gp(10);
         r = vtop[-1].r;
@@ -1418,6 +1830,21 @@ void gen_opi(int op)
     case TOK_PDIV:
         uu = 0;
     divmod:
+        if (cc) {
+            /* constant divisor: multiply by its magic number */
+            d = ll ? vtop->c.ll : uu ? (long long)vtop->c.ui : vtop->c.i;
+            ud = uu || d > 0 ? d : -(unsigned long long)d;
+            if (ud > 1 && (ud & (ud - 1))) {
+                vswap();
+                gv(RC_RCX);
+                vswap();
+                vtop--;
+                save_reg(TREG_RAX);
+                save_reg(TREG_RDX);
+                vtop->r = gen_divc(op, d, ll, uu);
+                break;
+            }
+        }
         /* first operand must be in eax */
         /* XXX: need better constraint for second operand */
         gv2(RC_RAX, RC_RCX);
@@ -1562,6 +1989,8 @@ void gen_opf(int op)
             }
 
             if (op == TOK_EQ || op == TOK_NE) {
+                save_reg(TREG_RAX); /* eax is used to test for unordered */
+                gp(10);
                 swapped = 0;
             } else {
                 if (op == TOK_LE || op == TOK_LT)
@@ -1589,6 +2018,14 @@ void gen_opf(int op)
                 o(0x2e0f); /* ucomisd */
                 gen_modrm(0, r, vtop->sym, fc);
             }
+            if (op == TOK_EQ || op == TOK_NE) {
+                /* unordered sets ZF, PF and CF: equal is ZF without PF */
+                gp(8);
+                o(0xc09b0f); /* setnp %al */
+                o(0xc4940f); /* sete %ah */
+                o(0xe020); /* and %ah, %al */
+                op = op == TOK_EQ ? TOK_NE : TOK_EQ;
+            }
 
             vtop--;
             vtop->r = VT_CMP;
@@ -1665,6 +2102,314 @@ void gen_opf(int op)
     }
 }
 
+/* emit the SSE instruction 'pfx 0f opc' between %xmm'xr' and the
+   vector lvalue 'sv': a frame slot or a pointer held in a register */
+static void gen_vmodrm(int pfx, int opc, int xr, SValue *sv)
+{
+    int r = sv->r & VT_VALMASK;
+
+    gp(16);
+    if (r == VT_LOCAL) {
+        if (pfx)
+            g(pfx);
+        g(0x0f);
+        g(opc);
+        gen_modrm_impl(xr, VT_LOCAL, NULL, sv->c.ul, 0);
+        return;
+    }
+#ifdef __native_client__
+    if (REX_BASE(r))
+        g(0x45);
+    g(0x89); /* mov %e_r, %e_r */
+    g(0xc0 | REG_VALUE(r) * 9);
+    if (pfx)
+        g(pfx);
+    g(0x41 | REX_BASE(r) << 1);
+    g(0x0f);
+    g(opc);
+    g(0x04 | xr << 3); /* (%r15,%r) */
+    g(REG_VALUE(r) << 3 | 7);
+#else
+    if (pfx)
+        g(pfx);
+    if (REX_BASE(r))
+        g(0x41);
+    g(0x0f);
+    g(opc);
+    g(xr << 3 | REG_VALUE(r));
+#endif
+}
+
+/* emit the SSE instruction 'pfx 0f opc modrm' between two registers
+   (an immediate byte may follow) */
+static void orv(int pfx, int opc, int modrm)
+{
+    gp(5);
+    if (pfx)
+        g(pfx);
+    g(0x0f);
+    g(opc);
+    g(modrm);
+}
+
+/* true if the vector lvalue 'sv' is known to be 16 byte aligned: a
+   local of the frame, which is aligned like %rbp */
+static int vec_aligned(SValue *sv)
+{
+    int c = sv->c.ul;
+    return (sv->r & VT_VALMASK) == VT_LOCAL && c < 0 && !(c & 15);
+}
+
+/* GCC vectors: 'dest = vtop[-1] op vtop[0]' on 16 byte vectors with
+   SSE2, or 'dest = vtop[0]' if op is '='. The operands are frame
+   slots or pointers held in registers. Return 0 if there is no SSE2
+   instruction for 'op' on these lanes. */
+ST_FUNC int gen_opv(int op, SValue *dest)
+{
+    int bt, size, align, pfx, opc;
+
+    if (op == '=') {
+        gen_vmodrm(0, vec_aligned(vtop) ? 0x28 : 0x10, 1, vtop); /* movaps */
+    } else {
+        bt = vtop->type.ref->next->type.t & VT_BTYPE;
+        size = type_size(&vtop->type.ref->next->type, &align);
+        pfx = 0x66;
+        opc = 0;
+        if (bt == VT_FLOAT || bt == VT_DOUBLE) {
+            if (bt == VT_FLOAT)
+                pfx = 0;
+            switch(op) {
+            case '+': opc = 0x58; break; /* addp[sd] */
+            case '-': opc = 0x5c; break; /* subp[sd] */
+            case '*': opc = 0x59; break; /* mulp[sd] */
+            case '/': opc = 0x5e; break; /* divp[sd] */
+            }
+        } else {
+            switch(op) {
+            case '+': /* padd[bwdq] */
+                opc = size == 1 ? 0xfc : size == 2 ? 0xfd : size == 4 ? 0xfe : 0xd4;
+                break;
+            case '-': /* psub[bwdq] */
+                opc = size == 1 ? 0xf8 : size == 2 ? 0xf9 : size == 4 ? 0xfa : 0xfb;
+                break;
+            case '*':
+                if (size == 2)
+                    opc = 0xd5; /* pmullw */
+                else if (size == 4)
+                    opc = 0xf4; /* pmuludq, see below */
+                break;
+            case '&': opc = 0xdb; break; /* pand */
+            case '|': opc = 0xeb; break; /* por */
+            case '^': opc = 0xef; break; /* pxor */
+            }
+        }
+        if (!opc)
+            return 0;
+        gen_vmodrm(0, vec_aligned(vtop - 1) ? 0x28 : 0x10, 1, vtop - 1);
+        gen_vmodrm(0, vec_aligned(vtop) ? 0x28 : 0x10, 2, vtop);
+        if (opc == 0xf4) {
+            /* no pmulld in SSE2: multiply the even and the odd lanes
+               into quadwords and gather their low halves */
+            orv(0x66, 0x70, 0xd9); /* pshufd $0xf5, %xmm1, %xmm3 */
+            g(0xf5);
+            orv(0x66, 0x70, 0xe2); /* pshufd $0xf5, %xmm2, %xmm4 */
+            g(0xf5);
+            orv(0x66, 0xf4, 0xca); /* pmuludq %xmm2, %xmm1 */
+            orv(0x66, 0xf4, 0xdc); /* pmuludq %xmm4, %xmm3 */
+            orv(0x66, 0x70, 0xc9); /* pshufd $8, %xmm1, %xmm1 */
+            g(0x08);
+            orv(0x66, 0x70, 0xdb); /* pshufd $8, %xmm3, %xmm3 */
+            g(0x08);
+            orv(0x66, 0x62, 0xcb); /* punpckldq %xmm3, %xmm1 */
+        } else {
+            orv(pfx, opc, 0xca); /* op %xmm2, %xmm1 */
+        }
+    }
+    gen_vmodrm(0, vec_aligned(dest) ? 0x29 : 0x11, 1, dest); /* movaps */
+    return 1;
+}
+
+/* the register moved by gen_memmov() has no REX.R: not %r8 or %r9 */
+#define RC_MEMMOV (RC_RAX | RC_RCX | RC_RDX)
+
+/* emit the load (opc 0x8b) or the store (opc 0x89) of 'size' bytes
+   between register 'r' and 'off' bytes into the lvalue 'sv', a frame
+   slot or a pointer held in a register. 16 bytes go through %xmm1. */
+static void gen_memmov(int opc, int size, int r, SValue *sv, int off)
+{
+    int b, c, mod, n;
+
+    b = sv->r & VT_VALMASK;
+    c = off;
+    if (b == VT_LOCAL)
+        c += sv->c.ul;
+    mod = c == (char)c ? 0x40 : 0x80;
+    if (b != VT_LOCAL && !c)
+        mod = 0;
+    n = 2 + (size == 2 || size >= 8) + (size == 16) + (mod == 0x40) +
+        (mod == 0x80) * 4;
+#ifdef __native_client__
+    if (b != VT_LOCAL)
+        n += 4 + REX_BASE(b) - (size == 8);
+#endif
+    gp(n);
+    if (size == 2)
+        g(0x66);
+    if (size == 16) {
+        r = 1;
+        opc = opc == 0x8b ? 0x10 : 0x11; /* movups */
+    } else if (size == 1) {
+        opc--;
+    }
+    if (b == VT_LOCAL) {
+        if (size == 8)
+            g(0x48);
+        if (size == 16)
+            g(0x0f);
+        g(opc);
+        gen_modrm_impl(r, VT_LOCAL, NULL, c, 0);
+        return;
+    }
+#ifdef __native_client__
+    /* the address is %r15 + the zero extended 32 bit pointer */
+    if (REX_BASE(b))
+        g(0x45);
+    g(0x89); /* mov %e_b, %e_b */
+    g(0xc0 | REG_VALUE(b) * 9);
+    g(0x41 | (size == 8) << 3 | REX_BASE(b) << 1);
+    if (size == 16)
+        g(0x0f);
+    g(opc);
+    g(mod | r << 3 | 4);
+    g(REG_VALUE(b) << 3 | 7);
+#else
+    if (size == 8 || REX_BASE(b))
+        g(0x40 | (size == 8) << 3 | REX_BASE(b));
+    if (size == 16)
+        g(0x0f);
+    g(opc);
+    g(mod | r << 3 | REG_VALUE(b));
+#endif
+    if (mod == 0x40)
+        g(c);
+    else if (mod == 0x80)
+        gen_le32(c);
+}
+
+/* largest move for the 'n' remaining bytes of a copy */
+static int mem_chunk(int n)
+{
+    return n >= 16 ? 16 : n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+}
+
+#ifndef __native_client__
+/* load the address of the lvalue 'sv' into register 'r' */
+static void gen_memaddr(int r, SValue *sv)
+{
+    int b = sv->r & VT_VALMASK;
+
+    if (b == VT_LOCAL) {
+        o(0x8d48); /* lea */
+        gen_modrm_impl(r, VT_LOCAL, NULL, sv->c.ul, 0);
+    } else {
+        orex(1, r, b, 0x89); /* mov */
+        o(0xc0 | REG_VALUE(b) << 3 | REG_VALUE(r));
+    }
+}
+
+/* emit 'rep movsq' (op 0xa5) or 'rep stosq' (op 0xab) for 'size'
+   bytes, then the string moves of the 4, 2 and 1 byte tail */
+static void gen_memrep(int op, int size)
+{
+    save_reg(TREG_RCX);
+    oad(0xb9, size >> 3); /* mov $xxx, %ecx */
+    o(0x48f3);
+    o(op); /* rep movsq / stosq */
+    if (size & 4)
+        o(op);
+    if (size & 2)
+        o(0x66 | op << 8);
+    if (size & 1)
+        o(op - 1);
+}
+#endif
+
+/* memcpy() of 'size' bytes from the lvalue vtop to the lvalue
+   vtop[-1], both frame slots or pointers held in registers. Small
+   copies are unrolled, larger ones use 'rep movsq' */
+ST_FUNC int gen_memcpy(int size)
+{
+    int r, n, off;
+
+    if (size > tcc_state->inline_copy_limit) {
+#ifdef __native_client__
+        /* no string instructions in the sandbox */
+        return 0;
+#else
+        gen_memaddr(TREG_RSI, vtop);
+        gen_memaddr(TREG_RDI, vtop - 1);
+        gen_memrep(0xa5, size);
+        return 1;
+#endif
+    }
+    r = 0;
+    if (size & 15)
+        r = get_reg(RC_MEMMOV);
+    for (off = 0; off < size; off += n) {
+        n = mem_chunk(size - off);
+        gen_memmov(0x8b, n, r, vtop, off);
+        gen_memmov(0x89, n, r, vtop - 1, off);
+    }
+    return 1;
+}
+
+/* memset() of 'size' bytes of the lvalue vtop[-1] with the constant
+   byte vtop */
+ST_FUNC int gen_memset(int size)
+{
+    unsigned long long v;
+    int r, n, off;
+
+    v = (vtop->c.i & 0xff) * 0x0101010101010101ULL;
+    if (size > tcc_state->inline_copy_limit) {
+#ifdef __native_client__
+        return 0;
+#else
+        gen_memaddr(TREG_RDI, vtop - 1);
+        save_reg(TREG_RAX);
+        r = TREG_RAX;
+#endif
+    } else {
+        r = get_reg(RC_MEMMOV);
+    }
+    if (v) {
+        o(0xb848 + (r << 8)); /* mov $xxx, %r */
+        gen_le64(v);
+    } else {
+        o(0xc031 + r * 0x900); /* xor %r, %r */
+    }
+    if (size > tcc_state->inline_copy_limit) {
+#ifndef __native_client__
+        gen_memrep(0xab, size);
+#endif
+        return 1;
+    }
+    if (size >= 16) {
+        if (v) {
+            orv(0x66, 0x6e, 0xc8 | r); /* movd %r, %xmm1 */
+            orv(0x66, 0x70, 0xc9); /* pshufd $0, %xmm1, %xmm1 */
+            g(0x00);
+        } else {
+            orv(0x66, 0xef, 0xc9); /* pxor %xmm1, %xmm1 */
+        }
+    }
+    for (off = 0; off < size; off += n) {
+        n = mem_chunk(size - off);
+        gen_memmov(0x89, n, r, vtop - 1, off);
+    }
+    return 1;
+}
+
 /* convert integers to fp 't' type. Must handle 'int', 'unsigned int'
    and 'long long' cases. */
 void gen_cvt_itof(int t)
@@ -1798,6 +2543,18 @@ void gen_cvt_ftoi(int t)
 /* computed goto support */
 void ggoto(void)
 {
+#ifdef __native_client__
+    if ((vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST) {
+        load(TREG_R11, vtop);
+        /* nacljmp */
+        gp(10);
+        o(0xe0e38341); /* and $-32, %r11d */
+        o(0xfb014d); /* add %r15, %r11 */
+        o(0xe3ff41); /* jmp *%r11 */
+        vtop--;
+        return;
+    }
+#endif
     gcall_or_jmp(1);
     vtop--;
 }